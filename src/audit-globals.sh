@@ -33,10 +33,15 @@ sed '
   /^connections last_conn_serial$/d
   /^connections shutting_down$/d
   /^main allow_kq$/d
+  /^main n_workers$/d
+  /^main n_crypto_threads$/d
+  /^main crypto_offload_min$/d
   /^main the_event_base$/d
   /^main handle_signal_cb(int, short, void\*)::got_sigint$/d
   /^network listeners$/d
+  /^network workers$/d
   /^rng rng$/d
+  /^rng fast$/d
   /^util log_dest$/d
   /^util log_min_sev$/d
   /^util log_timestamps$/d
@@ -44,6 +49,12 @@ sed '
   /^util the_evdns_base$/d
   /^crypt log_crypto()::initialized$/d
   /^crypt init_crypto()::initialized$/d
+  /^cryptpool pool$/d
+  /^secmem arena$/d
+  /^steg\/embed embed_store$/d
+  /^steg\/payloads payload_store$/d
+  /^steg\/peernames peer_names$/d
+  /^steg\/peernames peer_name_cache::in_flight$/d
 
   # These are grandfathered; they need to be removed.
   /^steg\/payloads payload_count$/d
@@ -178,6 +178,29 @@ axe_timer_cb(evutil_socket_t, short, void *arg)
     delete ckt;
 }
 
+/* Stop reading from upstream while too much data is waiting to be
+   transmitted downstream, and start again once the protocol has
+   caught up.  (A read high-watermark on the bufferevent would do
+   this too, but some versions of libevent keep invoking the read
+   callback for as long as the watermark is reached.)  */
+
+static void
+upstream_input_cb(struct evbuffer *buf, const struct evbuffer_cb_info *,
+                  void *arg)
+{
+  circuit_t *ckt = (circuit_t *)arg;
+  if (evbuffer_get_length(buf) >= CIRCUIT_UP_READ_HIGH_WATER) {
+    if (!ckt->read_paused)
+      log_debug(ckt, "pausing upstream reads");
+    bufferevent_disable(ckt->up_buffer, EV_READ);
+    ckt->read_paused = true;
+  } else if (ckt->read_paused) {
+    log_debug(ckt, "resuming upstream reads");
+    bufferevent_enable(ckt->up_buffer, EV_READ);
+    ckt->read_paused = false;
+  }
+}
+
 circuit_t *
 circuit_create(config_t *cfg, size_t index)
 {
@@ -202,8 +225,11 @@ circuit_t::~circuit_t()
   log_debug(this, "closing circuit; %lu remaining",
             (unsigned long)circuits.size());
 
-  if (this->up_buffer)
+  if (this->up_buffer) {
+    evbuffer_remove_cb(bufferevent_get_input(this->up_buffer),
+                       upstream_input_cb, this);
     bufferevent_free(this->up_buffer);
+  }
   if (this->up_peer)
     free((void *)this->up_peer);
   if (this->socks_state)
@@ -222,6 +248,12 @@ circuit_t::cfg() const
   return 0;
 }
 
+int
+circuit_t::upstream_drained()
+{
+  return 0;
+}
+
 void
 circuit_add_upstream(circuit_t *ckt, struct bufferevent *buf, const char *peer)
 {
@@ -230,6 +262,9 @@ circuit_add_upstream(circuit_t *ckt, struct bufferevent *buf, const char *peer)
 
   ckt->up_buffer = buf;
   ckt->up_peer = peer;
+
+  evbuffer_add_cb(bufferevent_get_input(buf), upstream_input_cb, ckt);
+  bufferevent_setwatermark(buf, EV_WRITE, CIRCUIT_UP_WRITE_LOW_WATER, 0);
 }
 
 /* circuit_open_upstream is in network.c */
@@ -243,6 +278,15 @@ circuit_send(circuit_t *ckt)
   }
 }
 
+void
+circuit_upstream_drained(circuit_t *ckt)
+{
+  if (ckt->upstream_drained()) {
+    log_info(ckt, "error during transmit");
+    delete ckt;
+  }
+}
+
 void
 circuit_send_eof(circuit_t *ckt)
 {
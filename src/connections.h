@@ -73,6 +73,12 @@ struct conn_t {
       on this connection.  However, the peer may still send data back. */
   virtual void cease_transmission() = 0;
 
+  /** The cover protocol allows another round of transmission on this
+      connection (for instance, the next request on a persistent HTTP
+      connection), which it had held off until now.  Only valid if
+      cease_transmission has not been called.  */
+  virtual void resume_transmission() = 0;
+
   /** If TIMEOUT milliseconds elapse without anything having been
       transmitted on this connection, you need to make up some data
       and send it.  */
@@ -97,6 +103,16 @@ size_t conn_count(void);
 void conn_send_eof(conn_t *conn);
 void conn_do_flush(conn_t *conn);
 
+/** When running as several worker processes, report how many there
+    are, and which one this is (counting from zero). */
+unsigned int worker_count(void);
+unsigned int worker_index(void);
+
+/** Pass a newly accepted server connection, and the data already read
+    from it, to another worker process.  See network.cc. */
+int conn_hand_off(conn_t *conn, config_t *cfg, size_t index,
+                  unsigned int worker, struct evbuffer *prefix);
+
 /**
    This struct holds all the state for an "upstream" connection to the
    higher-level client or server that we are proxying traffic for. It
@@ -107,7 +123,16 @@ void conn_do_flush(conn_t *conn);
 
    Like conn_t, the protocol has an opportunity to add information to
    this structure, and will certainly add at least one conn_t pointer.
+
+   Each circuit stops reading from its upstream while more than
+   CIRCUIT_UP_READ_HIGH_WATER bytes are waiting to be transmitted
+   downstream, and is told (via |upstream_drained|) whenever the data
+   waiting to be written upstream falls to CIRCUIT_UP_WRITE_LOW_WATER
+   bytes or less, so that protocols can apply backpressure in both
+   directions.
  */
+const size_t CIRCUIT_UP_READ_HIGH_WATER = 256 * 1024;
+const size_t CIRCUIT_UP_WRITE_LOW_WATER = 64 * 1024;
 
 struct circuit_t {
   struct event       *flush_timer;
@@ -120,8 +145,10 @@ struct circuit_t {
   bool                connected : 1;
   bool                flushing : 1;
   bool                pending_eof : 1;
+  bool                read_paused : 1;
 
-  circuit_t() : connected(false), flushing(false), pending_eof(false) {}
+  circuit_t() : connected(false), flushing(false), pending_eof(false),
+                read_paused(false) {}
   virtual ~circuit_t();
 
   /** Return the configuration that this circuit belongs to. */
@@ -143,6 +170,14 @@ struct circuit_t {
       periodic "can we flush more data now?" callbacks, and |conn_t::recv|
       events won't do it, you have to set them up yourself. */
   virtual int send_eof() = 0;
+
+  /** The upstream peer has caught up with the data written to it: no
+      more than CIRCUIT_UP_WRITE_LOW_WATER bytes remain to be written.
+      Protocols that hold off their downstream peer while upstream is
+      slow can let it resume.  Returns 0 on success, -1 on failure.
+      NOTE: this is *not* a pure virtual method; the default does
+      nothing. */
+  virtual int upstream_drained();
 };
 
 circuit_t *circuit_create(config_t *cfg, size_t index);
@@ -156,6 +191,7 @@ void circuit_reopen_downstreams(circuit_t *ckt);
 void circuit_recv_eof(circuit_t *ckt);
 
 void circuit_send(circuit_t *ckt);
+void circuit_upstream_drained(circuit_t *ckt);
 void circuit_send_eof(circuit_t *ckt);
 
 void circuit_arm_flush_timer(circuit_t *ckt, unsigned int milliseconds);
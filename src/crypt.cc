@@ -4,7 +4,11 @@
 
 #include "util.h"
 #include "crypt.h"
+#include "secmem.h"
 
+#include <algorithm>
+
+#include <openssl/crypto.h>
 #include <openssl/engine.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
@@ -86,14 +90,16 @@ namespace {
   // loosely based on crypto++'s SecByteBlock
   class MemBlock {
   public:
-    explicit MemBlock(size_t l) : data(new uint8_t[l]), len(l)
-    { memset(data, 0, l); }
+    explicit MemBlock(size_t l)
+      : data((uint8_t *)secmem_alloc(l)), len(l)
+    {}
 
-    MemBlock(const uint8_t *d, size_t l) : data(new uint8_t[l]), len(l)
-    { if (d) memcpy(data, d, l); else memset(data, 0, l); }
+    MemBlock(const uint8_t *d, size_t l)
+      : data((uint8_t *)secmem_alloc(l)), len(l)
+    { if (d) memcpy(data, d, l); }
 
     ~MemBlock()
-    { memset(data, 0, len); delete [] data; }
+    { secmem_free(data, len); }
 
     operator const void*() const
     { return data; }
@@ -124,7 +130,7 @@ namespace {
     size_t len;
   };
 
-  struct ecb_encryptor_impl : ecb_encryptor
+  struct ecb_encryptor_impl : ecb_encryptor, secmem_object
   {
     EVP_CIPHER_CTX ctx;
     ecb_encryptor_impl() { EVP_CIPHER_CTX_init(&ctx); }
@@ -132,7 +138,7 @@ namespace {
     virtual void encrypt(uint8_t *out, const uint8_t *in);
   };
 
-  struct ecb_decryptor_impl : ecb_decryptor
+  struct ecb_decryptor_impl : ecb_decryptor, secmem_object
   {
     EVP_CIPHER_CTX ctx;
     ecb_decryptor_impl() { EVP_CIPHER_CTX_init(&ctx); }
@@ -232,22 +238,43 @@ ecb_decryptor_impl::decrypt(uint8_t *out, const uint8_t *in)
 }
 
 namespace {
-  struct gcm_encryptor_impl : gcm_encryptor
+  struct gcm_encryptor_impl : gcm_encryptor, secmem_object
   {
     EVP_CIPHER_CTX ctx;
     gcm_encryptor_impl() { EVP_CIPHER_CTX_init(&ctx); }
     virtual ~gcm_encryptor_impl();
     virtual void encrypt(uint8_t *out, const uint8_t *in, size_t inlen,
                          const uint8_t *nonce, size_t nlen);
+    virtual void encrypt(uint8_t *out,
+                         const struct evbuffer_iovec *in, size_t nin,
+                         size_t padlen,
+                         const uint8_t *nonce, size_t nlen);
+    virtual void encrypt(const struct evbuffer_iovec *out, size_t nout,
+                         const struct evbuffer_iovec *in, size_t nin,
+                         uint8_t *tag,
+                         const uint8_t *nonce, size_t nlen);
+
+    void begin(const uint8_t *nonce, size_t nlen);
+    void finish(uint8_t *tag);
   };
 
-  struct gcm_decryptor_impl : gcm_decryptor
+  struct gcm_decryptor_impl : gcm_decryptor, secmem_object
   {
     EVP_CIPHER_CTX ctx;
     gcm_decryptor_impl() { EVP_CIPHER_CTX_init(&ctx); }
     virtual ~gcm_decryptor_impl();
     virtual int decrypt(uint8_t *out, const uint8_t *in, size_t inlen,
                         const uint8_t *nonce, size_t nlen);
+    virtual int decrypt(const struct evbuffer_iovec *segs, size_t nsegs,
+                        const uint8_t *tag,
+                        const uint8_t *nonce, size_t nlen);
+    virtual int decrypt(const struct evbuffer_iovec *out, size_t nout,
+                        const struct evbuffer_iovec *in, size_t nin,
+                        const uint8_t *tag,
+                        const uint8_t *nonce, size_t nlen);
+
+    int begin(const uint8_t *tag, const uint8_t *nonce, size_t nlen);
+    int finish();
   };
 }
 
@@ -331,12 +358,46 @@ gcm_decryptor::~gcm_decryptor() {}
 gcm_decryptor_impl::~gcm_decryptor_impl()
 { EVP_CIPHER_CTX_cleanup(&ctx); }
 
-void
-gcm_encryptor_impl::encrypt(uint8_t *out, const uint8_t *in, size_t inlen,
-                            const uint8_t *nonce, size_t nlen)
+// Run the cipher over the concatenation of the segments IN, writing
+// the result across the segments OUT.  Each call to EVP_CipherUpdate
+// covers as much as possible of the current input segment and the
+// current output segment; GCM does not care where the pieces break.
+// Empty segments are skipped.  Returns false on failure.
+static bool
+cipher_update_scattered(EVP_CIPHER_CTX *ctx,
+                        const struct evbuffer_iovec *out, size_t nout,
+                        const struct evbuffer_iovec *in, size_t nin)
 {
-  log_assert(inlen <= size_t(INT_MAX));
+  size_t i = 0, ioff = 0, o = 0, ooff = 0;
+  for (;;) {
+    while (i < nin && ioff == in[i].iov_len)
+      i++, ioff = 0;
+    while (o < nout && ooff == out[o].iov_len)
+      o++, ooff = 0;
+    if (i == nin || o == nout)
+      break;
+
+    size_t n = std::min(in[i].iov_len - ioff, out[o].iov_len - ooff);
+    if (n > size_t(INT_MAX))
+      n = INT_MAX;
+
+    int olen;
+    if (!EVP_CipherUpdate(ctx, (uint8_t *)out[o].iov_base + ooff, &olen,
+                          (const uint8_t *)in[i].iov_base + ioff, n) ||
+        size_t(olen) != n)
+      return false;
+    ioff += n;
+    ooff += n;
+  }
 
+  // Both sides must run out together.
+  log_assert(i == nin && o == nout);
+  return true;
+}
+
+void
+gcm_encryptor_impl::begin(const uint8_t *nonce, size_t nlen)
+{
   if (nlen != size_t(EVP_CIPHER_CTX_iv_length(&ctx)))
     if (!EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_SET_IVLEN, nlen, 0))
       log_crypto_abort("gcm_encryptor::reset nonce length");
@@ -347,23 +408,85 @@ gcm_encryptor_impl::encrypt(uint8_t *out, const uint8_t *in, size_t inlen,
   int olen;
   if (!EVP_EncryptUpdate(&ctx, 0, &olen, (const uint8_t *)"", 0) || olen != 0)
     log_crypto_abort("gcm_encryptor::set null AAD");
+}
 
-  if (!EVP_EncryptUpdate(&ctx, out, &olen, in, inlen) || size_t(olen) != inlen)
-    log_crypto_abort("gcm_encryptor::encrypt");
-
-  if (!EVP_EncryptFinal_ex(&ctx, out + inlen, &olen) || olen != 0)
+void
+gcm_encryptor_impl::finish(uint8_t *tag)
+{
+  int olen;
+  if (!EVP_EncryptFinal_ex(&ctx, tag, &olen) || olen != 0)
     log_crypto_abort("gcm_encryptor::finalize");
 
-  if (!EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_GET_TAG, 16, out + inlen))
+  if (!EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_GET_TAG, 16, tag))
     log_crypto_abort("gcm_encryptor::write tag");
 }
 
-int
-gcm_decryptor_impl::decrypt(uint8_t *out, const uint8_t *in, size_t inlen,
+void
+gcm_encryptor_impl::encrypt(uint8_t *out, const uint8_t *in, size_t inlen,
                             const uint8_t *nonce, size_t nlen)
 {
   log_assert(inlen <= size_t(INT_MAX));
 
+  begin(nonce, nlen);
+
+  int olen;
+  if (!EVP_EncryptUpdate(&ctx, out, &olen, in, inlen) || size_t(olen) != inlen)
+    log_crypto_abort("gcm_encryptor::encrypt");
+
+  finish(out + inlen);
+}
+
+void
+gcm_encryptor_impl::encrypt(uint8_t *out,
+                            const struct evbuffer_iovec *in, size_t nin,
+                            size_t padlen,
+                            const uint8_t *nonce, size_t nlen)
+{
+  log_assert(padlen <= size_t(INT_MAX));
+
+  begin(nonce, nlen);
+
+  int olen;
+  for (size_t i = 0; i < nin; i++) {
+    size_t seglen = in[i].iov_len;
+    log_assert(seglen <= size_t(INT_MAX));
+    if (!EVP_EncryptUpdate(&ctx, out, &olen,
+                           (const uint8_t *)in[i].iov_base, seglen) ||
+        size_t(olen) != seglen)
+      log_crypto_abort("gcm_encryptor::encrypt segment");
+    out += seglen;
+  }
+
+  // GCM is happy to encrypt in place, so zero the padding where it
+  // will end up and encrypt it there, rather than needing a separate
+  // buffer full of zeroes.
+  if (padlen) {
+    memset(out, 0, padlen);
+    if (!EVP_EncryptUpdate(&ctx, out, &olen, out, padlen) ||
+        size_t(olen) != padlen)
+      log_crypto_abort("gcm_encryptor::encrypt padding");
+    out += padlen;
+  }
+
+  finish(out);
+}
+
+void
+gcm_encryptor_impl::encrypt(const struct evbuffer_iovec *out, size_t nout,
+                            const struct evbuffer_iovec *in, size_t nin,
+                            uint8_t *tag,
+                            const uint8_t *nonce, size_t nlen)
+{
+  begin(nonce, nlen);
+  if (!cipher_update_scattered(&ctx, out, nout, in, nin))
+    log_crypto_abort("gcm_encryptor::encrypt segment");
+  finish(tag);
+}
+
+int
+gcm_decryptor_impl::begin(const uint8_t *tag,
+                          const uint8_t *nonce, size_t nlen)
+{
   if (nlen != size_t(EVP_CIPHER_CTX_iv_length(&ctx)))
     if (!EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_SET_IVLEN, nlen, 0))
       log_crypto_abort("gcm_decryptor::reset nonce length");
@@ -371,26 +494,703 @@ gcm_decryptor_impl::decrypt(uint8_t *out, const uint8_t *in, size_t inlen,
   if (!EVP_DecryptInit_ex(&ctx, 0, 0, 0, nonce))
     return log_crypto_warn("gcm_decryptor::set nonce");
 
-  if (!EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_SET_TAG, 16,
-                           (void *)(in + inlen - 16)))
+  if (!EVP_CIPHER_CTX_ctrl(&ctx, EVP_CTRL_GCM_SET_TAG, 16, (void *)tag))
     return log_crypto_warn("gcm_decryptor::set tag");
 
   int olen;
   if (!EVP_DecryptUpdate(&ctx, 0, &olen, (const uint8_t *)"", 0) || olen != 0)
     return log_crypto_warn("gcm_decryptor::set null AAD");
 
+  return 0;
+}
+
+int
+gcm_decryptor_impl::finish()
+{
+  // GCM never produces output at this point, but EVP wants somewhere
+  // to put it anyway.
+  uint8_t dummy[AES_BLOCK_LEN];
+  int olen;
+  if (!EVP_DecryptFinal_ex(&ctx, dummy, &olen) || olen != 0)
+    return log_crypto_warn("gcm_decryptor::check tag");
+
+  return 0;
+}
+
+int
+gcm_decryptor_impl::decrypt(uint8_t *out, const uint8_t *in, size_t inlen,
+                            const uint8_t *nonce, size_t nlen)
+{
+  log_assert(inlen <= size_t(INT_MAX));
+
+  if (begin(in + inlen - 16, nonce, nlen))
+    return -1;
+
+  int olen;
   inlen -= 16;
   if (!EVP_DecryptUpdate(&ctx, out, &olen, in, inlen) || size_t(olen) != inlen)
     return log_crypto_warn("gcm_encryptor::decrypt");
 
-  if (!EVP_DecryptFinal_ex(&ctx, out + inlen, &olen) || olen != 0)
-    return log_crypto_warn("gcm_decryptor::check tag");
+  return finish();
+}
+
+int
+gcm_decryptor_impl::decrypt(const struct evbuffer_iovec *segs, size_t nsegs,
+                            const uint8_t *tag,
+                            const uint8_t *nonce, size_t nlen)
+{
+  return decrypt(segs, nsegs, segs, nsegs, tag, nonce, nlen);
+}
+
+int
+gcm_decryptor_impl::decrypt(const struct evbuffer_iovec *out, size_t nout,
+                            const struct evbuffer_iovec *in, size_t nin,
+                            const uint8_t *tag,
+                            const uint8_t *nonce, size_t nlen)
+{
+  if (begin(tag, nonce, nlen))
+    return -1;
+
+  if (!cipher_update_scattered(&ctx, out, nout, in, nin))
+    return log_crypto_warn("gcm_decryptor::decrypt segment");
+
+  return finish();
+}
+
+// The ChaCha20-Poly1305 suite: ChaCha20 and Poly1305 as specified in
+// RFC 7539, and SipHash-2-4 for the header permutation.  OpenSSL only
+// gained ChaCha20 and Poly1305 in 1.1.0, and the hosts that most need
+// them (no AES instructions) are also the ones most likely to have an
+// old OpenSSL, so we carry a portable implementation of our own.  All
+// three are naturally constant-time in this form; the only comparison
+// of secret data is the tag check, which uses CRYPTO_memcmp.
+
+namespace {
+  const size_t CHACHA_KEY_LEN   = 32;
+  const size_t CHACHA_NONCE_LEN = 12;
+  const size_t CHACHA_BLOCK_LEN = 64;
+  const size_t POLY1305_KEY_LEN = 32;
+  const size_t POLY1305_TAG_LEN = 16;
+
+  inline uint32_t
+  load32_le(const uint8_t *p)
+  {
+    return (uint32_t(p[0])       | (uint32_t(p[1]) <<  8) |
+            (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24));
+  }
+
+  inline void
+  store32_le(uint8_t *p, uint32_t v)
+  {
+    p[0] = uint8_t(v);
+    p[1] = uint8_t(v >> 8);
+    p[2] = uint8_t(v >> 16);
+    p[3] = uint8_t(v >> 24);
+  }
+
+  inline uint32_t
+  rotl32(uint32_t v, int c)
+  {
+    return (v << c) | (v >> (32 - c));
+  }
+
+  // OUT = IN ^ KS, for N bytes, a word at a time where possible.
+  inline void
+  xor_bytes(uint8_t *out, const uint8_t *in, const uint8_t *ks, size_t n)
+  {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+      uint64_t a, b;
+      memcpy(&a, in + i, 8);
+      memcpy(&b, ks + i, 8);
+      a ^= b;
+      memcpy(out + i, &a, 8);
+    }
+    for (; i < n; i++)
+      out[i] = in[i] ^ ks[i];
+  }
+
+  // Set up the ChaCha20 input block for KEY, block COUNTER, and the
+  // CHACHA_NONCE_LEN-byte NONCE.
+  void
+  chacha20_init(uint32_t st[16], const uint8_t *key, uint32_t counter,
+                const uint8_t *nonce)
+  {
+    st[0] = 0x61707865;
+    st[1] = 0x3320646e;
+    st[2] = 0x79622d32;
+    st[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++)
+      st[4 + i] = load32_le(key + 4*i);
+    st[12] = counter;
+    st[13] = load32_le(nonce);
+    st[14] = load32_le(nonce + 4);
+    st[15] = load32_le(nonce + 8);
+  }
+
+#define CHACHA_QR(a, b, c, d)                   \
+  a += b; d ^= a; d = rotl32(d, 16);            \
+  c += d; b ^= c; b = rotl32(b, 12);            \
+  a += b; d ^= a; d = rotl32(d,  8);            \
+  c += d; b ^= c; b = rotl32(b,  7)
 
+  // Write the CHACHA_BLOCK_LEN bytes of keystream for input block ST.
+  void
+  chacha20_block(uint8_t *out, const uint32_t st[16])
+  {
+    uint32_t x[16];
+    memcpy(x, st, sizeof x);
+    for (int i = 0; i < 10; i++) {
+      CHACHA_QR(x[0], x[4], x[ 8], x[12]);
+      CHACHA_QR(x[1], x[5], x[ 9], x[13]);
+      CHACHA_QR(x[2], x[6], x[10], x[14]);
+      CHACHA_QR(x[3], x[7], x[11], x[15]);
+      CHACHA_QR(x[0], x[5], x[10], x[15]);
+      CHACHA_QR(x[1], x[6], x[11], x[12]);
+      CHACHA_QR(x[2], x[7], x[ 8], x[13]);
+      CHACHA_QR(x[3], x[4], x[ 9], x[14]);
+    }
+    for (int i = 0; i < 16; i++)
+      store32_le(out + 4*i, x[i] + st[i]);
+    memset(x, 0, sizeof x);
+  }
+
+#undef CHACHA_QR
+
+  // Poly1305 with 26-bit limbs, so that all products fit in 64 bits
+  // even on 32-bit hosts.  After poly1305-donna.
+  struct poly1305
+  {
+    uint32_t r[5], h[5], pad[4];
+    uint8_t buf[16];
+    size_t nbuf;
+
+    void init(const uint8_t *key);
+    void update(const uint8_t *m, size_t n);
+    void pad16();
+    void finish(uint8_t *tag);
+    void blocks(const uint8_t *m, size_t n, uint32_t hibit);
+  };
+
+  void
+  poly1305::init(const uint8_t *key)
+  {
+    r[0] = (load32_le(key +  0)     ) & 0x3ffffff;
+    r[1] = (load32_le(key +  3) >> 2) & 0x3ffff03;
+    r[2] = (load32_le(key +  6) >> 4) & 0x3ffc0ff;
+    r[3] = (load32_le(key +  9) >> 6) & 0x3f03fff;
+    r[4] = (load32_le(key + 12) >> 8) & 0x00fffff;
+    for (int i = 0; i < 5; i++)
+      h[i] = 0;
+    for (int i = 0; i < 4; i++)
+      pad[i] = load32_le(key + 16 + 4*i);
+    nbuf = 0;
+  }
+
+  // Absorb N bytes (a multiple of 16) from M.  HIBIT is 1<<24 for
+  // full blocks, 0 for the final partial block, which the caller has
+  // already terminated with a 1 byte.
+  void
+  poly1305::blocks(const uint8_t *m, size_t n, uint32_t hibit)
+  {
+    const uint32_t r0 = r[0], r1 = r[1], r2 = r[2], r3 = r[3], r4 = r[4];
+    const uint32_t s1 = r1*5, s2 = r2*5, s3 = r3*5, s4 = r4*5;
+    uint32_t h0 = h[0], h1 = h[1], h2 = h[2], h3 = h[3], h4 = h[4];
+
+    for (; n >= 16; m += 16, n -= 16) {
+      h0 += (load32_le(m +  0)     ) & 0x3ffffff;
+      h1 += (load32_le(m +  3) >> 2) & 0x3ffffff;
+      h2 += (load32_le(m +  6) >> 4) & 0x3ffffff;
+      h3 += (load32_le(m +  9) >> 6) & 0x3ffffff;
+      h4 += (load32_le(m + 12) >> 8) | hibit;
+
+      uint64_t d0 = (uint64_t(h0)*r0 + uint64_t(h1)*s4 + uint64_t(h2)*s3 +
+                     uint64_t(h3)*s2 + uint64_t(h4)*s1);
+      uint64_t d1 = (uint64_t(h0)*r1 + uint64_t(h1)*r0 + uint64_t(h2)*s4 +
+                     uint64_t(h3)*s3 + uint64_t(h4)*s2);
+      uint64_t d2 = (uint64_t(h0)*r2 + uint64_t(h1)*r1 + uint64_t(h2)*r0 +
+                     uint64_t(h3)*s4 + uint64_t(h4)*s3);
+      uint64_t d3 = (uint64_t(h0)*r3 + uint64_t(h1)*r2 + uint64_t(h2)*r1 +
+                     uint64_t(h3)*r0 + uint64_t(h4)*s4);
+      uint64_t d4 = (uint64_t(h0)*r4 + uint64_t(h1)*r3 + uint64_t(h2)*r2 +
+                     uint64_t(h3)*r1 + uint64_t(h4)*r0);
+
+      uint32_t c;
+      c = uint32_t(d0 >> 26); h0 = uint32_t(d0) & 0x3ffffff;
+      d1 += c; c = uint32_t(d1 >> 26); h1 = uint32_t(d1) & 0x3ffffff;
+      d2 += c; c = uint32_t(d2 >> 26); h2 = uint32_t(d2) & 0x3ffffff;
+      d3 += c; c = uint32_t(d3 >> 26); h3 = uint32_t(d3) & 0x3ffffff;
+      d4 += c; c = uint32_t(d4 >> 26); h4 = uint32_t(d4) & 0x3ffffff;
+      h0 += c*5; c = h0 >> 26; h0 &= 0x3ffffff;
+      h1 += c;
+    }
+
+    h[0] = h0; h[1] = h1; h[2] = h2; h[3] = h3; h[4] = h4;
+  }
+
+  void
+  poly1305::update(const uint8_t *m, size_t n)
+  {
+    if (nbuf) {
+      size_t k = std::min(n, 16 - nbuf);
+      memcpy(buf + nbuf, m, k);
+      nbuf += k;
+      m += k;
+      n -= k;
+      if (nbuf < 16)
+        return;
+      blocks(buf, 16, 1 << 24);
+      nbuf = 0;
+    }
+
+    size_t full = n & ~size_t(15);
+    if (full) {
+      blocks(m, full, 1 << 24);
+      m += full;
+      n -= full;
+    }
+
+    if (n) {
+      memcpy(buf, m, n);
+      nbuf = n;
+    }
+  }
+
+  // Zero-pad what has been absorbed so far to a multiple of 16 bytes,
+  // as the AEAD construction requires between its sections.
+  void
+  poly1305::pad16()
+  {
+    if (nbuf) {
+      memset(buf + nbuf, 0, 16 - nbuf);
+      blocks(buf, 16, 1 << 24);
+      nbuf = 0;
+    }
+  }
+
+  void
+  poly1305::finish(uint8_t *tag)
+  {
+    if (nbuf) {
+      buf[nbuf++] = 1;
+      memset(buf + nbuf, 0, 16 - nbuf);
+      blocks(buf, 16, 0);
+      nbuf = 0;
+    }
+
+    // Fully carry h.
+    uint32_t h0 = h[0], h1 = h[1], h2 = h[2], h3 = h[3], h4 = h[4], c;
+                 c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c;     c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c;     c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c;     c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c*5;   c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    // Compute h - p, and keep it instead of h if it did not borrow.
+    uint32_t g0, g1, g2, g3, g4;
+    g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    g4 = h4 + c - (1 << 26);
+
+    uint32_t mask = (g4 >> 31) - 1;
+    g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+    mask = ~mask;
+    h0 = (h0 & mask) | g0;
+    h1 = (h1 & mask) | g1;
+    h2 = (h2 & mask) | g2;
+    h3 = (h3 & mask) | g3;
+    h4 = (h4 & mask) | g4;
+
+    // h mod 2^128, plus the pad.
+    h0 = (h0      ) | (h1 << 26);
+    h1 = (h1 >>  6) | (h2 << 20);
+    h2 = (h2 >> 12) | (h3 << 14);
+    h3 = (h3 >> 18) | (h4 <<  8);
+
+    uint64_t f;
+    f = uint64_t(h0) + pad[0];             store32_le(tag +  0, uint32_t(f));
+    f = uint64_t(h1) + pad[1] + (f >> 32); store32_le(tag +  4, uint32_t(f));
+    f = uint64_t(h2) + pad[2] + (f >> 32); store32_le(tag +  8, uint32_t(f));
+    f = uint64_t(h3) + pad[3] + (f >> 32); store32_le(tag + 12, uint32_t(f));
+
+    memset(this, 0, sizeof *this);
+  }
+
+  // The ChaCha20-Poly1305 AEAD construction, with no associated data,
+  // taking its input in pieces.  Shared by the encryptor and the
+  // decryptor; the only difference is whether the MAC is computed
+  // over the output or the input.
+  struct chacha20_poly1305
+  {
+    uint8_t key[CHACHA_KEY_LEN];
+    uint32_t st[16];
+    uint8_t ks[CHACHA_BLOCK_LEN];
+    size_t ks_used;
+    uint64_t ctlen;
+    poly1305 mac;
+
+    chacha20_poly1305(const uint8_t *k)
+    { memcpy(key, k, sizeof key); }
+    ~chacha20_poly1305()
+    {
+      memset(key, 0, sizeof key);
+      memset(st, 0, sizeof st);
+      memset(ks, 0, sizeof ks);
+    }
+
+    void begin(const uint8_t *nonce, size_t nlen);
+    void update(uint8_t *out, const uint8_t *in, size_t n, bool encrypting);
+    void finish(uint8_t *tag);
+  };
+
+  void
+  chacha20_poly1305::begin(const uint8_t *nonce, size_t nlen)
+  {
+    log_assert(nlen >= CHACHA_NONCE_LEN);
+    uint8_t n12[CHACHA_NONCE_LEN];
+    memcpy(n12, nonce, CHACHA_NONCE_LEN);
+    for (size_t i = CHACHA_NONCE_LEN; i < nlen; i++)
+      n12[i % CHACHA_NONCE_LEN] ^= nonce[i];
+
+    // Block 0 supplies the one-time Poly1305 key; the message is
+    // encrypted starting with block 1.
+    chacha20_init(st, key, 0, n12);
+    chacha20_block(ks, st);
+    mac.init(ks);
+    st[12] = 1;
+    ks_used = CHACHA_BLOCK_LEN;
+    ctlen = 0;
+  }
+
+  void
+  chacha20_poly1305::update(uint8_t *out, const uint8_t *in, size_t n,
+                            bool encrypting)
+  {
+    // 'in' and 'out' may be the same, so the decryptor must MAC the
+    // ciphertext before overwriting it.
+    if (!encrypting)
+      mac.update(in, n);
+    ctlen += n;
+
+    uint8_t *const start = out;
+    const size_t total = n;
+
+    // Use up any keystream left over from the previous call.
+    size_t k = std::min(n, CHACHA_BLOCK_LEN - ks_used);
+    xor_bytes(out, in, ks + ks_used, k);
+    ks_used += k;
+    in += k;
+    out += k;
+    n -= k;
+
+    // Whole blocks.
+    while (n >= CHACHA_BLOCK_LEN) {
+      chacha20_block(ks, st);
+      st[12]++;
+      xor_bytes(out, in, ks, CHACHA_BLOCK_LEN);
+      in += CHACHA_BLOCK_LEN;
+      out += CHACHA_BLOCK_LEN;
+      n -= CHACHA_BLOCK_LEN;
+    }
+
+    // A final partial block; keep the rest of its keystream.
+    if (n) {
+      chacha20_block(ks, st);
+      st[12]++;
+      xor_bytes(out, in, ks, n);
+      ks_used = n;
+    }
+
+    if (encrypting)
+      mac.update(start, total);
+  }
+
+  void
+  chacha20_poly1305::finish(uint8_t *tag)
+  {
+    uint8_t lens[16];
+    mac.pad16();
+    store32_le(lens +  0, 0);  // associated data length
+    store32_le(lens +  4, 0);
+    store32_le(lens +  8, uint32_t(ctlen));
+    store32_le(lens + 12, uint32_t(ctlen >> 32));
+    mac.update(lens, sizeof lens);
+    mac.finish(tag);
+    memset(ks, 0, sizeof ks);
+  }
+
+  struct chacha_aead_encryptor_impl : gcm_encryptor, secmem_object
+  {
+    chacha20_poly1305 aead;
+    chacha_aead_encryptor_impl(const uint8_t *key) : aead(key) {}
+    virtual ~chacha_aead_encryptor_impl();
+    virtual void encrypt(uint8_t *out, const uint8_t *in, size_t inlen,
+                         const uint8_t *nonce, size_t nlen);
+    virtual void encrypt(uint8_t *out,
+                         const struct evbuffer_iovec *in, size_t nin,
+                         size_t padlen,
+                         const uint8_t *nonce, size_t nlen);
+    virtual void encrypt(const struct evbuffer_iovec *out, size_t nout,
+                         const struct evbuffer_iovec *in, size_t nin,
+                         uint8_t *tag,
+                         const uint8_t *nonce, size_t nlen);
+  };
+
+  struct chacha_aead_decryptor_impl : gcm_decryptor, secmem_object
+  {
+    chacha20_poly1305 aead;
+    chacha_aead_decryptor_impl(const uint8_t *key) : aead(key) {}
+    virtual ~chacha_aead_decryptor_impl();
+    virtual int decrypt(uint8_t *out, const uint8_t *in, size_t inlen,
+                        const uint8_t *nonce, size_t nlen);
+    virtual int decrypt(const struct evbuffer_iovec *segs, size_t nsegs,
+                        const uint8_t *tag,
+                        const uint8_t *nonce, size_t nlen);
+    virtual int decrypt(const struct evbuffer_iovec *out, size_t nout,
+                        const struct evbuffer_iovec *in, size_t nin,
+                        const uint8_t *tag,
+                        const uint8_t *nonce, size_t nlen);
+
+    int check(const uint8_t *tag);
+  };
+}
+
+chacha_aead_encryptor_impl::~chacha_aead_encryptor_impl() {}
+chacha_aead_decryptor_impl::~chacha_aead_decryptor_impl() {}
+
+void
+chacha_aead_encryptor_impl::encrypt(uint8_t *out,
+                                   const uint8_t *in, size_t inlen,
+                                   const uint8_t *nonce, size_t nlen)
+{
+  aead.begin(nonce, nlen);
+  aead.update(out, in, inlen, true);
+  aead.finish(out + inlen);
+}
+
+void
+chacha_aead_encryptor_impl::encrypt(uint8_t *out,
+                                   const struct evbuffer_iovec *in,
+                                   size_t nin, size_t padlen,
+                                   const uint8_t *nonce, size_t nlen)
+{
+  aead.begin(nonce, nlen);
+  for (size_t i = 0; i < nin; i++) {
+    aead.update(out, (const uint8_t *)in[i].iov_base, in[i].iov_len, true);
+    out += in[i].iov_len;
+  }
+  if (padlen) {
+    memset(out, 0, padlen);
+    aead.update(out, out, padlen, true);
+    out += padlen;
+  }
+  aead.finish(out);
+}
+
+void
+chacha_aead_encryptor_impl::encrypt(const struct evbuffer_iovec *out,
+                                   size_t nout,
+                                   const struct evbuffer_iovec *in,
+                                   size_t nin, uint8_t *tag,
+                                   const uint8_t *nonce, size_t nlen)
+{
+  aead.begin(nonce, nlen);
+  size_t i = 0, ioff = 0, o = 0, ooff = 0;
+  for (;;) {
+    while (i < nin && ioff == in[i].iov_len)
+      i++, ioff = 0;
+    while (o < nout && ooff == out[o].iov_len)
+      o++, ooff = 0;
+    if (i == nin || o == nout)
+      break;
+
+    size_t n = std::min(in[i].iov_len - ioff, out[o].iov_len - ooff);
+    aead.update((uint8_t *)out[o].iov_base + ooff,
+                (const uint8_t *)in[i].iov_base + ioff, n, true);
+    ioff += n;
+    ooff += n;
+  }
+  log_assert(i == nin && o == nout);
+  aead.finish(tag);
+}
+
+int
+chacha_aead_decryptor_impl::check(const uint8_t *tag)
+{
+  uint8_t computed[POLY1305_TAG_LEN];
+  aead.finish(computed);
+  int bad = CRYPTO_memcmp(computed, tag, sizeof computed);
+  memset(computed, 0, sizeof computed);
+  if (bad) {
+    log_warn("chacha20-poly1305: authentication tag mismatch");
+    return -1;
+  }
   return 0;
 }
 
+int
+chacha_aead_decryptor_impl::decrypt(uint8_t *out,
+                                   const uint8_t *in, size_t inlen,
+                                   const uint8_t *nonce, size_t nlen)
+{
+  if (inlen < POLY1305_TAG_LEN)
+    return -1;
+  inlen -= POLY1305_TAG_LEN;
+  aead.begin(nonce, nlen);
+  aead.update(out, in, inlen, false);
+  return check(in + inlen);
+}
+
+int
+chacha_aead_decryptor_impl::decrypt(const struct evbuffer_iovec *segs,
+                                   size_t nsegs, const uint8_t *tag,
+                                   const uint8_t *nonce, size_t nlen)
+{
+  return decrypt(segs, nsegs, segs, nsegs, tag, nonce, nlen);
+}
+
+int
+chacha_aead_decryptor_impl::decrypt(const struct evbuffer_iovec *out,
+                                   size_t nout,
+                                   const struct evbuffer_iovec *in,
+                                   size_t nin, const uint8_t *tag,
+                                   const uint8_t *nonce, size_t nlen)
+{
+  aead.begin(nonce, nlen);
+  size_t i = 0, ioff = 0, o = 0, ooff = 0;
+  for (;;) {
+    while (i < nin && ioff == in[i].iov_len)
+      i++, ioff = 0;
+    while (o < nout && ooff == out[o].iov_len)
+      o++, ooff = 0;
+    if (i == nin || o == nout)
+      break;
+
+    size_t n = std::min(in[i].iov_len - ioff, out[o].iov_len - ooff);
+    aead.update((uint8_t *)out[o].iov_base + ooff,
+                (const uint8_t *)in[i].iov_base + ioff, n, false);
+    ioff += n;
+    ooff += n;
+  }
+  log_assert(i == nin && o == nout);
+  return check(tag);
+}
+
+// Cipher suites
+
+int
+cipher_suite_by_name(const char *name, cipher_suite *suite)
+{
+  if (!strcmp(name, "aes128-gcm"))
+    *suite = CIPHER_AES128_GCM;
+  else if (!strcmp(name, "chacha20-poly1305"))
+    *suite = CIPHER_CHACHA20_POLY1305;
+  else
+    return -1;
+  return 0;
+}
+
+const char *
+cipher_suite_name(cipher_suite suite)
+{
+  switch (suite) {
+  case CIPHER_AES128_GCM:        return "aes128-gcm";
+  case CIPHER_CHACHA20_POLY1305: return "chacha20-poly1305";
+  }
+  log_abort("unknown cipher suite %d", int(suite));
+}
+
+size_t
+cipher_suite_key_len(cipher_suite suite)
+{
+  switch (suite) {
+  case CIPHER_AES128_GCM:        return 16;
+  case CIPHER_CHACHA20_POLY1305: return CHACHA_KEY_LEN;
+  }
+  log_abort("unknown cipher suite %d", int(suite));
+}
+
+ecb_encryptor *
+ecb_encryptor::create(cipher_suite suite, const uint8_t *key, size_t keylen)
+{
+  // Every suite encrypts headers with AES; the ChaCha20 suite's
+  // 32-byte keys make that AES-256.
+  log_assert(keylen == cipher_suite_key_len(suite));
+  return create(key, keylen);
+}
+
+ecb_decryptor *
+ecb_decryptor::create(cipher_suite suite, const uint8_t *key, size_t keylen)
+{
+  // Every suite encrypts headers with AES; the ChaCha20 suite's
+  // 32-byte keys make that AES-256.
+  log_assert(keylen == cipher_suite_key_len(suite));
+  return create(key, keylen);
+}
+
+gcm_encryptor *
+gcm_encryptor::create(cipher_suite suite, const uint8_t *key, size_t keylen)
+{
+  log_assert(keylen == cipher_suite_key_len(suite));
+  if (suite == CIPHER_CHACHA20_POLY1305)
+    return new chacha_aead_encryptor_impl(key);
+  return create(key, keylen);
+}
+
+gcm_decryptor *
+gcm_decryptor::create(cipher_suite suite, const uint8_t *key, size_t keylen)
+{
+  log_assert(keylen == cipher_suite_key_len(suite));
+  if (suite == CIPHER_CHACHA20_POLY1305)
+    return new chacha_aead_decryptor_impl(key);
+  return create(key, keylen);
+}
+
+ecb_encryptor *
+ecb_encryptor::create(cipher_suite suite, key_generator *gen)
+{
+  size_t keylen = cipher_suite_key_len(suite);
+  MemBlock key(keylen);
+  size_t got = gen->generate(key, keylen);
+  log_assert(got == keylen);
+  return create(suite, key, keylen);
+}
+
+ecb_decryptor *
+ecb_decryptor::create(cipher_suite suite, key_generator *gen)
+{
+  size_t keylen = cipher_suite_key_len(suite);
+  MemBlock key(keylen);
+  size_t got = gen->generate(key, keylen);
+  log_assert(got == keylen);
+  return create(suite, key, keylen);
+}
+
+gcm_encryptor *
+gcm_encryptor::create(cipher_suite suite, key_generator *gen)
+{
+  size_t keylen = cipher_suite_key_len(suite);
+  MemBlock key(keylen);
+  size_t got = gen->generate(key, keylen);
+  log_assert(got == keylen);
+  return create(suite, key, keylen);
+}
+
+gcm_decryptor *
+gcm_decryptor::create(cipher_suite suite, key_generator *gen)
+{
+  size_t keylen = cipher_suite_key_len(suite);
+  MemBlock key(keylen);
+  size_t got = gen->generate(key, keylen);
+  log_assert(got == keylen);
+  return create(suite, key, keylen);
+}
+
 namespace {
-  struct key_generator_impl : key_generator
+  struct key_generator_impl : key_generator, secmem_object
   {
     HMAC_CTX expander;
     MemBlock prevT;
@@ -454,9 +1254,17 @@ key_generator::from_passphrase(const uint8_t *phra, size_t plen,
   // alternative would be to run PBKDF2 on the passphrase without a
   // salt, then put the result through HKDF-Extract with the salt.
 
-  log_assert(plen <= INT_MAX && slen < INT_MAX);
-
   MemBlock prk(SHA256_LEN);
+  stretch_passphrase(prk, phra, plen, salt, slen);
+  return new key_generator_impl(prk, ctxt, clen);
+}
+
+void
+key_generator::stretch_passphrase(uint8_t *prk,
+                                  const uint8_t *phra, size_t plen,
+                                  const uint8_t *salt, size_t slen)
+{
+  log_assert(plen <= INT_MAX && slen < INT_MAX);
 
   if (slen == 0) {
     salt = nosalt;
@@ -467,8 +1275,15 @@ key_generator::from_passphrase(const uint8_t *phra, size_t plen,
 
   if (!PKCS5_PBKDF2_HMAC((const char *)phra, plen, salt, slen,
                          10000, EVP_sha256(), SHA256_LEN, prk))
-    log_crypto_abort("key_generator::from_passphrase");
+    log_crypto_abort("key_generator::stretch_passphrase");
+}
 
+key_generator *
+key_generator::from_prk(const uint8_t *prk, const uint8_t *ctxt, size_t clen)
+{
+  log_assert(clen < INT_MAX);
+
+  init_crypto();
   return new key_generator_impl(prk, ctxt, clen);
 }
 
@@ -5,12 +5,43 @@
 #ifndef CRYPT_H
 #define CRYPT_H
 
+#include <event2/buffer.h> /* evbuffer_iovec */
+
 const size_t AES_BLOCK_LEN = 16;
 const size_t GCM_TAG_LEN   = 16;
 const size_t SHA256_LEN    = 32;
 
 struct key_generator;
 
+/** The available cipher suites.  A suite supplies both halves of what
+    a chop circuit needs: a 16-byte block permutation for headers (the
+    ecb_* classes) and an authenticated cipher for payloads (the gcm_*
+    classes).  The class names reflect the original AES suite; the
+    interfaces are the same for every suite.
+
+    CIPHER_CHACHA20_POLY1305 is the AEAD of RFC 7539, with a 32-byte
+    key, and is much faster than AES on CPUs without AES instructions.
+    Its nonces are 12 bytes; a longer nonce is folded down to 12 bytes
+    by XORing its excess bytes into the front.  Its header permutation
+    is AES-256, keyed with the suite's 32-byte header key, so every
+    suite's headers rest on the same analysis (see chop.cc).  */
+enum cipher_suite
+{
+  CIPHER_AES128_GCM,
+  CIPHER_CHACHA20_POLY1305
+};
+
+/** Look up a cipher suite by the name used in configuration,
+    "aes128-gcm" or "chacha20-poly1305".  Returns 0 and sets *SUITE on
+    success, -1 if NAME is not recognized.  */
+int cipher_suite_by_name(const char *name, cipher_suite *suite);
+
+/** The configuration name of SUITE.  */
+const char *cipher_suite_name(cipher_suite suite);
+
+/** The length of every key used by SUITE.  */
+size_t cipher_suite_key_len(cipher_suite suite);
+
 struct ecb_encryptor
 {
   ecb_encryptor() {}
@@ -25,6 +56,14 @@ struct ecb_encryptor
       16, 24, or 32 bytes. */
   static ecb_encryptor *create(key_generator *gen, size_t keylen);
 
+  /** Return a new encryption state for cipher suite 'suite', using 'key' (of
+      length 'keylen', which must be cipher_suite_key_len(suite)).  */
+  static ecb_encryptor *create(cipher_suite suite,
+                               const uint8_t *key, size_t keylen);
+
+  /** As above, but generate the key from the key generator 'gen'.  */
+  static ecb_encryptor *create(cipher_suite suite, key_generator *gen);
+
   /** Encrypt exactly AES_BLOCK_LEN bytes of data in the buffer 'in' and
       write the result to 'out'.  */
   virtual void encrypt(uint8_t *out, const uint8_t *in) = 0;
@@ -48,6 +87,14 @@ struct ecb_decryptor
       16, 24, or 32 bytes. */
   static ecb_decryptor *create(key_generator *gen, size_t keylen);
 
+  /** Return a new decryption state for cipher suite 'suite', using 'key' (of
+      length 'keylen', which must be cipher_suite_key_len(suite)).  */
+  static ecb_decryptor *create(cipher_suite suite,
+                               const uint8_t *key, size_t keylen);
+
+  /** As above, but generate the key from the key generator 'gen'.  */
+  static ecb_decryptor *create(cipher_suite suite, key_generator *gen);
+
   /** Decrypt exactly AES_BLOCK_LEN bytes of data in the buffer 'in' and
       write the result to 'out'.  */
   virtual void decrypt(uint8_t *out, const uint8_t *in) = 0;
@@ -72,6 +119,14 @@ struct gcm_encryptor
       16, 24, or 32 bytes. */
   static gcm_encryptor *create(key_generator *gen, size_t keylen);
 
+  /** Return a new encryption state for cipher suite 'suite', using 'key' (of
+      length 'keylen', which must be cipher_suite_key_len(suite)).  */
+  static gcm_encryptor *create(cipher_suite suite,
+                               const uint8_t *key, size_t keylen);
+
+  /** As above, but generate the key from the key generator 'gen'.  */
+  static gcm_encryptor *create(cipher_suite suite, key_generator *gen);
+
   /** Encrypt 'inlen' bytes of data in the buffer 'in', writing the
       result plus an authentication tag to the buffer 'out', whose
       length must be at least 'inlen'+16 bytes.  Use 'nonce'
@@ -80,6 +135,28 @@ struct gcm_encryptor
   virtual void encrypt(uint8_t *out, const uint8_t *in, size_t inlen,
                        const uint8_t *nonce, size_t nlen) = 0;
 
+  /** As above, but the plaintext is the concatenation of the 'nin'
+      segments 'in' (e.g. as returned by evbuffer_peek), followed by
+      'padlen' zero bytes.  This allows data to be encrypted straight
+      out of an evbuffer's chains without copying it anywhere first.
+      'out' must have room for the total length plus 16 bytes.  */
+  virtual void encrypt(uint8_t *out,
+                       const struct evbuffer_iovec *in, size_t nin,
+                       size_t padlen,
+                       const uint8_t *nonce, size_t nlen) = 0;
+
+  /** Scatter-gather form: the plaintext is the concatenation of the
+      'nin' segments 'in', and the ciphertext is written across the
+      'nout' segments 'out', whose total length must be the same.  The
+      segment boundaries on the two sides need not line up.  The
+      authentication tag, GCM_TAG_LEN bytes, goes to 'tag'.  An output
+      segment may be the very same memory as the corresponding input
+      (to encrypt in place), but must not otherwise overlap it.  */
+  virtual void encrypt(const struct evbuffer_iovec *out, size_t nout,
+                       const struct evbuffer_iovec *in, size_t nin,
+                       uint8_t *tag,
+                       const uint8_t *nonce, size_t nlen) = 0;
+
 private:
   gcm_encryptor(const gcm_encryptor&);
   gcm_encryptor& operator=(const gcm_encryptor&);
@@ -99,6 +176,14 @@ struct gcm_decryptor
       16, 24, or 32 bytes. */
   static gcm_decryptor *create(key_generator *gen, size_t keylen);
 
+  /** Return a new decryption state for cipher suite 'suite', using 'key' (of
+      length 'keylen', which must be cipher_suite_key_len(suite)).  */
+  static gcm_decryptor *create(cipher_suite suite,
+                               const uint8_t *key, size_t keylen);
+
+  /** As above, but generate the key from the key generator 'gen'.  */
+  static gcm_decryptor *create(cipher_suite suite, key_generator *gen);
+
   /** Decrypt 'inlen' bytes of data in the buffer 'in'; the last 16
       bytes of this buffer are assumed to be the authentication tag.
       Write the result to the buffer 'out', whose length must be at
@@ -108,6 +193,26 @@ struct gcm_decryptor
   virtual int decrypt(uint8_t *out, const uint8_t *in, size_t inlen,
                       const uint8_t *nonce, size_t nlen) = 0;
 
+  /** Decrypt, in place, the concatenation of the 'nsegs' segments
+      'segs' (e.g. as returned by evbuffer_peek).  The authentication
+      tag, GCM_TAG_LEN bytes, is passed separately as 'tag'.  'nonce'
+      and the return value are as above.  If the authentication check
+      fails, the contents of the segments are unspecified.  */
+  virtual int decrypt(const struct evbuffer_iovec *segs, size_t nsegs,
+                      const uint8_t *tag,
+                      const uint8_t *nonce, size_t nlen) = 0;
+
+  /** Scatter-gather form: decrypt the concatenation of the 'nin'
+      segments 'in' into the 'nout' segments 'out', with the same
+      rules about lengths and overlap as gcm_encryptor's scatter-gather
+      encrypt.  'tag', 'nonce', and the return value are as above.  If
+      the authentication check fails, the contents of 'out' are
+      unspecified.  */
+  virtual int decrypt(const struct evbuffer_iovec *out, size_t nout,
+                      const struct evbuffer_iovec *in, size_t nin,
+                      const uint8_t *tag,
+                      const uint8_t *nonce, size_t nlen) = 0;
+
 private:
   gcm_decryptor(const gcm_decryptor&) DELETE_METHOD;
   gcm_decryptor& operator=(const gcm_decryptor&) DELETE_METHOD;
@@ -139,6 +244,22 @@ struct key_generator
                                         const uint8_t *salt, size_t slen,
                                         const uint8_t *ctxt, size_t clen);
 
+  /** Stretch a passphrase with PBKDF2, exactly as from_passphrase
+      does, and write the resulting SHA256_LEN-byte pseudorandom key
+      to PRK.  This is the expensive part of from_passphrase; callers
+      that need many independent key generators from one passphrase
+      should do it once and then use from_prk.  */
+  static void stretch_passphrase(uint8_t *prk,
+                                 const uint8_t *phra, size_t plen,
+                                 const uint8_t *salt, size_t slen);
+
+  /** Construct a key generator directly from a pseudorandom key of
+      exactly SHA256_LEN bytes, as produced by stretch_passphrase or
+      HKDF-Extract.  Only HKDF-Expand is performed, so this is cheap.
+      The context argument is the same as for from_random_secret.  */
+  static key_generator *from_prk(const uint8_t *prk,
+                                 const uint8_t *ctxt, size_t clen);
+
   /** Write LEN bytes of key material to BUF.  May be called
       repeatedly.  Note that HKDF has a hard upper limit on the total
       amount of key material it can generate.  The return value is
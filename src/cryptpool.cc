@@ -0,0 +1,452 @@
+/* Copyright 2012 the StegoTorus authors
+   See LICENSE for other credits and copying information
+*/
+
+#include "util.h"
+#include "cryptpool.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <vector>
+
+#include <event2/event.h>
+#include <openssl/crypto.h>
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define NEED_OPENSSL_LOCKS
+#endif
+
+using std::vector;
+
+/* All of the pool's shared state is protected by 'lock'.  Lanes with
+   queued jobs, none of which is running, wait on a ready list for a
+   worker to take them: the crypto threads share one, and the
+   background thread has one of its own.  Finished jobs wait on the
+   done list for the event loop.  The worker that puts the first job
+   on an empty done list also writes a byte to the wakeup socket, and
+   the loop empties the list completely each time it wakes, so no job
+   is forgotten.  */
+struct crypt_ready_list
+{
+  crypt_lane *head;
+  crypt_lane *tail;
+  pthread_cond_t work;       // a lane became ready, or we are stopping
+};
+
+struct crypt_pool
+{
+  pthread_mutex_t lock;
+  pthread_cond_t idle;       // a lane stopped running
+  vector<pthread_t> threads; // the background thread comes first
+  crypt_ready_list crypto;
+  crypt_ready_list background;
+  crypt_job *done_head;
+  crypt_job *done_tail;
+  evutil_socket_t wake[2];
+  struct event *wake_ev;
+  size_t min_bytes;
+  unsigned int n_crypto;
+  bool running;
+  bool stopping;
+#ifdef NEED_OPENSSL_LOCKS
+  pthread_mutex_t *ssl_locks;
+#endif
+
+  crypt_ready_list &ready_list(crypt_lane *lane)
+  {
+    return lane->background ? background : crypto;
+  }
+  void make_ready(crypt_lane *lane);
+  void unready(crypt_lane *lane);
+  void run_jobs(crypt_ready_list &ready);
+  void finish_jobs();
+  bool start_thread(crypt_ready_list &ready);
+
+  static void *worker_main(void *arg);
+  static void wake_cb(evutil_socket_t, short, void *arg);
+#ifdef NEED_OPENSSL_LOCKS
+  static void ssl_lock_cb(int mode, int n, const char *, int);
+  static unsigned long ssl_id_cb();
+#endif
+};
+
+static crypt_pool pool;
+
+crypt_job::~crypt_job()
+{
+}
+
+crypt_lane::crypt_lane(bool background_)
+  : head(0), tail(0), next_ready(0), n_pending(0),
+    background(background_), ready(false), running(false)
+{
+}
+
+void
+crypt_lane::cancel()
+{
+  if (!n_pending)
+    return;
+
+  // Once no worker is using our cipher state, pull everything of
+  // ours off the queues.
+  pthread_mutex_lock(&pool.lock);
+  while (running)
+    pthread_cond_wait(&pool.idle, &pool.lock);
+  if (ready)
+    pool.unready(this);
+  crypt_job *doomed = head;
+  head = tail = 0;
+  n_pending = 0;
+
+  crypt_job **pp = &pool.done_head;
+  pool.done_tail = 0;
+  while (*pp) {
+    crypt_job *j = *pp;
+    if (j->lane == this) {
+      *pp = j->next;
+      j->next = doomed;
+      doomed = j;
+    } else {
+      pool.done_tail = j;
+      pp = &j->next;
+    }
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  while (doomed) {
+    crypt_job *j = doomed;
+    doomed = j->next;
+    delete j;
+  }
+}
+
+void
+crypt_lane::complete()
+{
+  if (!n_pending)
+    return;
+
+  // Once everything has run, all our jobs are on the done list, in
+  // order.  Take them off it.
+  crypt_job *mine = 0;
+  crypt_job **tailp = &mine;
+  pthread_mutex_lock(&pool.lock);
+  while (head || running)
+    pthread_cond_wait(&pool.idle, &pool.lock);
+  crypt_job **pp = &pool.done_head;
+  pool.done_tail = 0;
+  while (*pp) {
+    crypt_job *j = *pp;
+    if (j->lane == this) {
+      *pp = j->next;
+      j->next = 0;
+      *tailp = j;
+      tailp = &j->next;
+    } else {
+      pool.done_tail = j;
+      pp = &j->next;
+    }
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  while (mine) {
+    crypt_job *j = mine;
+    mine = j->next;
+    n_pending--;
+    j->finish();
+    delete j;
+  }
+}
+
+void
+crypt_lane::submit(crypt_job *job)
+{
+  log_assert(pool.running && (background || pool.n_crypto > 0));
+  job->lane = this;
+  job->next = 0;
+  n_pending++;
+
+  pthread_mutex_lock(&pool.lock);
+  if (tail)
+    tail->next = job;
+  else
+    head = job;
+  tail = job;
+  if (!ready && !running)
+    pool.make_ready(this);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+// Put LANE at the end of its ready list.  Lock must be held.
+void
+crypt_pool::make_ready(crypt_lane *lane)
+{
+  crypt_ready_list &ready = ready_list(lane);
+  lane->ready = true;
+  lane->next_ready = 0;
+  if (ready.tail)
+    ready.tail->next_ready = lane;
+  else
+    ready.head = lane;
+  ready.tail = lane;
+  pthread_cond_signal(&ready.work);
+}
+
+// Take LANE off its ready list.  Lock must be held.
+void
+crypt_pool::unready(crypt_lane *lane)
+{
+  crypt_ready_list &ready = ready_list(lane);
+  crypt_lane *prev = 0;
+  for (crypt_lane *l = ready.head; l; prev = l, l = l->next_ready) {
+    if (l != lane)
+      continue;
+    if (prev)
+      prev->next_ready = l->next_ready;
+    else
+      ready.head = l->next_ready;
+    if (ready.tail == l)
+      ready.tail = prev;
+    break;
+  }
+  lane->ready = false;
+  lane->next_ready = 0;
+}
+
+// Worker thread body: take the first lane on READY, run its first
+// job, and pass the job along to the done list.  Only one worker can
+// hold a given lane at a time, which is what keeps each lane in order.
+void
+crypt_pool::run_jobs(crypt_ready_list &ready)
+{
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (!ready.head && !stopping)
+      pthread_cond_wait(&ready.work, &lock);
+    if (stopping)
+      break;
+
+    crypt_lane *lane = ready.head;
+    ready.head = lane->next_ready;
+    if (!ready.head)
+      ready.tail = 0;
+    lane->ready = false;
+    lane->running = true;
+
+    crypt_job *job = lane->head;
+    lane->head = job->next;
+    if (!lane->head)
+      lane->tail = 0;
+
+    pthread_mutex_unlock(&lock);
+    job->run();
+    pthread_mutex_lock(&lock);
+
+    lane->running = false;
+    if (lane->head)
+      make_ready(lane);
+    pthread_cond_broadcast(&idle);
+
+    job->next = 0;
+    if (done_tail) {
+      done_tail->next = job;
+      done_tail = job;
+    } else {
+      done_head = done_tail = job;
+      // The loop may be asleep.  If this fails, the socket buffer is
+      // full of wakeups already.
+      char c = 0;
+      send(wake[1], &c, 1, 0);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Event loop side: finish every job on the done list, one at a time,
+// since finishing one job may destroy the lanes of others.
+void
+crypt_pool::finish_jobs()
+{
+  char buf[64];
+  while (recv(wake[0], buf, sizeof buf, 0) > 0)
+    ;
+
+  for (;;) {
+    pthread_mutex_lock(&lock);
+    crypt_job *job = done_head;
+    if (job) {
+      done_head = job->next;
+      if (!done_head)
+        done_tail = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    if (!job)
+      break;
+
+    job->lane->n_pending--;
+    job->finish();
+    delete job;
+  }
+}
+
+void *
+crypt_pool::worker_main(void *arg)
+{
+  pool.run_jobs(*static_cast<crypt_ready_list *>(arg));
+  return 0;
+}
+
+// Start a thread serving READY.  Lock need not be held.
+bool
+crypt_pool::start_thread(crypt_ready_list &ready)
+{
+  pthread_t t;
+  if (pthread_create(&t, 0, crypt_pool::worker_main, &ready))
+    return false;
+  threads.push_back(t);
+  return true;
+}
+
+void
+crypt_pool::wake_cb(evutil_socket_t, short, void *arg)
+{
+  static_cast<crypt_pool *>(arg)->finish_jobs();
+}
+
+#ifdef NEED_OPENSSL_LOCKS
+void
+crypt_pool::ssl_lock_cb(int mode, int n, const char *, int)
+{
+  if (mode & CRYPTO_LOCK)
+    pthread_mutex_lock(&pool.ssl_locks[n]);
+  else
+    pthread_mutex_unlock(&pool.ssl_locks[n]);
+}
+
+unsigned long
+crypt_pool::ssl_id_cb()
+{
+  return (unsigned long)pthread_self();
+}
+#endif
+
+int
+crypt_pool_start(struct event_base *base, unsigned int nthreads,
+                 size_t min_bytes)
+{
+  log_assert(!pool.running);
+
+  if (evutil_socketpair(AF_UNIX, SOCK_STREAM, 0, pool.wake)) {
+    log_warn("crypto pool: failed to create wakeup socket: %s",
+             evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+    return -1;
+  }
+  evutil_make_socket_nonblocking(pool.wake[0]);
+  evutil_make_socket_nonblocking(pool.wake[1]);
+  evutil_make_socket_closeonexec(pool.wake[0]);
+  evutil_make_socket_closeonexec(pool.wake[1]);
+
+  pool.wake_ev = event_new(base, pool.wake[0], EV_READ|EV_PERSIST,
+                           crypt_pool::wake_cb, &pool);
+  if (!pool.wake_ev || event_add(pool.wake_ev, 0)) {
+    log_warn("crypto pool: failed to create wakeup event");
+    if (pool.wake_ev)
+      event_free(pool.wake_ev);
+    evutil_closesocket(pool.wake[0]);
+    evutil_closesocket(pool.wake[1]);
+    return -1;
+  }
+
+  pthread_mutex_init(&pool.lock, 0);
+  pthread_cond_init(&pool.idle, 0);
+  pthread_cond_init(&pool.crypto.work, 0);
+  pthread_cond_init(&pool.background.work, 0);
+  pool.crypto.head = pool.crypto.tail = 0;
+  pool.background.head = pool.background.tail = 0;
+  pool.done_head = pool.done_tail = 0;
+  pool.min_bytes = min_bytes;
+  pool.n_crypto = nthreads;
+  pool.stopping = false;
+
+#ifdef NEED_OPENSSL_LOCKS
+  // OpenSSL before 1.1 is only thread-safe if we provide the locks.
+  if (!CRYPTO_get_locking_callback()) {
+    pool.ssl_locks = new pthread_mutex_t[CRYPTO_num_locks()];
+    for (int i = 0; i < CRYPTO_num_locks(); i++)
+      pthread_mutex_init(&pool.ssl_locks[i], 0);
+    CRYPTO_set_id_callback(crypt_pool::ssl_id_cb);
+    CRYPTO_set_locking_callback(crypt_pool::ssl_lock_cb);
+  }
+#endif
+
+  // Signals are for the event loop thread.
+#ifndef _WIN32
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+#endif
+  bool ok = pool.start_thread(pool.background);
+  if (!ok)
+    log_warn("crypto pool: failed to start the background thread");
+  for (unsigned int i = 0; ok && i < nthreads; i++) {
+    ok = pool.start_thread(pool.crypto);
+    if (!ok)
+      log_warn("crypto pool: failed to start thread %u of %u",
+               i + 1, nthreads);
+  }
+#ifndef _WIN32
+  pthread_sigmask(SIG_SETMASK, &saved, 0);
+#endif
+
+  pool.running = true;
+  if (!ok) {
+    crypt_pool_stop();
+    return -1;
+  }
+
+  log_debug("crypto pool: %u crypto threads, offloading work of %lu bytes "
+            "or more, and a background thread", nthreads,
+            (unsigned long)min_bytes);
+  return 0;
+}
+
+void
+crypt_pool_stop()
+{
+  if (!pool.running)
+    return;
+
+  pthread_mutex_lock(&pool.lock);
+  log_assert(!pool.crypto.head && !pool.background.head && !pool.done_head);
+  pool.stopping = true;
+  pthread_cond_broadcast(&pool.crypto.work);
+  pthread_cond_broadcast(&pool.background.work);
+  pthread_mutex_unlock(&pool.lock);
+
+  for (vector<pthread_t>::iterator i = pool.threads.begin();
+       i != pool.threads.end(); i++)
+    pthread_join(*i, 0);
+  pool.threads.clear();
+
+  event_free(pool.wake_ev);
+  evutil_closesocket(pool.wake[0]);
+  evutil_closesocket(pool.wake[1]);
+  pthread_cond_destroy(&pool.idle);
+  pthread_cond_destroy(&pool.background.work);
+  pthread_cond_destroy(&pool.crypto.work);
+  pthread_mutex_destroy(&pool.lock);
+  pool.running = false;
+}
+
+bool
+crypt_pool_offload(size_t nbytes)
+{
+  return pool.running && pool.n_crypto > 0 && nbytes >= pool.min_bytes;
+}
+
+bool
+crypt_pool_running()
+{
+  return pool.running;
+}
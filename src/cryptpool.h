@@ -0,0 +1,113 @@
+/* Copyright 2012 the StegoTorus authors
+   See LICENSE for other credits and copying information
+*/
+
+#ifndef CRYPTPOOL_H
+#define CRYPTPOOL_H
+
+/* An optional pool of worker threads for bulk encryption and
+   decryption, so that one busy circuit does not hold up the event
+   loop for everyone else.  Work is submitted as jobs on a lane; each
+   circuit has one lane per direction, since the cipher state it uses
+   must not be touched by two threads at once.  Jobs on the same lane
+   run one at a time, in the order they were submitted, and finish (on
+   the event loop thread) in that order too.  Jobs on different lanes
+   may run concurrently.
+
+   Besides the crypto threads, the pool has one background thread of
+   its own, for occasional slow jobs that must never hold up the event
+   loop whatever their size, such as reloading a cover-traffic trace.
+   It serves only background lanes, and it is there even if there
+   are no crypto threads.
+
+   If the pool has not been started, nothing should be submitted;
+   callers are expected to do the work inline instead.  See
+   crypt_pool_offload and crypt_pool_running.  */
+
+struct event_base;
+struct crypt_lane;
+
+struct crypt_job
+{
+  crypt_job() : next(0), lane(0) {}
+  virtual ~crypt_job();
+
+  /** Do the actual work.  Called on a worker thread: touch nothing
+      but the job's own state and the cipher state that its lane
+      protects.  */
+  virtual void run() = 0;
+
+  /** Called on the event loop thread after 'run'.  The job is deleted
+      as soon as this returns.  Jobs still queued when their lane is
+      destroyed are deleted without being finished.  */
+  virtual void finish() = 0;
+
+private:
+  friend struct crypt_lane;
+  friend struct crypt_pool;
+  crypt_job *next;
+  crypt_lane *lane;
+
+  crypt_job(const crypt_job&) DELETE_METHOD;
+  crypt_job& operator=(const crypt_job&) DELETE_METHOD;
+};
+
+struct crypt_lane
+{
+  /** A BACKGROUND lane's jobs run on the background thread instead
+      of the crypto threads.  */
+  explicit crypt_lane(bool background = false);
+  ~crypt_lane() { cancel(); }
+
+  /** Discard every job on this lane that has not yet finished.  If
+      one is running right now, wait for it.  Afterward, nothing on
+      any other thread is using the lane's cipher state.  */
+  void cancel();
+
+  /** Wait for every job on this lane to run, then finish them all,
+      in order, right away.  */
+  void complete();
+
+  /** Queue JOB to run after everything already on this lane.  The
+      lane takes ownership of it.  */
+  void submit(crypt_job *job);
+
+  /** True if any job has been submitted to this lane and not yet
+      finished.  While this is so, all further work that uses the
+      lane's cipher state must be submitted too, not done inline.  */
+  bool busy() const { return n_pending > 0; }
+
+private:
+  friend struct crypt_pool;
+  crypt_job *head;        // queued, not yet running
+  crypt_job *tail;
+  crypt_lane *next_ready;
+  size_t n_pending;       // submitted but not finished; loop thread only
+  bool background : 1;
+  bool ready : 1;         // on the pool's ready list
+  bool running : 1;       // a worker is running this lane's head job
+
+  crypt_lane(const crypt_lane&) DELETE_METHOD;
+  crypt_lane& operator=(const crypt_lane&) DELETE_METHOD;
+};
+
+/** Start NTHREADS crypto threads, and the background thread,
+    finishing jobs on BASE.  NTHREADS may be zero.  Only work of at
+    least MIN_BYTES is worth handing to the crypto threads.  Returns 0
+    on success, -1 on failure.  */
+int crypt_pool_start(struct event_base *base, unsigned int nthreads,
+                     size_t min_bytes);
+
+/** Stop the worker threads.  All lanes should have been destroyed
+    already.  */
+void crypt_pool_stop();
+
+/** True if the pool has crypto threads and NBYTES of work is enough
+    to be worth handing to them.  */
+bool crypt_pool_offload(size_t nbytes);
+
+/** True if the pool is running, so that jobs can be submitted to
+    background lanes.  */
+bool crypt_pool_running();
+
+#endif
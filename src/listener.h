@@ -9,4 +9,9 @@
 int listener_open(struct event_base *base, config_t *cfg);
 void listener_close_all(void);
 
+/* Multiple worker processes; see network.cc.  Unix only. */
+int workers_create(unsigned int n);
+void worker_become(unsigned int index);
+int worker_listen(struct event_base *base);
+
 #endif
@@ -7,8 +7,12 @@
 
 #include "connections.h"
 #include "crypt.h"
+#include "cryptpool.h"
 #include "listener.h"
 #include "protocol.h"
+#include "rng.h"
+#include "secmem.h"
+#include "steg.h"
 
 #include <vector>
 #include <string>
@@ -20,6 +24,7 @@
 #include <process.h>
 #include <io.h>
 #else
+#include <sys/wait.h>
 #include <unistd.h>
 #ifdef HAVE_EXECINFO_H
 #include <execinfo.h>
@@ -34,6 +39,9 @@ using std::string;
 
 static struct event_base *the_event_base;
 static bool allow_kq = false;
+static unsigned int n_workers = 1;
+static unsigned int n_crypto_threads = 0;
+static size_t crypto_offload_min = 16384;
 
 /**
    Puts stegotorus's networking subsystem on "closing time" mode. This
@@ -78,6 +86,9 @@ finish_shutdown(void)
            and terminate when they all close.
            On a second SIGINT we shut down immediately but cleanly.
    SIGTERM: Shut down immediately but cleanly.
+   SIGHUP: Reread the cover-traffic traces (see steg_reload).  New
+           traces should be renamed into place, so that a reload
+           never reads one that is only partly written.
 */
 static void
 handle_signal_cb(evutil_socket_t fd, short, void *)
@@ -85,6 +96,13 @@ handle_signal_cb(evutil_socket_t fd, short, void *)
   static int got_sigint = 0;
   int signum = (int) fd;
 
+#ifdef SIGHUP
+  if (signum == SIGHUP) {
+    log_info("reloading cover-traffic traces on SIGHUP");
+    steg_reload();
+    return;
+  }
+#endif
   log_assert(signum == SIGINT || signum == SIGTERM);
 
   if (signum == SIGINT && !got_sigint) {
@@ -158,6 +176,94 @@ stdin_detect_eof_cb(evutil_socket_t fd, short, void *arg)
   }
 }
 
+#ifndef _WIN32
+/**
+   Fork 'n' worker processes.  Each of them returns from this function
+   and goes on to set up its own event loop and listeners.  The parent
+   stays behind, passing SIGINT, SIGTERM and SIGHUP along to the
+   workers, and exits when they all have.
+*/
+static void
+start_workers(unsigned int n)
+{
+  vector<pid_t> pids;
+  sigset_t mask, oldmask;
+  int status = 0;
+
+  if (workers_create(n))
+    log_abort("failed to set up worker processes");
+
+  /* Block the signals we care about until the workers are running, so
+     that none get lost, and have the parent collect them with
+     sigwait. */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, &oldmask);
+  fflush(NULL);
+
+  for (unsigned int i = 0; i < n; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      sigprocmask(SIG_SETMASK, &oldmask, NULL);
+      worker_become(i);
+      rng_reseed();
+      secmem_after_fork();
+      return;
+    }
+    if (pid < 0) {
+      log_warn("failed to start worker %u: %s", i, strerror(errno));
+      for (vector<pid_t>::iterator p = pids.begin(); p != pids.end(); p++)
+        kill(*p, SIGTERM);
+      exit(1);
+    }
+    pids.push_back(pid);
+  }
+
+  worker_become(-1U);
+  log_info("started %u worker processes", n);
+  /* Monitoring processes wait for stdout to close; see main(). */
+  fclose(stdout);
+
+  for (size_t live = n; live > 0; ) {
+    int sig;
+    if (sigwait(&mask, &sig))
+      continue;
+
+    if (sig != SIGCHLD) {
+      for (vector<pid_t>::iterator p = pids.begin(); p != pids.end(); p++)
+        if (*p)
+          kill(*p, sig);
+      continue;
+    }
+
+    pid_t pid;
+    int st;
+    while ((pid = waitpid(-1, &st, WNOHANG)) > 0) {
+      for (vector<pid_t>::iterator p = pids.begin(); p != pids.end(); p++)
+        if (*p == pid)
+          *p = 0;
+      live--;
+      if (!WIFEXITED(st) || WEXITSTATUS(st) != 0) {
+        /* The circuits it owned are lost, and the others cannot hand
+           it any more connections; give up altogether. */
+        log_warn("worker process %lu exited abnormally; stopping the rest",
+                 (unsigned long)pid);
+        for (vector<pid_t>::iterator p = pids.begin(); p != pids.end(); p++)
+          if (*p)
+            kill(*p, SIGTERM);
+        status = 1;
+      }
+    }
+  }
+
+  log_info("all worker processes have exited");
+  exit(status);
+}
+#endif
+
 /**
    Prints usage instructions then exits.
 */
@@ -177,7 +283,12 @@ usage(void)
           "--log-min-severity=warn|info|debug ~ set minimum logging severity\n"
           "--no-log ~ disable logging\n"
           "--timestamp-logs ~ add timestamps to all log messages\n"
-          "--allow-kqueue ~ allow use of kqueue(2) (may be buggy)\n");
+          "--allow-kqueue ~ allow use of kqueue(2) (may be buggy)\n"
+          "--workers=<n> ~ run <n> worker processes (default 1)\n"
+          "--crypto-threads=<n> ~ encrypt and decrypt on <n> threads "
+          "(default 0: on the event loop)\n"
+          "--crypto-offload-min=<bytes> ~ smallest job worth handing to "
+          "those threads (default 16384)\n");
 
   exit(1);
 }
@@ -199,6 +310,9 @@ handle_generic_args(const char *const *argv)
   bool logsev_set = false;
   bool allow_kq_set = false;
   bool timestamps_set = false;
+  bool workers_set = false;
+  bool crypto_threads_set = false;
+  bool crypto_offload_min_set = false;
   int i = 1;
 
   while (argv[i] &&
@@ -249,6 +363,52 @@ handle_generic_args(const char *const *argv)
       }
       allow_kq = true;
       allow_kq_set = true;
+    } else if (!strncmp(argv[i], "--workers=", 10)) {
+      char *end;
+      unsigned long n = strtoul(argv[i]+10, &end, 10);
+      if (workers_set) {
+        fprintf(stderr, "you've already set the number of workers!\n");
+        exit(1);
+      }
+      if (!argv[i][10] || *end || n < 1 || n > 256) {
+        fprintf(stderr, "number of workers must be between 1 and 256\n");
+        exit(1);
+      }
+#ifdef _WIN32
+      if (n > 1) {
+        fprintf(stderr, "multiple workers are not supported on Windows\n");
+        exit(1);
+      }
+#endif
+      n_workers = n;
+      workers_set = true;
+    } else if (!strncmp(argv[i], "--crypto-threads=", 17)) {
+      char *end;
+      unsigned long n = strtoul(argv[i]+17, &end, 10);
+      if (crypto_threads_set) {
+        fprintf(stderr, "you've already set the number of crypto threads!\n");
+        exit(1);
+      }
+      if (!argv[i][17] || *end || n > 64) {
+        fprintf(stderr, "number of crypto threads must be between 0 and 64\n");
+        exit(1);
+      }
+      n_crypto_threads = n;
+      crypto_threads_set = true;
+    } else if (!strncmp(argv[i], "--crypto-offload-min=", 21)) {
+      char *end;
+      unsigned long n = strtoul(argv[i]+21, &end, 10);
+      if (crypto_offload_min_set) {
+        fprintf(stderr, "you've already set the crypto offload minimum!\n");
+        exit(1);
+      }
+      if (!argv[i][21] || *end || n > 1024*1024) {
+        fprintf(stderr, "crypto offload minimum must be between 0 and "
+                "1048576 bytes\n");
+        exit(1);
+      }
+      crypto_offload_min = n;
+      crypto_offload_min_set = true;
     } else {
       fprintf(stderr, "unrecognizable argument '%s'", argv[i]);
       exit(1);
@@ -265,6 +425,7 @@ main(int, const char *const *argv)
   struct event_config *evcfg;
   struct event *sig_int;
   struct event *sig_term;
+  struct event *sig_hup = NULL;
   struct event *stdin_eof;
   vector<config_t *> configs;
   const char *const *begin;
@@ -325,6 +486,13 @@ main(int, const char *const *argv)
   }
 #endif
 
+#ifndef _WIN32
+  /* Split into worker processes, if requested, before anything else
+     is set up: libevent state does not survive fork(). */
+  if (n_workers > 1)
+    start_workers(n_workers);
+#endif
+
   /* Configure and initialize libevent. */
   evcfg = event_config_new();
   if (!evcfg)
@@ -346,6 +514,12 @@ main(int, const char *const *argv)
   if (!the_event_base)
     log_abort("failed to initialize networking (evbase)");
 
+  /* Start the crypto threads, if any, and the background thread that
+     rereads cover-traffic traces on SIGHUP.  This has to happen after
+     start_workers, since threads do not survive fork() either. */
+  if (crypt_pool_start(the_event_base, n_crypto_threads, crypto_offload_min))
+    log_abort("failed to start crypto threads");
+
   /* ASN should this happen only when SOCKS is enabled? */
   if (init_evdns_base(the_event_base))
     log_abort("failed to initialize DNS resolver");
@@ -360,6 +534,12 @@ main(int, const char *const *argv)
                           handle_signal_cb, NULL);
   if (event_add(sig_int, NULL) || event_add(sig_term, NULL))
     log_abort("failed to initialize signal handling");
+#ifdef SIGHUP
+  sig_hup = evsignal_new(the_event_base, SIGHUP,
+                         handle_signal_cb, NULL);
+  if (event_add(sig_hup, NULL))
+    log_abort("failed to initialize signal handling");
+#endif
 
 #ifndef _WIN32
   /* trap and diagnose fatal signals */
@@ -407,6 +587,10 @@ main(int, const char *const *argv)
     if (!listener_open(the_event_base, *i))
       log_abort("failed to open listeners for configuration %lu",
                 (unsigned long)(i - configs.begin()) + 1);
+#ifndef _WIN32
+  if (!worker_listen(the_event_base))
+    log_abort("failed to set up worker hand-off");
+#endif
 
   /* We are go for launch. As a signal to any monitoring process that may
      be running, close stdout now. */
@@ -424,10 +608,14 @@ main(int, const char *const *argv)
   for (vector<config_t *>::iterator i = configs.begin(); i != configs.end();
        i++)
     delete *i;
+  secmem_log_stats();
 
+  crypt_pool_stop();
   evdns_base_free(get_evdns_base(), 0);
   event_free(sig_int);
   event_free(sig_term);
+  if (sig_hup)
+    event_free(sig_hup);
   free(stdin_eof);
   event_base_free(the_event_base);
   event_config_free(evcfg);
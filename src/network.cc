@@ -9,12 +9,19 @@
 #include "socks.h"
 #include "protocol.h"
 
+#include <deque>
 #include <vector>
 
 #include <errno.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
+#include <event2/event.h>
 #include <event2/listener.h>
 
 using std::vector;
@@ -33,6 +40,56 @@ struct listener_t
 /** All our listeners. */
 static vector<listener_t *> listeners;
 
+/**
+  When stegotorus runs as several worker processes (see main.cc), each
+  worker has its own listeners, bound to the same addresses with
+  SO_REUSEPORT, so the kernel spreads incoming connections across
+  them.  A protocol may discover that a connection belongs to a
+  circuit owned by another worker; it then hands the connection over
+  with conn_hand_off, which passes the socket, and everything read from
+  it so far, down that worker's channel.  Each channel is a datagram
+  socket pair: the worker reads from one end, and all the others write
+  to the other.  When a channel is full, hand-offs to that worker wait
+  in a queue until it has room again.
+ */
+struct handoff_header
+{
+  uint32_t listener;  /* position in 'listeners' */
+  uint32_t len;       /* bytes of data following */
+};
+
+struct handoff_msg
+{
+  handoff_header hdr;
+  int fd;             /* our own copy of the connection's socket */
+  uint8_t *data;      /* hdr.len bytes */
+};
+
+struct handoff_queue
+{
+  std::deque<handoff_msg> msgs;
+  struct event *writable;
+};
+
+struct worker_state
+{
+  unsigned int count;
+  unsigned int index;
+  vector<int> recv_socks;
+  vector<int> send_socks;
+  vector<handoff_queue> queues;  /* one per worker we send to */
+  struct event *channel;
+};
+
+static worker_state workers =
+  { 1, 0, vector<int>(), vector<int>(), vector<handoff_queue>(), 0 };
+
+/** Hand-off messages carry at most this much already-received data. */
+static const size_t HANDOFF_MAX = 65536;
+
+/** At most this many hand-offs wait for each worker's channel. */
+static const size_t HANDOFF_QUEUE_MAX = 256;
+
 static void listener_close(listener_t *lsn);
 
 static void client_listener_cb(struct evconnlistener *evcl, evutil_socket_t fd,
@@ -53,9 +110,49 @@ static void downstream_flush_cb(struct bufferevent *bev, void *arg);
 static void upstream_event_cb(struct bufferevent *bev, short what, void *arg);
 static void downstream_event_cb(struct bufferevent *bev, short what, void *arg);
 
+static void server_accept(listener_t *lsn, evutil_socket_t fd,
+                          char *peername, struct evbuffer *prefix);
+static void handoff_cb(evutil_socket_t fd, short what, void *arg);
+static void handoff_write_cb(evutil_socket_t fd, short what, void *arg);
+static void handoff_queues_clear(void);
+
 static void create_outbound_connections(circuit_t *ckt, bool is_socks);
 static void create_outbound_connections_socks(circuit_t *ckt);
 
+/**
+   Open a listening socket on 'addr' that other worker processes can
+   bind as well.
+ */
+static struct evconnlistener *
+listener_new_shared(struct event_base *base, evconnlistener_cb callback,
+                    listener_t *lsn, unsigned flags,
+                    struct evutil_addrinfo *addr)
+{
+#if defined _WIN32 || !defined SO_REUSEPORT
+  (void)base; (void)callback; (void)lsn; (void)flags; (void)addr;
+  log_warn("multiple workers are not supported on this platform");
+  return NULL;
+#else
+  int one = 1;
+  evutil_socket_t fd = socket(addr->ai_family, SOCK_STREAM, 0);
+  if (fd < 0)
+    return NULL;
+  if (evutil_make_socket_nonblocking(fd) ||
+      evutil_make_listen_socket_reuseable(fd) ||
+      setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) ||
+      bind(fd, addr->ai_addr, addr->ai_addrlen)) {
+    evutil_closesocket(fd);
+    return NULL;
+  }
+
+  struct evconnlistener *l =
+    evconnlistener_new(base, callback, lsn, flags, -1, fd);
+  if (!l)
+    evutil_closesocket(fd);
+  return l;
+#endif
+}
+
 /**
    This function opens listening sockets configured according to the
    provided 'config_t'.  Returns 1 on success, 0 on failure.
@@ -84,9 +181,13 @@ listener_open(struct event_base *base, config_t *cfg)
       lsn->cfg = cfg;
       lsn->address = printable_address(addrs->ai_addr, addrs->ai_addrlen);
       lsn->index = i;
-      lsn->listener =
-        evconnlistener_new_bind(base, callback, lsn, flags, -1,
-                                addrs->ai_addr, addrs->ai_addrlen);
+      if (workers.count > 1)
+        lsn->listener = listener_new_shared(base, callback, lsn, flags,
+                                            addrs);
+      else
+        lsn->listener =
+          evconnlistener_new_bind(base, callback, lsn, flags, -1,
+                                  addrs->ai_addr, addrs->ai_addrlen);
 
       if (!lsn->listener) {
         log_warn("failed to open listening socket on %s: %s",
@@ -132,8 +233,394 @@ listener_close_all(void)
        i != listeners.end(); i++)
     listener_close(*i);
   listeners.clear();
+
+  /* Connections handed over from other workers count as new
+     connections, too. */
+  if (workers.channel) {
+    event_free(workers.channel);
+    workers.channel = NULL;
+  }
+  handoff_queues_clear();
+}
+
+#ifndef _WIN32
+/**
+   Create the hand-off channels for 'n' worker processes.  Call this
+   before forking them.  Returns 0 on success, -1 on failure.
+ */
+int
+workers_create(unsigned int n)
+{
+  log_assert(n > 1 && workers.count == 1);
+  for (unsigned int i = 0; i < n; i++) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv)) {
+      log_warn("failed to create worker channel: %s", strerror(errno));
+      return -1;
+    }
+    /* The sending ends are shared by all workers; a full channel must
+       not block the sender's event loop. */
+    if (evutil_make_socket_nonblocking(sv[0]) ||
+        evutil_make_socket_nonblocking(sv[1]) ||
+        evutil_make_socket_closeonexec(sv[0]) ||
+        evutil_make_socket_closeonexec(sv[1])) {
+      log_warn("failed to configure worker channel: %s", strerror(errno));
+      return -1;
+    }
+    workers.recv_socks.push_back(sv[0]);
+    workers.send_socks.push_back(sv[1]);
+  }
+  workers.queues.resize(n);
+  workers.count = n;
+  return 0;
+}
+
+/**
+   In a freshly forked worker process, become worker number 'index':
+   keep only our own end of the channel to read from.  In the parent
+   (index == -1U), close the channels altogether.
+ */
+void
+worker_become(unsigned int index)
+{
+  for (unsigned int i = 0; i < workers.count; i++) {
+    if (i != index)
+      close(workers.recv_socks[i]);
+    if (index == -1U)
+      close(workers.send_socks[i]);
+  }
+  workers.index = index;
+}
+
+/**
+   Start accepting connections handed over by other workers.  Call
+   after listener_open, once for each worker.  Returns 1 on success,
+   0 on failure, like listener_open.
+ */
+int
+worker_listen(struct event_base *base)
+{
+  if (workers.count == 1)
+    return 1;
+
+  workers.channel = event_new(base, workers.recv_socks[workers.index],
+                              EV_READ|EV_PERSIST, handoff_cb, NULL);
+  if (!workers.channel || event_add(workers.channel, NULL)) {
+    log_warn("failed to listen on worker channel");
+    return 0;
+  }
+  return 1;
+}
+#endif
+
+unsigned int
+worker_count(void)
+{
+  return workers.count;
+}
+
+unsigned int
+worker_index(void)
+{
+  return workers.index;
 }
 
+#ifndef _WIN32
+/**
+   Send one hand-off message, passing 'fd', down worker number
+   'worker''s channel.  Returns sendmsg's result; errno says why on
+   failure.
+ */
+static ssize_t
+handoff_send(unsigned int worker, const handoff_header &hdr,
+             const void *data, int fd)
+{
+  struct iovec iov[2];
+  iov[0].iov_base = const_cast<handoff_header *>(&hdr);
+  iov[0].iov_len = sizeof hdr;
+  iov[1].iov_base = const_cast<void *>(data);
+  iov[1].iov_len = hdr.len;
+
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof msg);
+  msg.msg_iov = iov;
+  msg.msg_iovlen = hdr.len ? 2 : 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof control.buf;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+
+  return sendmsg(workers.send_socks[worker], &msg, 0);
+}
+
+/** True if a failed send to a worker's channel is worth retrying. */
+static bool
+handoff_would_block(int err)
+{
+  return err == EAGAIN || err == EWOULDBLOCK || err == EINTR;
+}
+
+/**
+   Queue a hand-off to worker number 'worker' whose channel is full,
+   to be sent when it has room.  The message gets its own copy of
+   'fd', since the caller is about to close the original.  Returns 0
+   on success, -1 on failure.
+ */
+static int
+handoff_enqueue(conn_t *conn, struct event_base *base, unsigned int worker,
+                const handoff_header &hdr, const void *data, int fd)
+{
+  handoff_queue &q = workers.queues[worker];
+  if (q.msgs.size() >= HANDOFF_QUEUE_MAX) {
+    log_warn(conn, "worker %u is not accepting hand-offs", worker);
+    return -1;
+  }
+
+  if (!q.writable) {
+    q.writable = event_new(base, workers.send_socks[worker],
+                           EV_WRITE|EV_PERSIST, handoff_write_cb,
+                           (void *)(uintptr_t)worker);
+    if (!q.writable) {
+      log_warn(conn, "failed to wait for worker %u's channel", worker);
+      return -1;
+    }
+  }
+
+  handoff_msg m;
+  m.hdr = hdr;
+  m.fd = dup(fd);
+  if (m.fd < 0 || evutil_make_socket_closeonexec(m.fd)) {
+    log_warn(conn, "failed to keep socket for hand-off: %s",
+             strerror(errno));
+    if (m.fd >= 0)
+      close(m.fd);
+    return -1;
+  }
+  m.data = (uint8_t *)xmalloc(hdr.len);
+  if (hdr.len)
+    memcpy(m.data, data, hdr.len);
+
+  if (q.msgs.empty() && event_add(q.writable, NULL)) {
+    log_warn(conn, "failed to wait for worker %u's channel", worker);
+    close(m.fd);
+    free(m.data);
+    return -1;
+  }
+  q.msgs.push_back(m);
+  return 0;
+}
+
+/**
+   Called when worker number 'arg''s channel has room for the
+   hand-offs queued for it.
+ */
+static void
+handoff_write_cb(evutil_socket_t, short, void *arg)
+{
+  unsigned int worker = (unsigned int)(uintptr_t)arg;
+  handoff_queue &q = workers.queues[worker];
+
+  while (!q.msgs.empty()) {
+    handoff_msg &m = q.msgs.front();
+    if (handoff_send(worker, m.hdr, m.data, m.fd) < 0) {
+      if (handoff_would_block(errno))
+        return;
+      log_warn("failed to hand off to worker %u: %s",
+               worker, strerror(errno));
+    } else {
+      log_debug("handed off queued connection to worker %u with %lu bytes",
+                worker, (unsigned long)m.hdr.len);
+    }
+    close(m.fd);
+    free(m.data);
+    q.msgs.pop_front();
+  }
+  event_del(q.writable);
+}
+
+/**
+   Abandon all queued hand-offs.  The workers they were for are
+   shutting down too, and no longer listening on their channels.
+ */
+static void
+handoff_queues_clear(void)
+{
+  for (unsigned int i = 0; i < workers.queues.size(); i++) {
+    handoff_queue &q = workers.queues[i];
+    if (!q.msgs.empty())
+      log_info("dropping %lu connections waiting to go to worker %u",
+               (unsigned long)q.msgs.size(), i);
+    for (std::deque<handoff_msg>::iterator m = q.msgs.begin();
+         m != q.msgs.end(); m++) {
+      close(m->fd);
+      free(m->data);
+    }
+    q.msgs.clear();
+    if (q.writable) {
+      event_free(q.writable);
+      q.writable = NULL;
+    }
+  }
+}
+#else
+static void
+handoff_queues_clear(void)
+{
+}
+#endif
+
+/**
+   Hand 'conn', which must have been accepted by a server listener
+   for configuration 'cfg' at index 'index', over to worker
+   number 'worker', along with 'prefix', the data already read from
+   it, which may be at most HANDOFF_MAX bytes.  'prefix' is drained.
+   If the worker's channel is full, the hand-off is queued until it
+   is not.  Either way, the connection's socket stays open for the
+   other worker; the caller should now discard 'conn' without writing
+   anything to it.  Returns 0 on success, -1 on failure.
+ */
+int
+conn_hand_off(conn_t *conn, config_t *cfg, size_t index,
+              unsigned int worker, struct evbuffer *prefix)
+{
+#ifdef _WIN32
+  (void)cfg; (void)index; (void)worker; (void)prefix;
+  log_abort(conn, "multiple workers are not supported on this platform");
+#else
+  log_assert(worker < workers.count && worker != workers.index);
+
+  handoff_header hdr;
+  for (hdr.listener = 0; hdr.listener < listeners.size(); hdr.listener++)
+    if (listeners[hdr.listener]->cfg == cfg &&
+        listeners[hdr.listener]->index == index)
+      break;
+  if (hdr.listener == listeners.size()) {
+    log_warn(conn, "no listener to hand off to");
+    return -1;
+  }
+
+  size_t len = evbuffer_get_length(prefix);
+  if (len > HANDOFF_MAX) {
+    log_warn(conn, "too much data (%lu bytes) to hand off",
+             (unsigned long)len);
+    return -1;
+  }
+  hdr.len = len;
+
+  const void *data = evbuffer_pullup(prefix, -1);
+  int fd = bufferevent_getfd(conn->buffer);
+
+  // Keep hand-offs to each worker in order: if some are already
+  // waiting, this one waits behind them.
+  if (!workers.queues[worker].msgs.empty()) {
+    if (handoff_enqueue(conn, cfg->base, worker, hdr, data, fd))
+      return -1;
+    log_debug(conn, "hand-off to worker %u queued behind %lu others",
+              worker, (unsigned long)workers.queues[worker].msgs.size() - 1);
+  } else if (handoff_send(worker, hdr, data, fd) >= 0) {
+    log_debug(conn, "handed off to worker %u with %lu bytes",
+              worker, (unsigned long)len);
+  } else if (handoff_would_block(errno)) {
+    if (handoff_enqueue(conn, cfg->base, worker, hdr, data, fd))
+      return -1;
+    log_debug(conn, "worker %u's channel is full; hand-off queued", worker);
+  } else {
+    log_warn(conn, "failed to hand off to worker %u: %s",
+             worker, strerror(errno));
+    return -1;
+  }
+  evbuffer_drain(prefix, len);
+  return 0;
+#endif
+}
+
+#ifndef _WIN32
+/**
+   Called when other workers have handed connections to us.
+ */
+static void
+handoff_cb(evutil_socket_t sock, short, void *)
+{
+  static const size_t bufsize = sizeof(handoff_header) + HANDOFF_MAX;
+  uint8_t *buf = (uint8_t *)xmalloc(bufsize);
+
+  for (;;) {
+    union {
+      struct cmsghdr align;
+      char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov;
+    struct msghdr msg;
+    iov.iov_base = buf;
+    iov.iov_len = bufsize;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+
+    ssize_t n = recvmsg(sock, &msg, 0);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        log_warn("failed to read from worker channel: %s", strerror(errno));
+      break;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+      log_warn("malformed hand-off message");
+      continue;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+
+    handoff_header hdr;
+    if (size_t(n) < sizeof hdr ||
+        (memcpy(&hdr, buf, sizeof hdr), size_t(n) != sizeof hdr + hdr.len) ||
+        hdr.listener >= listeners.size() ||
+        listeners[hdr.listener]->cfg->mode != LSN_SIMPLE_SERVER) {
+      log_warn("malformed hand-off message");
+      evutil_closesocket(fd);
+      continue;
+    }
+
+    struct sockaddr_storage ss;
+    socklen_t sslen = sizeof ss;
+    char *peername = getpeername(fd, (struct sockaddr *)&ss, &sslen)
+      ? xstrdup("[unknown]")
+      : printable_address((struct sockaddr *)&ss, sslen);
+
+    struct evbuffer *prefix = evbuffer_new();
+    if (!prefix || evbuffer_add(prefix, buf + sizeof hdr, hdr.len)) {
+      log_warn("memory allocation failure");
+      if (prefix)
+        evbuffer_free(prefix);
+      evutil_closesocket(fd);
+      free(peername);
+      continue;
+    }
+
+    listener_t *lsn = listeners[hdr.listener];
+    log_info("%s: connection from %s handed over by another worker",
+             lsn->address, peername);
+    server_accept(lsn, fd, peername, prefix);
+    evbuffer_free(prefix);
+  }
+
+  free(buf);
+}
+#endif
+
 /**
    This function is called when a client-mode listener (simple or socks)
    receives a connection.
@@ -197,11 +684,23 @@ server_listener_cb(struct evconnlistener *, evutil_socket_t fd,
 {
   listener_t *lsn = (listener_t *)closure;
   char *peername = printable_address(peeraddr, peerlen);
-  struct bufferevent *buf;
-  conn_t *conn;
 
   log_assert(lsn->cfg->mode == LSN_SIMPLE_SERVER);
   log_info("%s: new connection to server from %s", lsn->address, peername);
+  server_accept(lsn, fd, peername, NULL);
+}
+
+/**
+   Set up a server-side connection on socket 'fd' from 'peername'.  If
+   'prefix' is not NULL, its contents were already read from the
+   socket (by another worker) and are processed first.
+ */
+static void
+server_accept(listener_t *lsn, evutil_socket_t fd, char *peername,
+              struct evbuffer *prefix)
+{
+  struct bufferevent *buf;
+  conn_t *conn;
 
   buf = bufferevent_socket_new(lsn->cfg->base, fd, BEV_OPT_CLOSE_ON_FREE);
   if (!buf) {
@@ -239,6 +738,16 @@ server_listener_cb(struct evconnlistener *, evutil_socket_t fd,
   bufferevent_setcb(buf, downstream_read_cb, downstream_flush_cb,
                     downstream_event_cb, conn);
   bufferevent_enable(conn->buffer, EV_READ|EV_WRITE);
+
+  /* The bufferevent normally keeps its input buffer closed to anyone
+     else's additions. */
+  if (prefix && evbuffer_get_length(prefix) > 0) {
+    struct evbuffer *input = bufferevent_get_input(buf);
+    evbuffer_unfreeze(input, 0);
+    evbuffer_add_buffer(input, prefix);
+    evbuffer_freeze(input, 0);
+    downstream_read_cb(buf, conn);
+  }
 }
 
 /**
@@ -412,6 +921,7 @@ downstream_event_cb(struct bufferevent *bev, short what, void *arg)
 
 /**
    Close a circuit when it has finished writing out all pending data.
+   Until then, let it know whenever upstream has caught up.
  */
 static void
 upstream_flush_cb(struct bufferevent *bev, void *arg)
@@ -423,6 +933,11 @@ upstream_flush_cb(struct bufferevent *bev, void *arg)
             ckt->connected ? "" : " (not connected)",
             ckt->flushing ? "" : " (not flushing)");
 
+  if (!ckt->flushing) {
+    circuit_upstream_drained(ckt);
+    return;
+  }
+
   if (remain == 0 && ckt->flushing && ckt->connected
       && (!ckt->flush_timer || !evtimer_pending(ckt->flush_timer, NULL))) {
     bufferevent_disable(bev, EV_WRITE);
@@ -462,6 +977,18 @@ downstream_flush_cb(struct bufferevent *bev, void *arg)
   }
 }
 
+/**
+   Turn on reading and writing for CKT's upstream connection, except
+   that reading stays off while it is paused for flow control (see
+   upstream_input_cb).
+*/
+static void
+upstream_enable(circuit_t *ckt)
+{
+  bufferevent_enable(ckt->up_buffer,
+                     ckt->read_paused ? EV_WRITE : EV_READ|EV_WRITE);
+}
+
 /**
    Called when an upstream connection has just been established, or
    failed to establish.
@@ -479,7 +1006,7 @@ upstream_connect_cb(struct bufferevent *bev, short what, void *arg)
 
     bufferevent_setcb(ckt->up_buffer, upstream_read_cb, upstream_flush_cb,
                       upstream_event_cb, ckt);
-    bufferevent_enable(ckt->up_buffer, EV_READ|EV_WRITE);
+    upstream_enable(ckt);
     ckt->connected = 1;
     if (ckt->pending_eof) {
       /* Try again to process the EOF. */
@@ -515,7 +1042,7 @@ downstream_connect_cb(struct bufferevent *bev, short what, void *arg)
     bufferevent_setcb(conn->buffer, downstream_read_cb,
                       downstream_flush_cb, downstream_event_cb, conn);
 
-    bufferevent_enable(ckt->up_buffer, EV_READ|EV_WRITE);
+    upstream_enable(ckt);
     bufferevent_enable(conn->buffer, EV_READ|EV_WRITE);
     conn->connected = 1;
 
@@ -604,7 +1131,7 @@ downstream_socks_connect_cb(struct bufferevent *bev, short what, void *arg)
                       upstream_event_cb, ckt);
     bufferevent_setcb(conn->buffer, downstream_read_cb, downstream_flush_cb,
                       downstream_event_cb, conn);
-    bufferevent_enable(ckt->up_buffer, EV_READ|EV_WRITE);
+    upstream_enable(ckt);
     bufferevent_enable(conn->buffer, EV_READ|EV_WRITE);
     conn->connected = 1;
 
@@ -0,0 +1,49 @@
+/* Copyright 2012 the StegoTorus authors
+   See LICENSE for other credits and copying information
+*/
+
+/* Offline indexer for the http steg module's server trace.  Working
+   out which messages can carry data, and how much, means scanning
+   every message in the trace, which makes the server slow to start;
+   this does the scan once and writes the result next to the trace
+   (see index_payloads).  Run it from the directory the server runs
+   in, again whenever the trace changes: a stale index is ignored. */
+
+#include "util.h"
+#include "main.h"
+#include "steg/payloads.h"
+
+void
+finish_shutdown(void)
+{
+}
+
+int
+main(int argc, char **argv)
+{
+  const char *fname = "traces/server.out";
+  int i, n[MAX_CONTENT_TYPE];
+
+  if (argc > 2) {
+    fprintf(stderr, "usage: %s [trace]\n", argv[0]);
+    return 2;
+  }
+  if (argc == 2)
+    fname = argv[1];
+
+  log_set_method(LOG_METHOD_STDERR, NULL);
+  payloads pl;
+  if (!load_payloads(pl, fname))
+    return 1;
+  scan_payloads(pl);
+  if (write_payload_index(pl, fname))
+    return 1;
+
+  memset(n, 0, sizeof n);
+  for (i = 0; i < pl.payload_count; i++)
+    n[pl.info[i].content_type]++;
+  printf("%s: %d messages; %d JavaScript, %d HTML, %d PDF, %d SWF\n",
+         fname, pl.payload_count, n[HTTP_CONTENT_JAVASCRIPT],
+         n[HTTP_CONTENT_HTML], n[HTTP_CONTENT_PDF], n[HTTP_CONTENT_SWF]);
+  return 0;
+}
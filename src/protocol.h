@@ -21,8 +21,11 @@ struct config_t
   enum listen_mode           mode;
   /* stopgap, see create_outbound_connections_socks */
   bool ignore_socks_destination : 1;
+  /* how many request/response exchanges a steg module whose cover
+     protocol allows persistent connections may make on each one */
+  unsigned int max_exchanges;
 
-  config_t() : base(0), mode((enum listen_mode)-1) {}
+  config_t() : base(0), mode((enum listen_mode)-1), max_exchanges(1) {}
   virtual ~config_t();
 
   /** Return the name of the protocol associated with this
@@ -123,6 +126,7 @@ extern const proto_module *const supported_protos[];
   virtual int  recv_eof();                              \
   virtual void expect_close();                          \
   virtual void cease_transmission();                    \
+  virtual void resume_transmission();                   \
   virtual void transmit_soon(unsigned long timeout)     \
   /* deliberate absence of semicolon */
 
@@ -131,6 +135,8 @@ extern const proto_module *const supported_protos[];
   { log_abort(this, "steg stub called"); }              \
   void mod##_conn_t::cease_transmission()               \
   { log_abort(this, "steg stub called"); }              \
+  void mod##_conn_t::resume_transmission()              \
+  { log_abort(this, "steg stub called"); }              \
   void mod##_conn_t::transmit_soon(unsigned long)       \
   { log_abort(this, "steg stub called"); }
 
@@ -8,11 +8,14 @@
 #include "util.h"
 #include "connections.h"
 #include "crypt.h"
+#include "cryptpool.h"
 #include "protocol.h"
 #include "rng.h"
+#include "secmem.h"
 #include "steg.h"
 
-#include <tr1/unordered_map>
+#include <algorithm>
+#include <map>
 #include <tr1/unordered_set>
 #include <vector>
 
@@ -23,9 +26,9 @@
 #include <execinfo.h>
 #endif
 
-using std::tr1::unordered_map;
 using std::tr1::unordered_set;
 using std::vector;
+using std::multimap;
 using std::make_pair;
 
 namespace
@@ -39,33 +42,46 @@ namespace
    | 0 | 1 | 2 | 3 | 4 | 5 | 6 | 7 | 8 | 9 | A | B | C | D | E | F |
    |Sequence Number|   D   |   P   | F |           Check           |
 
-   The header is encrypted with AES in ECB mode: this is safe because
-   the header is exactly one AES block long, the sequence number is
-   never repeated, the header-encryption key is not used for anything
-   else, and the high 24 bits of the sequence number, plus the check
-   field, constitute an 80-bit MAC.  The receiver maintains a
-   256-element sliding window of acceptable sequence numbers, which
-   begins one after the highest sequence number so far _processed_
-   (not received).  If the sequence number is outside this window, or
-   the check field is not all-bits-zero, the packet is discarded.  An
-   attacker's odds of being able to manipulate the D, P, or F fields
-   or the low bits of the sequence number are therefore less than one
-   in 2^80.  Unlike TCP, our sequence numbers always start at zero on
-   a new (or freshly rekeyed) circuit, and increment by one per
-   _block_, not per byte of data.  Furthermore, they do not wrap: a
-   rekeying cycle (which resets the sequence number) is required to
-   occur before the highest-received sequence number reaches 2^32.
-
-   Following the header are two variable-length payload sections,
-   "data" and "padding", whose length in bytes are given by the D and
-   P fields, respectively.  These sections are encrypted, using a
-   different key, with AES in GCM mode.  The *encrypted* packet header
-   doubles as the GCM nonce.  The semantics of the "data" section's
-   contents, if any, are defined by the opcode F.  The "padding"
-   section SHOULD be filled with zeroes by the sender; regardless, its
-   contents MUST be ignored by the receiver.  Following these sections
-   is a 16-byte GCM authentication tag, computed over the data and
-   padding sections only, NOT the message header.  */
+   The header is encrypted with AES in ECB mode (AES-128 with the
+   default --cipher=aes128-gcm, AES-256 with chacha20-poly1305, whose
+   keys are all 32 bytes long): this is safe because the header is
+   exactly one AES block long, the sequence number is never repeated,
+   the header-encryption key is not used for anything else, and the
+   check field, plus the bits of the sequence number above the receive
+   window, constitute a MAC.  The receiver maintains a sliding window of
+   acceptable sequence numbers, which begins one after the highest
+   sequence number so far _processed_ (not received).  The window is 256
+   blocks long unless both ends are configured with a larger --window;
+   it is always a power of two, at most 4096.  If the sequence number is
+   outside this window, or the check field is not all-bits-zero, the
+   packet is discarded.  A window of 2^w blocks leaves 32 - w bits of
+   sequence number checked, so the MAC is 88 - w bits long: 80 bits
+   with the default window, 76 with the largest.  An attacker's odds of
+   being able to manipulate the D, P, or F fields or the low bits of the
+   sequence number are therefore less than one in 2^(88 - w), that is,
+   2^(80 - (log2(window) - 8)).  Unlike TCP, our sequence numbers
+   always start at zero on a new (or freshly rekeyed) circuit, and
+   increment by one per _block_, not per byte of data.  Furthermore,
+   they do not wrap: a rekeying cycle (which resets the sequence
+   number) is required to occur before the highest-received sequence
+   number reaches 2^32.
+
+   Following the header are two variable-length payload sections, "data"
+   and "padding", whose length in bytes are given by the D and P fields,
+   respectively.  These sections are encrypted, using a different key,
+   with the cipher suite's AEAD: AES in GCM mode by default, or
+   ChaCha20-Poly1305 (RFC 7539).  The *encrypted* packet header doubles
+   as the nonce.  GCM takes all 16 bytes of it; ChaCha20-Poly1305 takes
+   12, so the last four bytes are XORed into the first four.  Distinct
+   headers encrypt to distinct blocks, but folding could map two of them
+   to the same nonce; since the encrypted headers look random, the
+   chance of that among the 2^32 blocks allowed before rekeying is about
+   2^64 / 2^97 = 2^-33.  The semantics of the "data" section's contents,
+   if any, are defined by the opcode F.  The "padding" section SHOULD be
+   filled with zeroes by the sender; regardless, its contents MUST be
+   ignored by the receiver.  Following these sections is a 16-byte
+   authentication tag, computed over the data and padding sections only,
+   NOT the message header.  */
 
 const size_t HEADER_LEN = 16;
 const size_t TRAILER_LEN = 16;
@@ -75,6 +91,33 @@ const size_t MAX_BLOCK_SIZE = MIN_BLOCK_SIZE + SECTION_LEN*2;
 
 const size_t HANDSHAKE_LEN = sizeof(uint32_t);
 
+// Bounds on the receive window, in blocks.  Both must be powers of two.
+const uint32_t MIN_WINDOW_SIZE = 256;
+const uint32_t MAX_WINDOW_SIZE = 4096;
+
+// Largest number of blocks we will pack into one steg transmission.
+// This must stay well below the smallest receive window.
+const size_t MAX_COALESCED_BLOCKS = 16;
+
+// How long the ID of a destroyed circuit is remembered, by default.
+// Can be changed with --time-wait.
+const uint32_t CIRCUIT_LINGER_MS = 60 * 1000;
+const uint32_t MAX_CIRCUIT_LINGER_MS = 24 * 60 * 60 * 1000;
+
+// Most request/response exchanges --keepalive lets a steg module make
+// on one downstream connection; browsers rarely go much past this.
+const unsigned int MAX_KEEPALIVE = 100;
+
+// Flow control.  Each end of a circuit may send at most CREDIT_WINDOW
+// bytes of data beyond what its peer has already passed upstream.  As
+// the receiver passes data upstream, it grants the sender more credit
+// by sending an op_CRD block, whose data section is a 32-bit
+// big-endian byte count.  Credit is granted in batches of at least
+// CREDIT_BATCH bytes, and only while the upstream peer is keeping up.
+const size_t CREDIT_WINDOW = 1024 * 1024;
+const size_t CREDIT_BATCH = CREDIT_WINDOW / 4;
+const size_t CREDIT_LEN = sizeof(uint32_t);
+
 enum opcode_t
 {
   op_DAT = 0,       // Pass data section along to upstream
@@ -83,7 +126,8 @@ enum opcode_t
   op_RK1 = 3,       // Commence rekeying
   op_RK2 = 4,       // Continue rekeying
   op_RK3 = 5,       // Conclude rekeying
-  op_RESERVED0 = 6, // 6 -- 127 reserved for future definition
+  op_CRD = 6,       // Grant flow-control credit (see below)
+  op_RESERVED0 = 7, // 7 -- 127 reserved for future definition
   op_STEG0 = 128,   // 128 -- 255 reserved for steganography modules
   op_LAST = 255
 };
@@ -94,6 +138,12 @@ class block_header
   uint8_t ciphr[16];
 
 public:
+  block_header()
+  {
+    memset(clear, 0xFF, sizeof clear); // invalid!
+    memset(ciphr, 0xFF, sizeof ciphr);
+  }
+
   block_header(uint32_t s, uint16_t d, uint16_t p, opcode_t f,
                ecb_encryptor &ec)
   {
@@ -167,13 +217,15 @@ public:
     return opcode_t(clear[8]);
   }
 
-  bool valid(uint64_t window) const
+  // WINDOW is the lowest acceptable sequence number, and SIZE the
+  // number of acceptable sequence numbers, which must be a power of two.
+  bool valid(uint64_t window, uint32_t size = MIN_WINDOW_SIZE) const
   {
     // This check must run in constant time.
     uint8_t ck = (clear[ 9] | clear[10] | clear[11] | clear[12] |
                   clear[13] | clear[14] | clear[15]);
     uint32_t delta = seqno() - window;
-    ck |= !!(delta & ~uint32_t(0xFF));
+    ck |= !!(delta & ~(size - 1));
     return !ck;
   }
 
@@ -188,91 +240,278 @@ public:
   }
 };
 
+/* Copy LEN bytes, starting OFFSET bytes from the beginning of BUF,
+   to OUT, without removing anything from BUF.  Returns 0 on success,
+   -1 if BUF is too short.  */
+int
+copyout_at(evbuffer *buf, size_t offset, uint8_t *out, size_t len)
+{
+  struct evbuffer_ptr pos;
+  struct evbuffer_iovec v[4];
+
+  if (evbuffer_get_length(buf) < offset + len ||
+      evbuffer_ptr_set(buf, &pos, offset, EVBUFFER_PTR_SET))
+    return -1;
+
+  int n = evbuffer_peek(buf, len, &pos, v, 4);
+  if (n > 4)
+    return -1;
+  for (int i = 0; i < n && len > 0; i++) {
+    size_t chunk = std::min(len, (size_t)v[i].iov_len);
+    memcpy(out, v[i].iov_base, chunk);
+    out += chunk;
+    len -= chunk;
+  }
+  return len == 0 ? 0 : -1;
+}
+
+/* Fill in SEGS (room for MAX entries) to cover exactly the first LEN
+   bytes of BUF, flattening them first if they are too fragmented.
+   Returns the number of segments used, or -1 if BUF is too short or
+   cannot be flattened.  */
+int
+gather_segments(evbuffer *buf, size_t len, struct evbuffer_iovec *segs,
+                int max)
+{
+  if (len == 0)
+    return 0;
+
+  int n = evbuffer_peek(buf, len, NULL, segs, max);
+  if (n > max) {
+    if (!evbuffer_pullup(buf, len))
+      return -1;
+    n = evbuffer_peek(buf, len, NULL, segs, 1);
+  }
+
+  // The last segment may extend past LEN.
+  size_t got = 0;
+  for (int i = 0; i < n; i++) {
+    if (got + segs[i].iov_len > len)
+      segs[i].iov_len = len - got;
+    got += segs[i].iov_len;
+  }
+  return got == len ? n : -1;
+}
+
+/* Append LEN bytes of contiguous space to BLOCK, to be filled in
+   afterward, and return a pointer to it, or NULL on allocation
+   failure.  Nothing else may be added to BLOCK until that is done.  */
+uint8_t *
+reserve_block_space(evbuffer *block, size_t len)
+{
+  struct evbuffer_iovec v;
+  if (evbuffer_reserve_space(block, len, &v, 1) != 1 || v.iov_len < len)
+    return 0;
+  v.iov_len = len;
+  if (evbuffer_commit_space(block, &v, 1))
+    return 0;
+  return (uint8_t *)v.iov_base;
+}
+
+/* Decrypt, in place, a block whose data section is the first D bytes
+   of DATA and whose padding is the first P bytes of PAD, given its
+   authentication TAG and NONCE (the encrypted header).  Returns 0 on
+   success, -1 if the block does not authenticate.  */
+int
+open_block(gcm_decryptor &dc, evbuffer *data, size_t d, evbuffer *pad,
+           size_t p, const uint8_t *tag, const uint8_t *nonce)
+{
+  // Heavily fragmented sections are flattened first, which costs a
+  // copy but bounds the segment list.
+  struct evbuffer_iovec segs[32];
+  int nd = gather_segments(data, d, segs, 16);
+  int np = gather_segments(pad, p, segs + std::max(nd, 0), 16);
+  if (nd < 0 || np < 0)
+    return -1;
+  return dc.decrypt(segs, nd + np, tag, nonce, HEADER_LEN);
+}
+
 /* Most of a block's header information is processed before it reaches
    the reassembly queue; the only things the queue needs to record are
    the sequence number (which is stored implictly), the opcode, and an
-   evbuffer holding the data section.  Zero-data blocks still get an
-   evbuffer, for simplicity's sake: a reassembly queue element holds a
-   received block if and only if its data pointer is non-null.
-
-   The reassembly queue is a 256-element circular buffer of
-   'reassembly_elt' structs.  This corresponds to the 256-element
-   sliding window of sequence numbers which may legitimately be
-   received at any time.  */
+   evbuffer holding the data section.  Zero-data blocks (which includes
+   most control blocks) have no evbuffer at all, so a separate flag
+   records whether a reassembly queue element holds a received block.
+
+   The reassembly queue is a circular buffer of 'reassembly_elt'
+   structs, one for each sequence number in the sliding receive window.
+   Which elements hold a received block is recorded in a bitmap.  The
+   elements themselves are allocated in chunks of SLOT_CHUNK, the first
+   time a block lands in each chunk, so a circuit that never has more
+   than a few blocks in flight only pays for a few chunks, however
+   large its window.
+
+   Data evbuffers are recycled: once a block's data has been passed
+   upstream, its (now empty) evbuffer goes back on a small free list
+   owned by the queue, and is reused for the next block received.  */
 
 struct reassembly_elt
 {
   evbuffer *data;
   opcode_t op;
+  bool present;
 };
 
 class reassembly_queue
 {
-  reassembly_elt cbuf[256];
+  static const uint32_t SLOT_CHUNK = 64;
+
+  reassembly_elt **slots;   // size/SLOT_CHUNK chunks, allocated on demand
+  uint64_t *present;        // size/64 words
+  uint32_t size;
   uint32_t next_to_process;
 
+  static const size_t POOL_MAX = 8;
+  evbuffer *pool[POOL_MAX];
+  size_t pool_len;
+  uint64_t pool_hits;
+  uint64_t pool_misses;
+
   reassembly_queue(const reassembly_queue&) DELETE_METHOD;
   reassembly_queue& operator=(const reassembly_queue&) DELETE_METHOD;
 
+  bool is_present(uint32_t pos) const
+  {
+    return present[pos / 64] & (uint64_t(1) << (pos % 64));
+  }
+
+  reassembly_elt &slot(uint32_t pos)
+  {
+    reassembly_elt *&chunk = slots[pos / SLOT_CHUNK];
+    if (!chunk)
+      chunk = new reassembly_elt[SLOT_CHUNK];
+    return chunk[pos % SLOT_CHUNK];
+  }
+
 public:
   reassembly_queue()
-    : next_to_process(0)
+    : slots(0), present(0), size(0), next_to_process(0),
+      pool_len(0), pool_hits(0), pool_misses(0)
   {
-    memset(cbuf, 0, sizeof cbuf);
+    set_size(MIN_WINDOW_SIZE);
   }
 
   ~reassembly_queue()
   {
-    for (int i = 0; i < 256; i++)
-      if (cbuf[i].data)
-        evbuffer_free(cbuf[i].data);
+    for (uint32_t i = 0; i < size / SLOT_CHUNK; i++) {
+      if (!slots[i])
+        continue;
+      for (uint32_t j = 0; j < SLOT_CHUNK; j++)
+        if (slots[i][j].data)
+          evbuffer_free(slots[i][j].data);
+      delete [] slots[i];
+    }
+    delete [] slots;
+    delete [] present;
+    for (size_t i = 0; i < pool_len; i++)
+      evbuffer_free(pool[i]);
   }
 
+  // Change the size of the receive window to N blocks, which must be
+  // a power of two between MIN_WINDOW_SIZE and MAX_WINDOW_SIZE.  Only
+  // allowed while the queue is empty.
+  void
+  set_size(uint32_t n)
+  {
+    log_assert(n >= MIN_WINDOW_SIZE && n <= MAX_WINDOW_SIZE &&
+               !(n & (n - 1)));
+    if (n == size)
+      return;
+
+    for (uint32_t i = 0; i < size / 64; i++)
+      log_assert(!present[i]);
+    for (uint32_t i = 0; i < size / SLOT_CHUNK; i++)
+      delete [] slots[i];
+    delete [] slots;
+    delete [] present;
+
+    size = n;
+    slots = new reassembly_elt *[size / SLOT_CHUNK];
+    present = new uint64_t[size / 64];
+  }
+
+  // Return an empty evbuffer to hold the data section of a block,
+  // taking it from the free list if possible.  Returns NULL on
+  // allocation failure.
+  evbuffer *
+  get_buffer()
+  {
+    if (pool_len) {
+      pool_hits++;
+      return pool[--pool_len];
+    }
+    pool_misses++;
+    return evbuffer_new();
+  }
+
+  // Return DATA, which may be NULL, to the free list, or free it if
+  // the free list is full.  Any contents are discarded.
+  void
+  put_buffer(evbuffer *data)
+  {
+    if (!data)
+      return;
+    if (pool_len < POOL_MAX) {
+      evbuffer_drain(data, evbuffer_get_length(data));
+      pool[pool_len++] = data;
+    } else {
+      evbuffer_free(data);
+    }
+  }
+
+  uint64_t buffer_hits() const { return pool_hits; }
+  uint64_t buffer_misses() const { return pool_misses; }
+
   // Remove the next block to be processed from the reassembly queue
   // and return it.  If we are out of blocks or the next block to
-  // process has not yet arrived, return an empty reassembly_elt.
-  // Caller is responsible for freeing the evbuffer in the
-  // reassembly_elt, if any.
+  // process has not yet arrived, return an empty reassembly_elt
+  // (whose 'present' flag is false).  Caller is responsible for
+  // passing the evbuffer in the reassembly_elt, if any, to put_buffer.
   reassembly_elt
   remove_next()
   {
-    reassembly_elt rv = { 0, op_DAT };
-    uint8_t front = next_to_process & 0xFF;
-    log_debug("next_to_process=%d data=%p op=%02x",
-              next_to_process, cbuf[front].data, cbuf[front].op);
-    if (cbuf[front].data) {
-      rv = cbuf[front];
-      cbuf[front].data = 0;
-      cbuf[front].op   = op_DAT;
+    reassembly_elt rv = { 0, op_DAT, false };
+    uint32_t front = next_to_process & (size - 1);
+    log_debug("next_to_process=%d present=%d",
+              next_to_process, is_present(front));
+    if (is_present(front)) {
+      reassembly_elt &elt = slot(front);
+      rv = elt;
+      rv.present = true;
+      elt.data = 0;
+      elt.op   = op_DAT;
+      present[front / 64] &= ~(uint64_t(1) << (front % 64));
       next_to_process++;
     }
     return rv;
   }
 
   // Insert a block into the reassembly queue at sequence number
-  // SEQNO, with opcode OP and data section DATA.  Returns true if the
-  // block was successfully added to the queue, false if it is either
-  // outside the acceptable window or duplicates a block already on
-  // the queue (both of these cases indicate protocol errors).
-  // DATA is consumed no matter what the return value is.
+  // SEQNO, with opcode OP and data section DATA (NULL if the block
+  // has no data).  Returns true if the block was successfully added
+  // to the queue, false if it is either outside the acceptable window
+  // or duplicates a block already on the queue (both of these cases
+  // indicate protocol errors).  DATA is consumed no matter what the
+  // return value is.
   bool
   insert(uint32_t seqno, opcode_t op, evbuffer *data, conn_t *conn)
   {
-    if (seqno - window() > 255) {
+    if (seqno - window() >= size) {
       log_info(conn, "block outside receive window");
-      evbuffer_free(data);
+      put_buffer(data);
       return false;
     }
-    uint8_t front = next_to_process & 0xFF;
-    uint8_t pos = front + (seqno - window());
-    if (cbuf[pos].data) {
+    uint32_t pos = (next_to_process + (seqno - window())) & (size - 1);
+    if (is_present(pos)) {
       log_info(conn, "duplicate block");
-      evbuffer_free(data);
+      put_buffer(data);
       return false;
     }
 
-    cbuf[pos].data = data;
-    cbuf[pos].op   = op;
+    reassembly_elt &elt = slot(pos);
+    elt.data = data;
+    elt.op   = op;
+    present[pos / 64] |= uint64_t(1) << (pos % 64);
     return true;
   }
 
@@ -281,12 +520,15 @@ public:
   // block_header::valid().
   uint32_t window() const { return next_to_process; }
 
+  // Return the number of sequence numbers in the receive window.
+  uint32_t window_size() const { return size; }
+
   // As the last step of a rekeying cycle, the expected next sequence number
   // is reset to zero.
   void reset()
   {
-    for (int i = 0; i < 256; i++) {
-      log_assert(!cbuf[i].data);
+    for (uint32_t i = 0; i < size / 64; i++) {
+      log_assert(!present[i]);
     }
     next_to_process = 0;
   }
@@ -296,8 +538,275 @@ public:
 
 struct chop_config_t;
 struct chop_circuit_t;
+struct chop_conn_t;
+struct chop_seal_job;
+struct chop_open_job;
+
+// Each configuration keeps track of its circuits by circuit ID.  When
+// a circuit is destroyed, its ID lingers in the table for a while as a
+// tombstone (like TCP's TIME_WAIT state; see ~chop_circuit_t) and is
+// then purged by a timer wheel.  The table uses open addressing with
+// linear probing, so that the lookup for every new connection touches
+// as little memory as possible, and it shrinks again after a burst of
+// circuits has expired.
+class chop_circuit_table
+{
+  struct entry
+  {
+    chop_circuit_t *ckt;  // NULL for a tombstone
+    uint32_t id;
+    bool used;
+  };
+
+  // The timer wheel has this many spokes, each holding the tombstones
+  // that expire on the same tick.
+  static const size_t WHEEL_SLOTS = 64;
+  static const size_t MIN_CAPACITY = 64;
+
+  entry *slots;
+  size_t capacity;      // always a power of two, 1 << bits
+  unsigned int bits;
+  size_t n_live;
+  size_t n_tombstones;
+  uint32_t hash_key;    // odd; keeps peer-chosen IDs from clustering
+
+  vector<uint32_t> wheel[WHEEL_SLOTS];
+  size_t wheel_pos;
+  struct timeval tick;
+  uint32_t linger_ms;
+  struct event *timer;
+
+  size_t home(uint32_t id) const
+  {
+    return uint32_t(id * hash_key) >> (32 - bits);
+  }
+
+  entry *lookup(uint32_t id) const;
+  void erase(entry *e);
+  void resize(size_t n);
+  void expire();
+  static void expire_cb(evutil_socket_t, short, void *arg);
+
+  chop_circuit_table(const chop_circuit_table &);
+  chop_circuit_table &operator=(const chop_circuit_table &);
+
+public:
+  chop_circuit_table();
+  ~chop_circuit_table();
+
+  // Set how long tombstones linger, in milliseconds.  Only allowed
+  // while the table is empty.
+  void set_linger(uint32_t ms);
+  uint32_t linger() const { return linger_ms; }
+
+  // Look up ID.  Returns false if it is not in the table at all.
+  // Otherwise, sets *CKT to the circuit, or to NULL if ID belongs to
+  // a circuit that has been destroyed, and returns true.
+  bool find(uint32_t id, chop_circuit_t **ckt) const;
+
+  // Add CKT to the table under ID.  Returns false, changing nothing,
+  // if ID is already in use, or lingering as a tombstone.
+  bool insert(uint32_t id, chop_circuit_t *ckt);
+
+  // The circuit under ID is being destroyed.  Replace it with a
+  // tombstone, which will expire after the linger interval; BASE is
+  // the event base to run the expiry timer on.
+  void retire(uint32_t id, struct event_base *base);
+
+  // Metrics.
+  size_t live() const { return n_live; }
+  size_t tombstones() const { return n_tombstones; }
+  size_t slot_count() const { return capacity; }
+
+  // Return the live circuit in slot N, or NULL if there is none.  For
+  // walking the whole table; see ~chop_config_t.
+  chop_circuit_t *at(size_t n) const
+  {
+    return slots[n].used ? slots[n].ckt : 0;
+  }
+};
+
+chop_circuit_table::chop_circuit_table()
+  : slots(0), capacity(0), bits(0), n_live(0), n_tombstones(0),
+    wheel_pos(0), linger_ms(0), timer(0)
+{
+  rng_bytes((uint8_t *)&hash_key, sizeof hash_key);
+  hash_key |= 1;
+  resize(MIN_CAPACITY);
+  set_linger(CIRCUIT_LINGER_MS);
+}
+
+chop_circuit_table::~chop_circuit_table()
+{
+  if (timer)
+    event_free(timer);
+  delete [] slots;
+}
+
+void
+chop_circuit_table::set_linger(uint32_t ms)
+{
+  log_assert(n_live == 0 && n_tombstones == 0);
+  linger_ms = ms;
+
+  // A tombstone goes on the spoke just behind the current one, so it
+  // expires between WHEEL_SLOTS - 2 and WHEEL_SLOTS - 1 ticks later.
+  uint32_t tick_ms = (ms + WHEEL_SLOTS - 3) / (WHEEL_SLOTS - 2);
+  tick.tv_sec = tick_ms / 1000;
+  tick.tv_usec = (tick_ms % 1000) * 1000;
+}
+
+chop_circuit_table::entry *
+chop_circuit_table::lookup(uint32_t id) const
+{
+  for (size_t i = home(id); slots[i].used; i = (i + 1) & (capacity - 1))
+    if (slots[i].id == id)
+      return &slots[i];
+  return 0;
+}
+
+bool
+chop_circuit_table::find(uint32_t id, chop_circuit_t **ckt) const
+{
+  entry *e = lookup(id);
+  if (!e)
+    return false;
+  *ckt = e->ckt;
+  return true;
+}
+
+bool
+chop_circuit_table::insert(uint32_t id, chop_circuit_t *ckt)
+{
+  log_assert(ckt);
+  if (lookup(id))
+    return false;
+
+  // Keep the load factor at or below one half.
+  if (2 * (n_live + n_tombstones + 1) > capacity)
+    resize(capacity * 2);
+
+  size_t i = home(id);
+  while (slots[i].used)
+    i = (i + 1) & (capacity - 1);
+  slots[i].ckt = ckt;
+  slots[i].id = id;
+  slots[i].used = true;
+  n_live++;
+  return true;
+}
+
+void
+chop_circuit_table::retire(uint32_t id, struct event_base *base)
+{
+  entry *e = lookup(id);
+  log_assert(e && e->ckt);
+  n_live--;
+
+  if (linger_ms == 0 || !base) {
+    erase(e);
+    return;
+  }
+
+  e->ckt = 0;
+  n_tombstones++;
+  wheel[(wheel_pos + WHEEL_SLOTS - 1) % WHEEL_SLOTS].push_back(id);
+
+  if (!timer) {
+    timer = event_new(base, -1, EV_PERSIST, expire_cb, this);
+    if (!timer)
+      log_abort("failed to create circuit expiry timer");
+  }
+  if (n_tombstones == 1)
+    evtimer_add(timer, &tick);
+}
+
+// Remove E from the table, shifting later members of its probe
+// sequence back so that no lookup has to step over a hole.
+void
+chop_circuit_table::erase(entry *e)
+{
+  size_t mask = capacity - 1;
+  size_t i = e - slots;
+  for (size_t j = (i + 1) & mask; slots[j].used; j = (j + 1) & mask) {
+    size_t k = home(slots[j].id);
+    // Slot J may move to I only if its home is not cyclically in (I, J].
+    if (((j - k) & mask) >= ((j - i) & mask)) {
+      slots[i] = slots[j];
+      i = j;
+    }
+  }
+  slots[i].used = false;
+  slots[i].ckt = 0;
+}
+
+void
+chop_circuit_table::resize(size_t n)
+{
+  entry *old = slots;
+  size_t old_capacity = capacity;
+
+  slots = new entry[n];
+  memset(slots, 0, n * sizeof(entry));
+  capacity = n;
+  for (bits = 0; (size_t(1) << bits) < n; bits++)
+    ;
+
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (!old[i].used)
+      continue;
+    size_t j = home(old[i].id);
+    while (slots[j].used)
+      j = (j + 1) & (capacity - 1);
+    slots[j] = old[i];
+  }
+  delete [] old;
+}
+
+void
+chop_circuit_table::expire()
+{
+  wheel_pos = (wheel_pos + 1) % WHEEL_SLOTS;
+  vector<uint32_t> &spoke = wheel[wheel_pos];
+  if (spoke.empty())
+    return;
+
+  for (vector<uint32_t>::iterator i = spoke.begin(); i != spoke.end(); i++) {
+    entry *e = lookup(*i);
+    log_assert(e && !e->ckt);
+    erase(e);
+    n_tombstones--;
+  }
+  log_debug("expired %lu circuit IDs; %lu live, %lu lingering, %lu slots",
+            (unsigned long)spoke.size(), (unsigned long)n_live,
+            (unsigned long)n_tombstones, (unsigned long)capacity);
+  spoke.clear();
+
+  if (n_tombstones == 0)
+    evtimer_del(timer);
+
+  // Give back memory after a burst of circuits has gone away.
+  size_t n = capacity;
+  while (n > MIN_CAPACITY && 8 * (n_live + n_tombstones) < n)
+    n /= 2;
+  if (n < capacity)
+    resize(n);
+}
 
-typedef unordered_map<uint32_t, chop_circuit_t *> chop_circuit_table;
+void
+chop_circuit_table::expire_cb(evutil_socket_t, short, void *arg)
+{
+  static_cast<chop_circuit_table *>(arg)->expire();
+}
+
+// Each circuit indexes its downstream connections by the most data
+// (not counting the block framing or the handshake) each could carry
+// in one block right now, as reported by steg_t::transmit_capacity.
+// That is exactly what transmit_room will grant for nosteg,
+// nosteg_rr and embed, which ignore or echo the size asked for; for
+// http it is the top of the range transmit_room pads into.  See
+// chop_circuit_t::pick_connection.
+typedef multimap<size_t, chop_conn_t *> chop_offer_index;
 
 struct chop_conn_t : conn_t
 {
@@ -305,14 +814,26 @@ struct chop_conn_t : conn_t
   chop_circuit_t *upstream;
   steg_t *steg;
   struct evbuffer *recv_pending;
+  struct evbuffer *recv_raw;  // see chop_conn_t::recv
+  size_t recv_raw_seen;       // inbound bytes already in recv_raw
   struct event *must_send_timer;
+  size_t index;           // which downstream address this belongs to
+  block_header recv_hdr;  // header of the first block in recv_pending
+  chop_offer_index::iterator offer; // valid only if offer_listed
+  bool recv_hdr_known : 1;
+  bool offer_listed : 1;
+  bool offer_stale : 1;
   bool sent_handshake : 1;
   bool no_more_transmissions : 1;
+  bool xmit_busy : 1;          // blocks for us are with the crypto pool
+  bool recv_eof_deferred : 1;  // see chop_conn_t::recv_eof
 
   CONN_DECLARE_METHODS(chop);
 
   int recv_handshake();
+  int recv_block(const block_header &hdr);
   int send(struct evbuffer *block);
+  void offer_changed();
 
   void send();
   bool must_send_p() const;
@@ -323,20 +844,29 @@ struct chop_circuit_t : circuit_t
 {
   reassembly_queue recv_queue;
   unordered_set<chop_conn_t *> downstreams;
+  chop_offer_index offers;
+  vector<chop_conn_t *> stale_offers;
   gcm_encryptor *send_crypt;
   ecb_encryptor *send_hdr_crypt;
   gcm_decryptor *recv_crypt;
   ecb_decryptor *recv_hdr_crypt;
+  crypt_lane send_lane;  // serializes use of send_crypt by the crypto pool
+  crypt_lane recv_lane;  // likewise recv_crypt
   chop_config_t *config;
 
   uint32_t circuit_id;
   uint32_t send_seq;
   uint32_t dead_cycles;
+  uint64_t send_credit;  // bytes of data we may still send
+  uint64_t recv_credit;  // bytes of data our peer may still send
+  uint64_t credit_owed;  // bytes passed upstream but not yet credited
   bool received_fin : 1;
   bool sent_fin : 1;
   bool upstream_eof : 1;
+  bool destroying : 1;
 
   CIRCUIT_DECLARE_METHODS(chop);
+  virtual int upstream_drained();
 
   // Shortcut some unnecessary conversions for callers within this file.
   void add_downstream(chop_conn_t *conn);
@@ -344,11 +874,25 @@ struct chop_circuit_t : circuit_t
 
   int send_special(opcode_t f, struct evbuffer *payload);
   int send_targeted(chop_conn_t *conn);
-  int send_targeted(chop_conn_t *conn, size_t blocksize);
   int send_targeted(chop_conn_t *conn, size_t d, size_t p, opcode_t f,
                     struct evbuffer *payload);
+  int send_blocks(chop_conn_t *conn, size_t room);
+  size_t sendable();
+  bool credit_due();
+  int encode_block(chop_conn_t *conn, uint8_t *out,
+                   size_t d, size_t p, opcode_t f, struct evbuffer *payload,
+                   chop_seal_job *job);
+  int transmit(chop_conn_t *conn, struct evbuffer *block, chop_seal_job *job);
+  void send_sealed(chop_seal_job *job);
+  void recv_opened(chop_open_job *job);
+  chop_conn_t *find_downstream(unsigned int conn_serial);
 
   chop_conn_t *pick_connection(size_t desired, size_t *blocksize);
+  chop_conn_t *pick_connection_scan(size_t desired, size_t *blocksize);
+  void invalidate_offer(chop_conn_t *conn);
+  void refresh_offers();
+
+  void init_keys();
 
   int process_queue();
   int check_for_eof();
@@ -361,12 +905,55 @@ struct chop_circuit_t : circuit_t
     // For simplicity's sake, right now we hardwire this to be 30 minutes.
     return 30 * 60 * 1000;
   }
-  uint32_t flush_interval() {
-    // 10*60*1000 lies between 2^19 and 2^20.
-    uint32_t shift = std::max(1u, std::min(19u, dead_cycles));
-    uint32_t xv = std::max(1u, std::min(10u * 60 * 1000, 1u << shift));
-    return rng_range_geom(20 * 60 * 1000, xv) + 100;
-  }
+  uint32_t flush_interval();
+};
+
+// Work for the crypto pool.  A seal job encrypts the blocks of one
+// transmission, whose headers are already in place, and then hands
+// them to the connection's steg module (see send_blocks).  An open job
+// decrypts one received block and then puts it on the reassembly
+// queue (see recv_block).  Either way, the connection is remembered
+// by serial number, since it may be gone by the time the job is done.
+
+struct chop_seal_job : crypt_job
+{
+  struct seal
+  {
+    uint8_t *out;   // header, then room for the sealed sections
+    size_t d;       // data bytes, taken in order from 'data'
+    size_t p;       // padding bytes
+  };
+
+  chop_circuit_t *ckt;
+  gcm_encryptor *crypt;
+  unsigned int conn_serial;
+  struct evbuffer *block;
+  struct evbuffer *data;
+  vector<seal> seals;
+
+  chop_seal_job(chop_circuit_t *c, chop_conn_t *conn);
+  ~chop_seal_job();
+  void run();
+  void finish() { ckt->send_sealed(this); }
+};
+
+struct chop_open_job : crypt_job
+{
+  chop_circuit_t *ckt;
+  gcm_decryptor *crypt;
+  unsigned int conn_serial;
+  struct evbuffer *data;  // data section, or NULL if none
+  struct evbuffer *pad;   // padding section, or NULL if none
+  uint8_t nonce[HEADER_LEN];
+  uint8_t tag[TRAILER_LEN];
+  uint32_t seqno;
+  opcode_t op;
+  bool ok;
+
+  chop_open_job(chop_circuit_t *c, chop_conn_t *conn, const block_header &hdr);
+  ~chop_open_job();
+  void run();
+  void finish() { ckt->recv_opened(this); }
 };
 
 struct chop_config_t : config_t
@@ -376,12 +963,34 @@ struct chop_config_t : config_t
   vector<steg_config_t *> steg_targets;
   chop_circuit_table circuits;
 
+  // Size of each circuit's receive window, in blocks.  The peer must
+  // be configured with the same size.
+  uint32_t window_size;
+
+  // Cipher suite for headers and payloads.  The peer must be
+  // configured with the same suite.
+  cipher_suite cipher;
+
+  // The passphrase, stretched once at startup.  Per-circuit keys are
+  // expanded from this and the circuit ID; see chop_circuit_t::init_keys.
+  // SHA256_LEN bytes, in the key arena.
+  uint8_t *master_key;
+
+  // Samplers for chop_circuit_t::flush_interval, indexed by the log2
+  // of the expected interval.  Each is built when first needed.
+  rng_geom_sampler *flush_delays[20];
+
   CONFIG_DECLARE_METHODS(chop);
 };
 
 // Configuration methods
 
+const char passphrase[] =
+  "did you buy one of therapist reawaken chemists continually gamma pacifies?";
+
 chop_config_t::chop_config_t()
+  : window_size(MIN_WINDOW_SIZE), cipher(CIPHER_AES128_GCM),
+    master_key((uint8_t *)secmem_alloc(SHA256_LEN)), flush_delays()
 {
   ignore_socks_destination = true;
 }
@@ -398,10 +1007,26 @@ chop_config_t::~chop_config_t()
        i != steg_targets.end(); i++)
     delete *i;
 
-  for (chop_circuit_table::iterator i = circuits.begin();
-       i != circuits.end(); i++)
-    if (i->second)
-      delete i->second;
+  log_info("chop: circuit table at exit: %lu live, %lu lingering, "
+           "%lu slots",
+           (unsigned long)circuits.live(),
+           (unsigned long)circuits.tombstones(),
+           (unsigned long)circuits.slot_count());
+
+  // Deleting a circuit retires it from the table, which can shuffle
+  // the remaining entries, so collect them all first.
+  vector<chop_circuit_t *> live;
+  for (size_t i = 0; i < circuits.slot_count(); i++)
+    if (chop_circuit_t *ckt = circuits.at(i))
+      live.push_back(ckt);
+  for (vector<chop_circuit_t *>::iterator i = live.begin();
+       i != live.end(); i++)
+    delete *i;
+
+  secmem_free(master_key, SHA256_LEN);
+
+  for (size_t i = 0; i < sizeof flush_delays / sizeof flush_delays[0]; i++)
+    delete flush_delays[i];
 }
 
 bool
@@ -411,6 +1036,49 @@ chop_config_t::init(int n_options, const char *const *options)
   int listen_up;
   int i;
 
+  while (n_options > 0 && !strncmp(options[0], "--", 2)) {
+    if (!strncmp(options[0], "--window=", 9)) {
+      char *end;
+      unsigned long n = strtoul(options[0] + 9, &end, 10);
+      if (*end || n < MIN_WINDOW_SIZE || n > MAX_WINDOW_SIZE || (n & (n - 1))) {
+        log_warn("chop: window size must be a power of two "
+                 "between %u and %u: %s", MIN_WINDOW_SIZE, MAX_WINDOW_SIZE,
+                 options[0] + 9);
+        goto usage;
+      }
+      window_size = n;
+    } else if (!strncmp(options[0], "--time-wait=", 12)) {
+      char *end;
+      unsigned long n = strtoul(options[0] + 12, &end, 10);
+      if (!options[0][12] || *end || n > MAX_CIRCUIT_LINGER_MS / 1000) {
+        log_warn("chop: time-wait interval must be a number of seconds "
+                 "between 0 and %u: %s", MAX_CIRCUIT_LINGER_MS / 1000,
+                 options[0] + 12);
+        goto usage;
+      }
+      circuits.set_linger(n * 1000);
+    } else if (!strncmp(options[0], "--keepalive=", 12)) {
+      char *end;
+      unsigned long n = strtoul(options[0] + 12, &end, 10);
+      if (!options[0][12] || *end || n < 1 || n > MAX_KEEPALIVE) {
+        log_warn("chop: keepalive must be a number of exchanges "
+                 "between 1 and %u: %s", MAX_KEEPALIVE, options[0] + 12);
+        goto usage;
+      }
+      max_exchanges = n;
+    } else if (!strncmp(options[0], "--cipher=", 9)) {
+      if (cipher_suite_by_name(options[0] + 9, &cipher)) {
+        log_warn("chop: unknown cipher suite: %s", options[0] + 9);
+        goto usage;
+      }
+    } else {
+      log_warn("chop: unrecognized option '%s'", options[0]);
+      goto usage;
+    }
+    options++;
+    n_options--;
+  }
+
   if (n_options < 3) {
     log_warn("chop: not enough parameters");
     goto usage;
@@ -460,11 +1128,29 @@ chop_config_t::init(int n_options, const char *const *options)
     }
     steg_targets.push_back(steg_new(options[i], this));
   }
+
+  // PBKDF2 is deliberately slow; do it only once per configuration,
+  // not once per circuit.
+  key_generator::stretch_passphrase(master_key,
+                                    (const uint8_t *)passphrase,
+                                    sizeof(passphrase) - 1, 0, 0);
   return true;
 
  usage:
   log_warn("chop syntax:\n"
-           "\tchop <mode> <up_address> (<down_address> [<steg>])...\n"
+           "\tchop [--window=<n>] [--time-wait=<secs>] [--cipher=<suite>] "
+           "[--keepalive=<n>] "
+           "<mode> <up_address> (<down_address> [<steg>])...\n"
+           "\t\twindow ~ receive window in blocks, a power of two from "
+           "256 to 4096\n"
+           "\t\t\t(must be the same at both ends)\n"
+           "\t\ttime-wait ~ how long to remember closed circuits "
+           "(default 60)\n"
+           "\t\tcipher ~ aes128-gcm (default) or chacha20-poly1305\n"
+           "\t\t\t(must be the same at both ends)\n"
+           "\t\tkeepalive ~ requests per connection, for steg modules "
+           "that can reuse\n"
+           "\t\t\tthem (default 1; must be the same at both ends)\n"
            "\t\tmode ~ server|client|socks\n"
            "\t\tup_address, down_address ~ host:port\n"
            "\t\tA steganographer is required for each down_address.\n"
@@ -505,51 +1191,65 @@ chop_config_t::get_target_addrs(size_t n)
 
 // Circuit methods
 
-const char passphrase[] =
-  "did you buy one of therapist reawaken chemists continually gamma pacifies?";
-
 circuit_t *
 chop_config_t::circuit_create(size_t)
 {
   chop_circuit_t *ckt = new chop_circuit_t;
   ckt->config = this;
+  ckt->recv_queue.set_size(window_size);
 
-  key_generator *kgen =
-    key_generator::from_passphrase((const uint8_t *)passphrase,
-                                   sizeof(passphrase) - 1,
-                                   0, 0, 0, 0);
-
-  if (mode == LSN_SIMPLE_SERVER) {
-    ckt->send_crypt     = gcm_encryptor::create(kgen, 16);
-    ckt->send_hdr_crypt = ecb_encryptor::create(kgen, 16);
-    ckt->recv_crypt     = gcm_decryptor::create(kgen, 16);
-    ckt->recv_hdr_crypt = ecb_decryptor::create(kgen, 16);
-  } else {
-    ckt->recv_crypt     = gcm_decryptor::create(kgen, 16);
-    ckt->recv_hdr_crypt = ecb_decryptor::create(kgen, 16);
-    ckt->send_crypt     = gcm_encryptor::create(kgen, 16);
-    ckt->send_hdr_crypt = ecb_encryptor::create(kgen, 16);
-
-    std::pair<chop_circuit_table::iterator, bool> out;
+  // On the server side, the circuit ID (and therefore the keys) are
+  // not known until chop_conn_t::recv_handshake.
+  if (mode != LSN_SIMPLE_SERVER) {
+    // Each client worker draws from its own residue class, so that
+    // two workers never pick the same circuit ID.
     do {
-      do {
-        rng_bytes((uint8_t *)&ckt->circuit_id, sizeof(ckt->circuit_id));
-      } while (!ckt->circuit_id);
+      rng_bytes((uint8_t *)&ckt->circuit_id, sizeof(ckt->circuit_id));
+    } while (!ckt->circuit_id ||
+             ckt->circuit_id % worker_count() != worker_index() ||
+             !circuits.insert(ckt->circuit_id, ckt));
 
-      out = circuits.insert(make_pair(ckt->circuit_id, (chop_circuit_t *)0));
-    } while (!out.second);
-
-    out.first->second = ckt;
+    ckt->init_keys();
   }
 
-  delete kgen;
   return ckt;
 }
 
 chop_circuit_t::chop_circuit_t()
+  : send_credit(CREDIT_WINDOW), recv_credit(CREDIT_WINDOW)
 {
 }
 
+/* Derive this circuit's keys from the configuration's master key and
+   the circuit ID.  This is only HKDF-Expand, so it is cheap enough to
+   do for every new circuit.  Both sides draw keys from the same
+   stream, so the order of the create() calls matters.  */
+void
+chop_circuit_t::init_keys()
+{
+  log_assert(!send_crypt);
+
+  key_generator *kgen =
+    key_generator::from_prk(config->master_key,
+                            (const uint8_t *)&circuit_id,
+                            sizeof circuit_id);
+
+  cipher_suite cs = config->cipher;
+  if (config->mode == LSN_SIMPLE_SERVER) {
+    send_crypt     = gcm_encryptor::create(cs, kgen);
+    send_hdr_crypt = ecb_encryptor::create(cs, kgen);
+    recv_crypt     = gcm_decryptor::create(cs, kgen);
+    recv_hdr_crypt = ecb_decryptor::create(cs, kgen);
+  } else {
+    recv_crypt     = gcm_decryptor::create(cs, kgen);
+    recv_hdr_crypt = ecb_decryptor::create(cs, kgen);
+    send_crypt     = gcm_encryptor::create(cs, kgen);
+    send_hdr_crypt = ecb_encryptor::create(cs, kgen);
+  }
+
+  delete kgen;
+}
+
 chop_circuit_t::~chop_circuit_t()
 {
   if (!sent_fin || !received_fin || !upstream_eof) {
@@ -565,23 +1265,37 @@ chop_circuit_t::~chop_circuit_t()
 #endif
   }
 
+  log_debug(this, "receive buffer pool: %llu hits, %llu misses",
+            (unsigned long long)recv_queue.buffer_hits(),
+            (unsigned long long)recv_queue.buffer_misses());
+
+  // Blocks still being sealed may include our FIN.  Transmit them
+  // before the connections are flushed.
+  destroying = true;
+  send_lane.complete();
+
   for (unordered_set<chop_conn_t *>::iterator i = downstreams.begin();
        i != downstreams.end(); i++) {
     chop_conn_t *conn = *i;
     conn->upstream = NULL;
+    conn->offer_listed = false;
+    conn->offer_stale = false;
     if (evbuffer_get_length(conn->outbound()) > 0)
       conn_do_flush(conn);
     else
       delete conn;
   }
 
+  // Nothing may still be using the keys when they go away.
+  send_lane.cancel();
+  recv_lane.cancel();
   delete send_crypt;
   delete send_hdr_crypt;
   delete recv_crypt;
   delete recv_hdr_crypt;
 
-  // The IDs for old circuits are preserved for a while (at present,
-  // indefinitely; FIXME: purge them on a timer) against the
+  // The IDs for old circuits are preserved for a while (one minute,
+  // unless configured otherwise with --time-wait) against the
   // possibility that we'll get a junk connection for one of them
   // right after we close it (same deal as the TIME_WAIT state in
   // TCP).  Note that we can hit this case for the *client* if the
@@ -589,11 +1303,9 @@ chop_circuit_t::~chop_circuit_t()
   // and the hidden channel closed s->c before c->s: the circuit will
   // get destroyed on the client side after the c->s FIN, and the
   // mandatory reply will be to a stale circuit.
-  chop_circuit_table::iterator out;
-  out = config->circuits.find(circuit_id);
-  log_assert(out != config->circuits.end());
-  log_assert(out->second == this);
-  out->second = NULL;
+  chop_circuit_t *ck = 0;
+  log_assert(config->circuits.find(circuit_id, &ck) && ck == this);
+  config->circuits.retire(circuit_id, config->base);
 }
 
 config_t *
@@ -609,6 +1321,7 @@ chop_circuit_t::add_downstream(chop_conn_t *conn)
   log_assert(!conn->upstream);
   conn->upstream = this;
   downstreams.insert(conn);
+  invalidate_offer(conn);
 
   log_debug(this, "added connection <%d.%d> to %s, now %lu",
             serial, conn->serial, conn->peername,
@@ -632,6 +1345,16 @@ chop_circuit_t::drop_downstream(chop_conn_t *conn)
   conn->upstream = NULL;
   downstreams.erase(conn);
 
+  if (conn->offer_listed) {
+    offers.erase(conn->offer);
+    conn->offer_listed = false;
+  }
+  if (conn->offer_stale) {
+    stale_offers.erase(std::find(stale_offers.begin(), stale_offers.end(),
+                                 conn));
+    conn->offer_stale = false;
+  }
+
   log_debug(this, "dropped connection <%d.%d> to %s, now %lu",
             serial, conn->serial, conn->peername,
             (unsigned long)downstreams.size());
@@ -670,32 +1393,54 @@ chop_circuit_t::send()
   circuit_disarm_flush_timer(this);
 
   struct evbuffer *xmit_pending = bufferevent_get_input(up_buffer);
-  size_t avail = evbuffer_get_length(xmit_pending);
+  size_t avail = sendable();
   size_t avail0 = avail;
+  bool stuck = downstreams.empty();
 
-  if (downstreams.empty()) {
+  if (stuck) {
     log_debug(this, "no downstream connections");
   } else {
     // Send at least one block, even if there is no real data to send.
     do {
       log_debug(this, "%lu bytes to send", (unsigned long)avail);
+      // Ask for enough room to carry any credit we owe, as well.
+      size_t want = avail;
+      if (credit_due())
+        want += avail ? MIN_BLOCK_SIZE + CREDIT_LEN : CREDIT_LEN;
       size_t blocksize;
-      chop_conn_t *target = pick_connection(avail, &blocksize);
+      chop_conn_t *target = pick_connection(want, &blocksize);
       if (!target) {
         // this is not an error; it can happen e.g. when the server has
         // something to send immediately and the client hasn't spoken yet
         log_debug(this, "no target connection available");
+        stuck = true;
         break;
       }
 
-      if (send_targeted(target, blocksize))
+      if (send_blocks(target, blocksize))
         return -1;
 
-      avail = evbuffer_get_length(xmit_pending);
+      avail = sendable();
     } while (avail > 0);
   }
 
-  if (avail0 == avail) { // no forward progress
+  if (avail0 == avail && send_credit == 0
+      && evbuffer_get_length(xmit_pending) > 0) {
+    // Our peer is not keeping up.  This is not a dead cycle; more
+    // credit will arrive when it catches up.  But it can only arrive
+    // over a connection the client opened, so if none of ours can
+    // carry anything, the client must open another and send chaff
+    // on it.
+    if (stuck && config->mode != LSN_SIMPLE_SERVER
+        && downstreams.size() < config->window_size / 2 - 1)
+      circuit_reopen_downstreams(this);
+    else
+      log_debug(this, "waiting for flow-control credit");
+  } else if (avail0 == avail && send_lane.busy()) {
+    // Connections are tied up with transmissions being sealed;
+    // send_sealed will call us again.
+    log_debug(this, "waiting for the crypto pool");
+  } else if (avail0 == avail) { // no forward progress
     dead_cycles++;
     log_debug(this, "%u dead cycles", dead_cycles);
 
@@ -704,9 +1449,10 @@ chop_circuit_t::send()
     // client, try opening new connections.  If we're the server, we
     // have to just twiddle our thumbs and hope the client does that.
     // Note that due to the sliding window of receive blocks, there is
-    // a hard upper limit of 127 outstanding connections (that is,
-    // half the receive window).
-    if ((avail0 > 0 && downstreams.size() < 127) || downstreams.empty()) {
+    // a hard upper limit on outstanding connections of one less than
+    // half the receive window.
+    if ((avail0 > 0 && downstreams.size() < config->window_size / 2 - 1)
+        || downstreams.empty()) {
       if (config->mode != LSN_SIMPLE_SERVER)
         circuit_reopen_downstreams(this);
       else
@@ -724,6 +1470,45 @@ chop_circuit_t::send_eof()
   return send();
 }
 
+int
+chop_circuit_t::upstream_drained()
+{
+  if (credit_due())
+    return send();
+  return 0;
+}
+
+// Return how much of the data waiting to be sent our peer has given
+// us credit for.
+size_t
+chop_circuit_t::sendable()
+{
+  size_t avail = evbuffer_get_length(bufferevent_get_input(up_buffer));
+  return std::min(avail, (size_t)std::min(send_credit, uint64_t(SIZE_MAX)));
+}
+
+// Return true if we should grant our peer more credit now.  We hold
+// it back while the upstream peer is slow to take what we have
+// already passed along; upstream_drained tells us when to try again.
+bool
+chop_circuit_t::credit_due()
+{
+  return (credit_owed >= CREDIT_BATCH && !received_fin &&
+          evbuffer_get_length(bufferevent_get_output(up_buffer))
+          <= CIRCUIT_UP_WRITE_LOW_WATER);
+}
+
+uint32_t
+chop_circuit_t::flush_interval()
+{
+  // 10*60*1000 lies between 2^19 and 2^20.
+  uint32_t shift = std::max(1u, std::min(19u, dead_cycles));
+  rng_geom_sampler *&delay = config->flush_delays[shift];
+  if (!delay)
+    delay = new rng_geom_sampler(20 * 60 * 1000, 1u << shift);
+  return delay->sample() + 100;
+}
+
 int
 chop_circuit_t::send_special(opcode_t f, struct evbuffer *payload)
 {
@@ -748,7 +1533,7 @@ chop_circuit_t::send_special(opcode_t f, struct evbuffer *payload)
 int
 chop_circuit_t::send_targeted(chop_conn_t *conn)
 {
-  size_t avail = evbuffer_get_length(bufferevent_get_input(up_buffer));
+  size_t avail = sendable();
   if (avail > SECTION_LEN)
     avail = SECTION_LEN;
   avail += MIN_BLOCK_SIZE;
@@ -775,93 +1560,245 @@ chop_circuit_t::send_targeted(chop_conn_t *conn)
   log_debug(conn, "requests %lu bytes (%s)", (unsigned long)room,
             conn->steg->cfg()->name());
 
-  return send_targeted(conn, room);
+  return send_blocks(conn, room);
 }
 
 int
-chop_circuit_t::send_targeted(chop_conn_t *conn, size_t blocksize)
+chop_circuit_t::send_targeted(chop_conn_t *conn, size_t d, size_t p, opcode_t f,
+                              struct evbuffer *payload)
 {
-  size_t lo = MIN_BLOCK_SIZE, hi = MAX_BLOCK_SIZE;
-  if (!conn->sent_handshake) {
-    lo += HANDSHAKE_LEN;
-    hi += HANDSHAKE_LEN;
+  size_t blocksize = d + p + MIN_BLOCK_SIZE;
+  struct evbuffer *block = evbuffer_new();
+  uint8_t *out = block ? reserve_block_space(block, blocksize) : 0;
+  if (!out) {
+    log_warn(conn, "memory allocation failure");
+    if (block)
+      evbuffer_free(block);
+    return -1;
   }
-  log_assert(blocksize >= lo && blocksize <= hi);
 
-  struct evbuffer *xmit_pending = bufferevent_get_input(up_buffer);
-  size_t avail = evbuffer_get_length(xmit_pending);
-  opcode_t op = op_DAT;
+  chop_seal_job *job = 0;
+  if (send_lane.busy())
+    job = new chop_seal_job(this, conn);
 
-  if (avail > blocksize - lo)
-    avail = blocksize - lo;
-  else if (avail > SECTION_LEN)
-    avail = SECTION_LEN;
-  else if (upstream_eof && !sent_fin)
-    // this block will carry the last byte of real data to be sent in
-    // this direction; mark it as such
-    op = op_FIN;
+  if (encode_block(conn, out, d, p, f, payload, job)) {
+    delete job;
+    evbuffer_free(block);
+    return -1;
+  }
 
-  return send_targeted(conn, avail, (blocksize - lo) - avail,
-                       op, xmit_pending);
+  return transmit(conn, block, job);
 }
 
+// Fill a transmission of ROOM bytes (including any handshake) with
+// as many consecutive blocks as it takes, and hand them all to CONN's
+// steg module at once.  Any credit due to our peer goes first.  Data
+// goes in the earliest blocks after that; padding fills out the last
+// one, spilling into a block of its own if need be.
 int
-chop_circuit_t::send_targeted(chop_conn_t *conn, size_t d, size_t p, opcode_t f,
-                              struct evbuffer *payload)
+chop_circuit_t::send_blocks(chop_conn_t *conn, size_t room)
 {
-  log_assert(payload || d == 0);
-  log_assert(d <= SECTION_LEN);
-  log_assert(p <= SECTION_LEN);
-
+  struct evbuffer *xmit_pending = bufferevent_get_input(up_buffer);
+  size_t left = room - (conn->sent_handshake ? 0 : HANDSHAKE_LEN);
   struct evbuffer *block = evbuffer_new();
-  if (!block) {
+  uint8_t *out = block ? reserve_block_space(block, left) : 0;
+  if (!out) {
     log_warn(conn, "memory allocation failure");
+    if (block)
+      evbuffer_free(block);
     return -1;
   }
 
-  size_t blocksize = d + p + MIN_BLOCK_SIZE;
-  struct evbuffer_iovec v;
-  if (evbuffer_reserve_space(block, blocksize, &v, 1) != 1 ||
-      v.iov_len < blocksize) {
-    log_warn(conn, "memory allocation failure");
-    return -1;
+  // Large transmissions are sealed by the crypto pool, and so is
+  // everything else while it has any of ours to do.
+  chop_seal_job *job = 0;
+  if (send_lane.busy() || crypt_pool_offload(left))
+    job = new chop_seal_job(this, conn);
+
+  if (credit_due() && (left == MIN_BLOCK_SIZE + CREDIT_LEN ||
+                       left >= 2*MIN_BLOCK_SIZE + CREDIT_LEN)) {
+    uint32_t grant = std::min(credit_owed, uint64_t(UINT32_MAX));
+    uint8_t wire[CREDIT_LEN] = {
+      uint8_t(grant >> 24), uint8_t(grant >> 16),
+      uint8_t(grant >>  8), uint8_t(grant      )
+    };
+    struct evbuffer *payload = evbuffer_new();
+    if (!payload || evbuffer_add(payload, wire, CREDIT_LEN) ||
+        encode_block(conn, out, CREDIT_LEN, 0, op_CRD, payload, job)) {
+      log_warn(conn, "failed to encode credit block");
+      if (payload)
+        evbuffer_free(payload);
+      delete job;
+      evbuffer_free(block);
+      return -1;
+    }
+    evbuffer_free(payload);
+    out += MIN_BLOCK_SIZE + CREDIT_LEN;
+    log_debug(conn, "granting %u bytes of credit", grant);
+    credit_owed -= grant;
+    recv_credit += grant;
+    left -= MIN_BLOCK_SIZE + CREDIT_LEN;
+  }
+
+  while (left > 0) {
+    log_assert(left >= MIN_BLOCK_SIZE);
+    size_t queued = evbuffer_get_length(xmit_pending);
+    size_t avail = std::min(queued, (size_t)send_credit);
+    size_t d = std::min(std::min(avail, SECTION_LEN), left - MIN_BLOCK_SIZE);
+    size_t rest = left - MIN_BLOCK_SIZE - d;
+    size_t p = 0;
+
+    // Pad this block unless the next one will carry data.  Never
+    // leave less than a minimal block's worth of room behind.
+    if (avail == d || rest < MIN_BLOCK_SIZE) {
+      p = std::min(rest, SECTION_LEN);
+      if (rest - p > 0 && rest - p < MIN_BLOCK_SIZE)
+        p -= MIN_BLOCK_SIZE - (rest - p);
+    }
+    left = rest - p;
+
+    opcode_t op = op_DAT;
+    if (left == 0 && queued == d && upstream_eof && !sent_fin)
+      op = op_FIN;
+
+    if (encode_block(conn, out, d, p, op, xmit_pending, job)) {
+      delete job;
+      evbuffer_free(block);
+      return -1;
+    }
+    out += MIN_BLOCK_SIZE + d + p;
+  }
+
+  return transmit(conn, block, job);
+}
+
+// Hand BLOCK, which holds one or more encoded blocks, to CONN's steg
+// module, and free it.  If JOB is not NULL, the blocks still have to
+// be sealed; that happens on the crypto pool, and the transmission
+// itself is finished by send_sealed.  Meanwhile CONN offers no room.
+int
+chop_circuit_t::transmit(chop_conn_t *conn, struct evbuffer *block,
+                         chop_seal_job *job)
+{
+  if (job) {
+    job->block = block;
+    conn->xmit_busy = true;
+    invalidate_offer(conn);
+    send_lane.submit(job);
+    return 0;
+  }
+
+  int rv = conn->send(block);
+  evbuffer_free(block);
+  return rv;
+}
+
+// The crypto pool has sealed JOB's blocks; transmit them, and carry
+// on as process_queue would (unless the circuit is on its way out).
+// If the connection went away meanwhile, so did the blocks, just as
+// if they had been lost on the wire.
+void
+chop_circuit_t::send_sealed(chop_seal_job *job)
+{
+  chop_conn_t *conn = find_downstream(job->conn_serial);
+  if (!conn) {
+    log_debug(this, "connection <%u.%u> closed before its blocks were sealed",
+              serial, job->conn_serial);
+  } else {
+    conn->xmit_busy = false;
+    if (destroying) {
+      if (conn->send(job->block))
+        log_info(conn, "error during transmit");
+      return;
+    }
+    if (conn->send(job->block)) {
+      log_info(this, "error during transmit");
+      delete this;
+      return;
+    }
+  }
+  if (destroying)
+    return;
+
+  int rv;
+  if (sendable() || (upstream_eof && !sent_fin) || credit_due())
+    rv = send();
+  else
+    rv = check_for_eof();
+  if (rv) {
+    log_info(this, "error during transmit");
+    delete this;
+    return;
   }
-  v.iov_len = blocksize;
+
+  // If our peer closed the connection while the blocks were being
+  // sealed, finish what recv_eof started.  This may destroy the
+  // circuit, so it has to come last.
+  conn = find_downstream(job->conn_serial);
+  if (conn && conn->recv_eof_deferred && !conn->xmit_busy) {
+    conn->recv_eof_deferred = false;
+    if ((sent_fin || conn->no_more_transmissions) && !conn->must_send_p())
+      drop_downstream(conn);
+  }
+}
+
+chop_conn_t *
+chop_circuit_t::find_downstream(unsigned int conn_serial)
+{
+  for (unordered_set<chop_conn_t *>::iterator i = downstreams.begin();
+       i != downstreams.end(); i++)
+    if ((*i)->serial == conn_serial)
+      return *i;
+  return 0;
+}
+
+// Encode one block carrying D bytes from PAYLOAD and P bytes of
+// padding, at OUT.  The data is drained from PAYLOAD and the block is
+// accounted as sent.  If JOB is NULL, the block is encrypted right
+// away; otherwise only its header is written, and its data is moved
+// to JOB for sealing later.
+int
+chop_circuit_t::encode_block(chop_conn_t *conn, uint8_t *out,
+                             size_t d, size_t p, opcode_t f,
+                             struct evbuffer *payload, chop_seal_job *job)
+{
+  log_assert(payload || d == 0);
+  log_assert(d <= SECTION_LEN);
+  log_assert(p <= SECTION_LEN);
 
   block_header hdr(send_seq, d, p, f, *send_hdr_crypt);
   log_assert(hdr.valid(send_seq));
-  memcpy(v.iov_base, hdr.nonce(), HEADER_LEN);
+  memcpy(out, hdr.nonce(), HEADER_LEN);
 
-  uint8_t encodebuf[SECTION_LEN*2];
-  if (payload) {
-    if (evbuffer_copyout(payload, encodebuf, d) != (ssize_t)d) {
+  if (job) {
+    if (d > 0 && ((!job->data && !(job->data = evbuffer_new())) ||
+                  evbuffer_remove_buffer(payload, job->data, d) != (int)d)) {
       log_warn(conn, "failed to extract payload");
-      evbuffer_free(block);
       return -1;
     }
-  }
-  memset(encodebuf + d, 0, p);
-  send_crypt->encrypt((uint8_t *)v.iov_base + HEADER_LEN, encodebuf,
-                      d + p, hdr.nonce(), HEADER_LEN);
-  if (evbuffer_commit_space(block, &v, 1)) {
-    log_warn(conn, "failed to commit block buffer");
-    evbuffer_free(block);
-    return -1;
+    chop_seal_job::seal s = { out, d, p };
+    job->seals.push_back(s);
+  } else {
+    // Encrypt the data section straight out of the payload's chains.
+    // If it is unusually fragmented, flatten it first.
+    struct evbuffer_iovec segs[8];
+    int nsegs = gather_segments(payload, d, segs, 8);
+    if (nsegs < 0) {
+      log_warn(conn, "failed to extract payload");
+      return -1;
+    }
+    send_crypt->encrypt(out + HEADER_LEN, segs, nsegs, p, out, HEADER_LEN);
+    if (d > 0)
+      evbuffer_drain(payload, d);
   }
 
   log_debug(conn, "transmitting block %u <d=%lu p=%lu f=%02x>",
             hdr.seqno(), (unsigned long)hdr.dlen(), (unsigned long)hdr.plen(),
             (uint8_t)hdr.opcode());
 
-  if (conn->send(block)) {
-    evbuffer_free(block);
-    return -1;
-  }
-
-  evbuffer_free(block);
-  evbuffer_drain(payload, d);
-
   send_seq++;
+  if (f == op_DAT || f == op_FIN)
+    send_credit -= d;
   if (f == op_FIN)
     sent_fin = true;
   if ((f == op_DAT || f == op_FIN) && d > 0)
@@ -871,10 +1808,150 @@ chop_circuit_t::send_targeted(chop_conn_t *conn, size_t d, size_t p, opcode_t f,
   return 0;
 }
 
+chop_seal_job::chop_seal_job(chop_circuit_t *c, chop_conn_t *conn)
+  : ckt(c), crypt(c->send_crypt), conn_serial(conn->serial), block(0),
+    data(0)
+{
+}
+
+chop_seal_job::~chop_seal_job()
+{
+  if (block)
+    evbuffer_free(block);
+  if (data)
+    evbuffer_free(data);
+}
+
+// Runs on a crypto pool thread; see encode_block for the inline
+// equivalent.
+void
+chop_seal_job::run()
+{
+  for (vector<seal>::iterator s = seals.begin(); s != seals.end(); s++) {
+    struct evbuffer_iovec segs[8];
+    int nsegs = gather_segments(data, s->d, segs, 8);
+    log_assert(nsegs >= 0);
+    crypt->encrypt(s->out + HEADER_LEN, segs, nsegs, s->p,
+                   s->out, HEADER_LEN);
+    if (s->d > 0)
+      evbuffer_drain(data, s->d);
+  }
+}
+
+// Note that CONN's steg module may now be willing to transmit a
+// different amount than it was before.
+void
+chop_circuit_t::invalidate_offer(chop_conn_t *conn)
+{
+  if (!conn->offer_stale) {
+    conn->offer_stale = true;
+    stale_offers.push_back(conn);
+  }
+}
+
+// Ask each connection whose offer is out of date how much it can
+// carry, and update the offer index accordingly.
+void
+chop_circuit_t::refresh_offers()
+{
+  for (vector<chop_conn_t *>::iterator i = stale_offers.begin();
+       i != stale_offers.end(); i++) {
+    chop_conn_t *conn = *i;
+    conn->offer_stale = false;
+    if (conn->offer_listed) {
+      offers.erase(conn->offer);
+      conn->offer_listed = false;
+    }
+    if (!conn->steg || conn->xmit_busy)
+      continue;
+
+    size_t shake = conn->sent_handshake ? 0 : HANDSHAKE_LEN;
+    size_t room = conn->steg->transmit_capacity(MIN_BLOCK_SIZE + shake,
+                                                MAX_BLOCK_SIZE + shake);
+    if (room == 0)
+      continue;
+    if (room < MIN_BLOCK_SIZE + shake || room > MAX_BLOCK_SIZE + shake)
+      log_abort(conn, "steg capacity (%lu) out of range [%lu, %lu]",
+                (unsigned long)room,
+                (unsigned long)(MIN_BLOCK_SIZE + shake),
+                (unsigned long)(MAX_BLOCK_SIZE + shake));
+
+    conn->offer = offers.insert(make_pair(room - shake, conn));
+    conn->offer_listed = true;
+  }
+  stale_offers.clear();
+}
+
 // N.B. 'desired' is the desired size of the _data section_, and
-// 'blocksize' on output is the size to make the _entire block_.
+// 'blocksize' on output is the size to make the _entire
+// transmission_, which may hold several blocks.
+//
+// The best fit is the connection with the smallest offer that can
+// take a full block's worth of the data, or failing that, the one
+// with the largest offer.  Only the chosen connection's steg module
+// is then asked how much to send, and if there is more data than
+// fits in one block and it can carry a full one, it is asked for
+// room for several at once.  If it turns out to have changed its
+// mind without telling us, fall back to asking everyone.
 chop_conn_t *
 chop_circuit_t::pick_connection(size_t desired, size_t *blocksize)
+{
+  refresh_offers();
+  if (offers.empty()) {
+    log_debug(this, "no connection offers any room");
+    *blocksize = 0;
+    return 0;
+  }
+
+  size_t one = std::min(desired, SECTION_LEN) + MIN_BLOCK_SIZE;
+  chop_offer_index::iterator i = offers.lower_bound(one);
+  if (i == offers.end())
+    --i;
+  chop_conn_t *conn = i->second;
+
+  size_t shake = conn->sent_handshake ? 0 : HANDSHAKE_LEN;
+  size_t lo = MIN_BLOCK_SIZE + (desired == 0 ? 0 : 1);
+  size_t pref = one;
+  size_t hi = MAX_BLOCK_SIZE;
+  size_t nblocks = 1;
+  if (desired > SECTION_LEN && i->first >= MIN_BLOCK_SIZE + SECTION_LEN) {
+    nblocks = std::min((desired + SECTION_LEN - 1) / SECTION_LEN,
+                       MAX_COALESCED_BLOCKS);
+    pref = std::min(desired, nblocks * SECTION_LEN)
+      + nblocks * MIN_BLOCK_SIZE;
+    hi = nblocks * (MIN_BLOCK_SIZE + SECTION_LEN);
+  }
+
+  size_t room = conn->steg->transmit_room(pref + shake, lo + shake,
+                                          hi + shake);
+  if (room == 0) {
+    log_debug(conn, "offer of %lu bytes withdrawn (%s)",
+              (unsigned long)i->first, conn->steg->cfg()->name());
+    invalidate_offer(conn);
+    return pick_connection_scan(desired, blocksize);
+  }
+  if (room < lo + shake || room > hi + shake
+      || (nblocks == 1 && room == hi + shake))
+    log_abort(conn, "steg size request (%lu) out of range [%lu, %lu]",
+              (unsigned long)room,
+              (unsigned long)(lo + shake),
+              (unsigned long)(hi + shake));
+
+  if (nblocks > 1)
+    log_debug(conn, "will carry %lu bytes in one transmission (%s)",
+              (unsigned long)room, conn->steg->cfg()->name());
+  else
+    log_debug(conn, "best fit for %lu bytes offers %lu bytes (%s)",
+              (unsigned long)one, (unsigned long)room,
+              conn->steg->cfg()->name());
+
+  *blocksize = room;
+  return conn;
+}
+
+// As pick_connection, but query every connection's steg module.
+chop_conn_t *
+chop_circuit_t::pick_connection_scan(size_t desired, size_t *blocksize)
 {
   size_t maxbelow = 0;
   size_t minabove = MAX_BLOCK_SIZE + 1;
@@ -901,6 +1978,10 @@ chop_circuit_t::pick_connection(size_t desired, size_t *blocksize)
       log_debug(conn, "offers 0 bytes (no steg)");
       continue;
     }
+    if (conn->xmit_busy) {
+      log_debug(conn, "offers 0 bytes (transmission in progress)");
+      continue;
+    }
 
     size_t shake = conn->sent_handshake ? 0 : HANDSHAKE_LEN;
     size_t room = conn->steg->transmit_room(desired + shake, lo + shake,
@@ -960,7 +2041,7 @@ chop_circuit_t::process_queue()
   bool pending_fin = false;
   bool pending_error = false;
   bool sent_error = false;
-  while ((blk = recv_queue.remove_next()).data) {
+  while ((blk = recv_queue.remove_next()).present) {
     switch (blk.op) {
     case op_FIN:
       if (received_fin) {
@@ -972,11 +2053,17 @@ chop_circuit_t::process_queue()
       pending_fin = true;
       // fall through - block may have data
     case op_DAT:
-      if (evbuffer_get_length(blk.data)) {
+      if (blk.data && evbuffer_get_length(blk.data)) {
+        size_t n = evbuffer_get_length(blk.data);
         if (received_fin) {
           log_info(this, "protocol error: data after FIN");
           pending_error = true;
+        } else if (n > recv_credit) {
+          log_info(this, "protocol error: peer exceeded its credit");
+          pending_error = true;
         } else {
+          recv_credit -= n;
+          credit_owed += n;
           // We are making forward progress if we are _either_ sending or
           // receiving data.
           dead_cycles = 0;
@@ -989,6 +2076,23 @@ chop_circuit_t::process_queue()
       }
       break;
 
+    case op_CRD: {
+      uint8_t wire[CREDIT_LEN];
+      if (!blk.data || evbuffer_get_length(blk.data) != CREDIT_LEN ||
+          evbuffer_remove(blk.data, wire, CREDIT_LEN) != (int)CREDIT_LEN) {
+        log_info(this, "protocol error: malformed credit block");
+        pending_error = true;
+        break;
+      }
+      uint32_t grant = ((uint32_t(wire[0]) << 24) |
+                        (uint32_t(wire[1]) << 16) |
+                        (uint32_t(wire[2]) <<  8) |
+                        (uint32_t(wire[3])      ));
+      log_debug(this, "received %u bytes of credit", grant);
+      send_credit += grant;
+      break;
+    }
+
     case op_RST:
       log_info(this, "received RST; disconnecting circuit");
       circuit_recv_eof(this);
@@ -1009,7 +2113,7 @@ chop_circuit_t::process_queue()
       break;
     }
 
-    evbuffer_free(blk.data);
+    recv_queue.put_buffer(blk.data);
 
     if (pending_fin && !received_fin) {
       circuit_recv_eof(this);
@@ -1029,9 +2133,11 @@ chop_circuit_t::process_queue()
   if (sent_error)
     return -1;
 
-  // It may have become possible to send queued data or a FIN.
-  if (evbuffer_get_length(bufferevent_get_input(up_buffer))
-      || (upstream_eof && !sent_fin))
+  // It may have become possible to send queued data or a FIN, and we
+  // may owe our peer credit for what we just passed upstream.  (If we
+  // have data but no credit to send it with, don't answer every block
+  // with a block of chaff; two blocked peers would never stop.)
+  if (sendable() || (upstream_eof && !sent_fin) || credit_due())
     return send();
 
   return check_for_eof();
@@ -1040,6 +2146,11 @@ chop_circuit_t::process_queue()
 int
 chop_circuit_t::check_for_eof()
 {
+  // Blocks still being sealed (perhaps including our FIN) have not
+  // been transmitted yet; send_sealed will check again.
+  if (send_lane.busy())
+    return 0;
+
   // If we're at EOF both ways, close all connections, sending first
   // if necessary.
   if (sent_fin && received_fin) {
@@ -1074,7 +2185,10 @@ chop_config_t::conn_create(size_t index)
     return 0;
   }
 
+  conn->index = index;
   conn->recv_pending = evbuffer_new();
+  if (mode == LSN_SIMPLE_SERVER && worker_count() > 1)
+    conn->recv_raw = evbuffer_new();
   return conn;
 }
 
@@ -1091,6 +2205,8 @@ chop_conn_t::~chop_conn_t()
   if (must_send_timer)
     event_free(must_send_timer);
   evbuffer_free(recv_pending);
+  if (recv_raw)
+    evbuffer_free(recv_raw);
 }
 
 circuit_t *
@@ -1128,9 +2244,19 @@ chop_conn_t::send(struct evbuffer *block)
   sent_handshake = true;
   if (must_send_timer)
     evtimer_del(must_send_timer);
+  offer_changed();
   return 0;
 }
 
+// Called whenever something happens that might change how much our
+// steg module is willing to transmit.
+void
+chop_conn_t::offer_changed()
+{
+  if (upstream)
+    upstream->invalidate_offer(this);
+}
+
 int
 chop_conn_t::handshake()
 {
@@ -1158,17 +2284,27 @@ chop_conn_t::recv_handshake()
                       sizeof circuit_id) != sizeof circuit_id)
     return -1;
 
-  chop_circuit_table::value_type in(circuit_id, 0);
-  std::pair<chop_circuit_table::iterator, bool> out
-    = this->config->circuits.insert(in);
+  // Circuits are sharded across worker processes by ID.  If this one
+  // is not ours, pass the connection to its owner and drop our copy.
+  // (Only the first handshake on a connection counts; see recv.)
+  if (recv_raw) {
+    unsigned int owner = circuit_id % worker_count();
+    if (owner != worker_index()) {
+      if (!conn_hand_off(this, config, index, owner, recv_raw))
+        log_debug(this, "circuit belongs to worker %u", owner);
+      return -1;
+    }
+    evbuffer_free(recv_raw);
+    recv_raw = NULL;
+  }
+
   chop_circuit_t *ck;
 
-  if (!out.second) { // element already exists
-    if (!out.first->second) {
+  if (this->config->circuits.find(circuit_id, &ck)) {
+    if (!ck) {
       log_debug(this, "stale circuit");
       return 0;
     }
-    ck = out.first->second;
     log_debug(this, "found circuit to %s", ck->up_peer);
   } else {
     ck = dynamic_cast<chop_circuit_t *>(circuit_create(this->config, 0));
@@ -1176,14 +2312,15 @@ chop_conn_t::recv_handshake()
       log_warn(this, "failed to create new circuit");
       return -1;
     }
+    ck->circuit_id = circuit_id;
+    this->config->circuits.insert(circuit_id, ck);
+    ck->init_keys();
     if (circuit_open_upstream(ck)) {
       log_warn(this, "failed to begin upstream connection");
       delete ck;
       return -1;
     }
     log_debug(this, "created new circuit to %s", ck->up_peer);
-    ck->circuit_id = circuit_id;
-    out.first->second = ck;
   }
 
   ck->add_downstream(this);
@@ -1193,10 +2330,54 @@ chop_conn_t::recv_handshake()
 int
 chop_conn_t::recv()
 {
-  if (steg->receive(recv_pending))
+  // When there are several worker processes, a new server connection
+  // may belong to a circuit owned by another worker, which will have
+  // to start over with everything received so far (see
+  // recv_handshake).  Until we know, keep a copy of everything that
+  // arrives.  Whatever the steg module left in the inbound buffer
+  // last time has been copied already; only the rest is new.
+  //
+  // conn_hand_off can pass on at most 64 KiB (HANDOFF_MAX in
+  // network.cc), and the copy keeps growing until the steg module
+  // yields the handshake, so a connection whose first cover message,
+  // plus anything read along with it, is bigger than that can only
+  // be served by the worker that accepted it.  Elsewhere it fails
+  // and is dropped.  This is usually the first read alone, but steg
+  // modules that wait for a whole message, such as http carrying
+  // several coalesced blocks, can reach the limit.
+  if (recv_raw && !upstream) {
+    struct evbuffer *in = inbound();
+    size_t fresh = evbuffer_get_length(in) - recv_raw_seen;
+    if (fresh > 0) {
+      struct evbuffer_ptr pos;
+      evbuffer_ptr_set(in, &pos, recv_raw_seen, EVBUFFER_PTR_SET);
+      int n = evbuffer_peek(in, fresh, &pos, NULL, 0);
+      vector<struct evbuffer_iovec> v(n);
+      evbuffer_peek(in, fresh, &pos, &v[0], n);
+      for (int i = 0; i < n && fresh > 0; i++) {
+        size_t len = std::min(v[i].iov_len, fresh);
+        evbuffer_add(recv_raw, v[i].iov_base, len);
+        fresh -= len;
+      }
+    }
+
+    int rv = steg->receive(recv_pending);
+    recv_raw_seen = evbuffer_get_length(in);
+    if (rv)
+      return -1;
+  } else if (steg->receive(recv_pending))
     return -1;
 
+  offer_changed();
   if (!upstream) {
+    // A client connection can outlive its circuit while it is being
+    // flushed, and with --keepalive it may still have a request
+    // outstanding.  The reply can no longer be decrypted; discard it.
+    if (config->mode != LSN_SIMPLE_SERVER) {
+      evbuffer_drain(recv_pending, evbuffer_get_length(recv_pending));
+      return 0;
+    }
+
     // Try to receive a handshake.
     if (recv_handshake())
       return -1;
@@ -1226,13 +2407,21 @@ chop_conn_t::recv()
       break;
 
     log_debug(this, "%lu bytes available", (unsigned long)avail);
-    if (avail < MIN_BLOCK_SIZE) {
-      log_debug(this, "incomplete block framing");
-      break;
+
+    // Only decrypt each block's header once, however many reads it
+    // takes for the rest of the block to arrive.
+    if (!recv_hdr_known) {
+      if (avail < MIN_BLOCK_SIZE) {
+        log_debug(this, "incomplete block framing");
+        break;
+      }
+      recv_hdr = block_header(recv_pending, *upstream->recv_hdr_crypt);
+      recv_hdr_known = true;
     }
 
-    block_header hdr(recv_pending, *upstream->recv_hdr_crypt);
-    if (!hdr.valid(upstream->recv_queue.window())) {
+    const block_header &hdr = recv_hdr;
+    if (!hdr.valid(upstream->recv_queue.window(),
+                   upstream->recv_queue.window_size())) {
       const uint8_t *c = hdr.cleartext();
       log_info(this, "invalid block header: %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
                c[0], c[1], c[2], c[3], c[4], c[5], c[6], c[7],
@@ -1244,37 +2433,129 @@ chop_conn_t::recv()
                 (unsigned long)hdr.total_len());
       break;
     }
+    recv_hdr_known = false;
 
-    uint8_t decodebuf[MAX_BLOCK_SIZE];
-    if (evbuffer_drain(recv_pending, HEADER_LEN) ||
-        evbuffer_remove(recv_pending, decodebuf, hdr.total_len() - HEADER_LEN)
-        != (ssize_t)(hdr.total_len() - HEADER_LEN)) {
-      log_warn(this, "failed to copy block to decode buffer");
+    if (recv_block(hdr))
       return -1;
-    }
-    if (upstream->recv_crypt->decrypt(decodebuf,
-                                      decodebuf, hdr.total_len() - HEADER_LEN,
-                                      hdr.nonce(), HEADER_LEN)) {
-      log_info("MAC verification failure");
+  }
+
+  return upstream->process_queue();
+}
+
+// Decrypt the block described by HDR, which is entirely present in
+// recv_pending, and hand it to the reassembly queue.  The data section
+// is decrypted in place and moved, chain by chain, into its own
+// evbuffer; the padding is decrypted in place and discarded.  Large
+// blocks are decrypted by the crypto pool instead, and so is
+// everything else while it has any of this circuit's to do; see
+// chop_circuit_t::recv_opened for the rest.
+int
+chop_conn_t::recv_block(const block_header &hdr)
+{
+  size_t d = hdr.dlen();
+  size_t p = hdr.plen();
+  uint8_t tag[TRAILER_LEN];
+
+  evbuffer *data = 0;
+  if (d) {
+    data = upstream->recv_queue.get_buffer();
+    if (!data) {
+      log_warn(this, "memory allocation failure");
       return -1;
     }
+  }
+  if (evbuffer_drain(recv_pending, HEADER_LEN) ||
+      (d && evbuffer_remove_buffer(recv_pending, data, d) != (int)d) ||
+      copyout_at(recv_pending, p, tag, TRAILER_LEN)) {
+    log_warn(this, "failed to extract block from receive buffer");
+    upstream->recv_queue.put_buffer(data);
+    return -1;
+  }
 
-    log_debug(this, "receiving block %u <d=%lu p=%lu f=%02x>",
-              hdr.seqno(), (unsigned long)hdr.dlen(), (unsigned long)hdr.plen(),
-              (unsigned int)hdr.opcode());
-
-    evbuffer *data = evbuffer_new();
-    if (!data || (hdr.dlen() && evbuffer_add(data, decodebuf, hdr.dlen()))) {
-      log_warn(this, "failed to extract data from decode buffer");
-      evbuffer_free(data);
+  if (upstream->recv_lane.busy() || crypt_pool_offload(d + p)) {
+    chop_open_job *job = new chop_open_job(upstream, this, hdr);
+    job->data = data;
+    memcpy(job->tag, tag, TRAILER_LEN);
+    if (p && (!(job->pad = evbuffer_new()) ||
+              evbuffer_remove_buffer(recv_pending, job->pad, p) != (int)p)) {
+      log_warn(this, "failed to extract block from receive buffer");
+      delete job;
       return -1;
     }
+    evbuffer_drain(recv_pending, TRAILER_LEN);
+    upstream->recv_lane.submit(job);
+    return 0;
+  }
 
-    if (!upstream->recv_queue.insert(hdr.seqno(), hdr.opcode(), data, this))
-      return -1; // insert() logs an error
+  if (open_block(*upstream->recv_crypt, data, d, recv_pending, p, tag,
+                 hdr.nonce())) {
+    log_info("MAC verification failure");
+    upstream->recv_queue.put_buffer(data);
+    return -1;
   }
+  evbuffer_drain(recv_pending, p + TRAILER_LEN);
 
-  return upstream->process_queue();
+  log_debug(this, "receiving block %u <d=%lu p=%lu f=%02x>",
+            hdr.seqno(), (unsigned long)d, (unsigned long)p,
+            (unsigned int)hdr.opcode());
+
+  if (!upstream->recv_queue.insert(hdr.seqno(), hdr.opcode(), data, this))
+    return -1; // insert() logs an error
+  return 0;
+}
+
+chop_open_job::chop_open_job(chop_circuit_t *c, chop_conn_t *conn,
+                             const block_header &hdr)
+  : ckt(c), crypt(c->recv_crypt), conn_serial(conn->serial), data(0), pad(0),
+    seqno(hdr.seqno()), op(hdr.opcode()), ok(false)
+{
+  memcpy(nonce, hdr.nonce(), HEADER_LEN);
+}
+
+chop_open_job::~chop_open_job()
+{
+  if (data)
+    evbuffer_free(data);
+  if (pad)
+    evbuffer_free(pad);
+}
+
+// Runs on a crypto pool thread.
+void
+chop_open_job::run()
+{
+  size_t d = data ? evbuffer_get_length(data) : 0;
+  size_t p = pad ? evbuffer_get_length(pad) : 0;
+  ok = !open_block(*crypt, data, d, pad, p, tag, nonce);
+}
+
+// The crypto pool has decrypted JOB's block.  Carry on as recv would
+// have; if anything goes wrong, the connection that brought the block
+// is closed, as it would have been then.
+void
+chop_circuit_t::recv_opened(chop_open_job *job)
+{
+  chop_conn_t *conn = find_downstream(job->conn_serial);
+  evbuffer *data = job->data;
+  job->data = 0;
+
+  if (!job->ok) {
+    log_info(this, "MAC verification failure");
+    recv_queue.put_buffer(data);
+  } else {
+    log_debug(this, "receiving block %u <d=%lu p=%lu f=%02x>",
+              job->seqno, (unsigned long)(data ? evbuffer_get_length(data) : 0),
+              (unsigned long)(job->pad ? evbuffer_get_length(job->pad) : 0),
+              (unsigned int)job->op);
+    if (recv_queue.insert(job->seqno, job->op, data, conn) &&
+        !process_queue())
+      return;
+  }
+
+  if (conn) {
+    log_debug(conn, "error during receive");
+    delete conn;
+  }
 }
 
 int
@@ -1297,9 +2578,15 @@ chop_conn_t::recv_eof()
   // longer sending covert data in the opposite direction _and_ the
   // cover protocol does not need us to send a reply (i.e. the
   // must_send_timer is not pending).
+  // If blocks for this connection are still being sealed, that
+  // has to wait until they have been transmitted (see send_sealed).
   if (upstream && (upstream->sent_fin || no_more_transmissions) &&
-      !must_send_p())
-    upstream->drop_downstream(this);
+      !must_send_p()) {
+    if (xmit_busy)
+      recv_eof_deferred = true;
+    else
+      upstream->drop_downstream(this);
+  }
 
   return 0;
 }
@@ -1317,9 +2604,20 @@ chop_conn_t::cease_transmission()
   no_more_transmissions = true;
   if (must_send_timer)
     evtimer_del(must_send_timer);
+  offer_changed();
   conn_do_flush(this);
 }
 
+void
+chop_conn_t::resume_transmission()
+{
+  // The connection stays in the circuit; all that changes is that
+  // its steg module will offer room again.
+  log_assert(!no_more_transmissions);
+  log_debug(this, "connection re-armed");
+  offer_changed();
+}
+
 void
 chop_conn_t::transmit_soon(unsigned long milliseconds)
 {
@@ -1333,6 +2631,7 @@ chop_conn_t::transmit_soon(unsigned long milliseconds)
   if (!must_send_timer)
     must_send_timer = evtimer_new(config->base, must_send_timeout, this);
   evtimer_add(must_send_timer, &tv);
+  offer_changed();
 }
 
 void
@@ -1352,6 +2651,10 @@ chop_conn_t::send()
   // protocol, we must send an HTTP reply to each HTTP query that
   // comes in for a stale circuit.
   if (upstream) {
+    if (xmit_busy) {
+      log_debug(this, "must send; transmission already in progress");
+      return;
+    }
     log_debug(this, "must send");
     if (upstream->send_targeted(this)) {
       upstream->drop_downstream(this);
@@ -1407,7 +2710,9 @@ chop_conn_t::must_send_p() const
 /* static */ void
 chop_conn_t::must_send_timeout(evutil_socket_t, short, void *arg)
 {
-  static_cast<chop_conn_t *>(arg)->send();
+  chop_conn_t *conn = static_cast<chop_conn_t *>(arg);
+  conn->offer_changed();
+  conn->send();
 }
 
 } // anonymous namespace
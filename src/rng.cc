@@ -8,10 +8,136 @@
 #include <cmath>
 #include <algorithm>
 
+#include <openssl/evp.h>
 #include <openssl/rand.h>
 
-/* OpenSSL's rng is global, automatically seeds itself, and does not
-   appear to need to be torn down explicitly. */
+/* OpenSSL's RAND_bytes is too slow to call for every random number
+   we need: it takes a global lock and stirs its pool on every call.
+   So we use it only to seed our own generator, AES-256 in counter
+   mode, with "fast key erasure": every time we run the cipher, the
+   first 48 bytes of the output become the next key and IV, so a
+   later compromise of the state reveals nothing already produced.
+   Small requests are served from a pool of keystream; large ones
+   (chaff, mostly) are generated straight into the caller's buffer.
+   Every RESEED_BYTES of output, and whenever rng_reseed is called,
+   fresh entropy from RAND_bytes is mixed into the key.
+
+   The generator is not thread-safe; only the event loop thread may
+   use it.  */
+
+namespace {
+  const size_t DRBG_SEED_LEN = 32 + 16;  // AES-256 key, then IV
+  const size_t DRBG_POOL_LEN = 1024;
+  const size_t DRBG_BULK_MIN = DRBG_POOL_LEN / 4;
+  const size_t RESEED_BYTES  = 1 << 20;
+
+  struct drbg
+  {
+    EVP_CIPHER_CTX ctx;
+    uint8_t pool[DRBG_POOL_LEN];
+    size_t avail;         // unused bytes at the end of the pool
+    size_t since_seed;    // bytes produced since the last reseed
+    bool seeded;
+
+    void seed();
+    void keystream(uint8_t *out, size_t n);
+    void rekey(const uint8_t *seed);
+    void refill();
+    void get(uint8_t *out, size_t n);
+  };
+}
+
+static drbg rng;
+
+// Install SEED (DRBG_SEED_LEN bytes) as the new key and IV.
+void
+drbg::rekey(const uint8_t *seed)
+{
+  if (!EVP_EncryptInit_ex(&ctx, 0, 0, seed, seed + 32))
+    log_abort("rng: failed to rekey");
+}
+
+// Write N bytes of keystream to OUT, then rekey from more of it.
+void
+drbg::keystream(uint8_t *out, size_t n)
+{
+  uint8_t next[DRBG_SEED_LEN];
+  int olen;
+
+  memset(out, 0, n);
+  memset(next, 0, sizeof next);
+  if (!EVP_EncryptUpdate(&ctx, out, &olen, out, n) || size_t(olen) != n ||
+      !EVP_EncryptUpdate(&ctx, next, &olen, next, sizeof next) ||
+      size_t(olen) != sizeof next)
+    log_abort("rng: keystream generation failed");
+  rekey(next);
+  memset(next, 0, sizeof next);
+
+  since_seed += n;
+}
+
+// Mix fresh entropy into the key, and throw away the pool.
+void
+drbg::seed()
+{
+  uint8_t fresh[DRBG_SEED_LEN], mixed[DRBG_SEED_LEN];
+
+  if (!seeded) {
+    EVP_CIPHER_CTX_init(&ctx);
+    memset(mixed, 0, sizeof mixed);
+    if (!EVP_EncryptInit_ex(&ctx, EVP_aes_256_ctr(), 0, mixed, mixed))
+      log_abort("rng: failed to initialize AES-CTR");
+    seeded = true;
+  }
+
+  int rv = RAND_bytes(fresh, sizeof fresh);
+  log_assert(rv == 1);
+
+  // XOR rather than replace, so that a weak RAND_bytes cannot make
+  // things worse than they already were.
+  keystream(mixed, sizeof mixed);
+  for (size_t i = 0; i < sizeof mixed; i++)
+    mixed[i] ^= fresh[i];
+  rekey(mixed);
+
+  memset(fresh, 0, sizeof fresh);
+  memset(mixed, 0, sizeof mixed);
+  memset(pool, 0, sizeof pool);
+  avail = 0;
+  since_seed = 0;
+}
+
+void
+drbg::refill()
+{
+  if (!seeded || since_seed >= RESEED_BYTES)
+    seed();
+  keystream(pool, sizeof pool);
+  avail = sizeof pool;
+}
+
+void
+drbg::get(uint8_t *out, size_t n)
+{
+  if (n >= DRBG_BULK_MIN) {
+    if (!seeded || since_seed >= RESEED_BYTES)
+      seed();
+    keystream(out, n);
+    return;
+  }
+
+  while (n > 0) {
+    if (avail == 0)
+      refill();
+    size_t k = std::min(n, avail);
+    uint8_t *src = pool + sizeof pool - avail;
+    memcpy(out, src, k);
+    memset(src, 0, k);  // what has been handed out is forgotten
+    avail -= k;
+    out += k;
+    n -= k;
+  }
+}
 
 /**
  * Fills 'buf' with 'buflen' random bytes.  Cannot fail.
@@ -20,8 +146,7 @@ void
 rng_bytes(uint8_t *buf, size_t buflen)
 {
   log_assert(buflen < INT_MAX);
-  int rv = RAND_bytes(buf, (int)buflen);
-  log_assert(rv);
+  rng.get(buf, buflen);
 }
 
 /**
@@ -223,3 +348,225 @@ rng_range_geom(unsigned int hi, unsigned int xv)
      for great defensiveness. */
   return min(hi-1, max(0U, (unsigned int)floor(T)));
 }
+
+/* rng_geom_sampler works digit by digit.  Write a geometric random
+   variable X, with P(X = x) proportional to q^x, in base 256:
+   X = d0 + 256 d1 + 256^2 d2 + ...; then q^X = q^d0 (q^256)^d1 ...,
+   so the digits are independent, and each one follows a geometric
+   distribution truncated to [0, 256), with ratio q^(256^k) for digit
+   k.  We sample each digit with an alias table (Walker's method),
+   which needs one random word per digit: the low 8 bits pick a
+   column, and the other 56 are compared with the column's threshold
+   to decide between it and its alias.  Each table entry packs the
+   threshold above the alias.
+
+   The top digit is truncated so that the digits reach just past
+   'hi', and the rare values that still fall beyond it are rejected.
+   Digits that would be nonzero less than 2^-56 of the time are left
+   out altogether; for small 'xv', that means there is only one.  */
+
+namespace {
+  const unsigned int GEOM_COLS = 256;
+  const unsigned int GEOM_MAX_LEVELS = 4;  // 256^4 > INT_MAX+1
+  const int GEOM_FRAC_BITS = 56;
+
+  // Fill in ROW, the alias table for the geometric distribution on
+  // [0, n) with ratio exp(-c).
+  void
+  build_alias_row(uint64_t *row, unsigned int n, double c)
+  {
+    double p[GEOM_COLS];
+    unsigned int small[GEOM_COLS], large[GEOM_COLS];
+    unsigned int ns = 0, nl = 0;
+    double sum = 0;
+
+    for (unsigned int i = 0; i < GEOM_COLS; i++) {
+      p[i] = i < n ? std::exp(-c * i) : 0;
+      sum += p[i];
+    }
+    for (unsigned int i = 0; i < GEOM_COLS; i++) {
+      p[i] *= GEOM_COLS / sum;
+      if (p[i] < 1)
+        small[ns++] = i;
+      else
+        large[nl++] = i;
+    }
+
+    const uint64_t one = UINT64_C(1) << GEOM_FRAC_BITS;
+    while (ns > 0 && nl > 0) {
+      unsigned int s = small[--ns];
+      unsigned int l = large[nl - 1];
+      uint64_t thresh = (uint64_t)std::ldexp(p[s], GEOM_FRAC_BITS);
+      row[s] = (std::min(thresh, one - 1) << 8) | l;
+      p[l] -= 1 - p[s];
+      if (p[l] < 1) {
+        nl--;
+        small[ns++] = l;
+      }
+    }
+    // Whatever is left has probability 1, up to rounding error.
+    while (ns > 0) {
+      unsigned int i = small[--ns];
+      row[i] = ((one - 1) << 8) | i;
+    }
+    while (nl > 0) {
+      unsigned int i = large[--nl];
+      row[i] = ((one - 1) << 8) | i;
+    }
+  }
+}
+
+rng_geom_sampler::rng_geom_sampler(unsigned int hi, unsigned int xv)
+  : hi(hi), xv(xv), nlevels(0),
+    table(new uint64_t[GEOM_MAX_LEVELS * GEOM_COLS])
+{
+  log_assert(hi <= ((unsigned int)INT_MAX)+1);
+  log_assert(0 < xv && xv < hi);
+
+  // The ratio q is xv/(xv+1) (see rng_range_geom); c = -log q.
+  double c = std::log1p(1. / xv);
+  uint64_t span = 1;  // 256^nlevels
+  while (span < hi) {
+    if (nlevels > 0 && span * c > GEOM_FRAC_BITS * M_LN2)
+      break;
+    log_assert(nlevels < GEOM_MAX_LEVELS);
+    unsigned int n = GEOM_COLS;
+    if ((hi + span - 1) / span < n)
+      n = (hi + span - 1) / span;
+    build_alias_row(table + nlevels * GEOM_COLS, n, c * span);
+    span *= GEOM_COLS;
+    nlevels++;
+  }
+}
+
+rng_geom_sampler::~rng_geom_sampler()
+{
+  delete [] table;
+}
+
+int
+rng_geom_sampler::sample(unsigned int lim) const
+{
+  log_assert(xv < lim && lim <= hi);
+
+  uint64_t r[GEOM_MAX_LEVELS];
+  for (;;) {
+    rng_bytes((uint8_t *)r, nlevels * sizeof(uint64_t));
+    uint64_t x = 0;
+    for (unsigned int k = nlevels; k-- > 0;) {
+      unsigned int col = r[k] & 0xFF;
+      uint64_t ent = table[k * GEOM_COLS + col];
+      if ((r[k] >> 8) >= (ent >> 8))
+        col = ent & 0xFF;
+      x = x * GEOM_COLS + col;
+    }
+    if (x < lim)
+      return (int)x;
+  }
+}
+
+/* The fast generator is xoshiro256** (Blackman and Vigna).  Each
+   thread has its own state, seeded from RAND_bytes the first time
+   that thread asks for a number; rng_bytes would do as well on the
+   event loop thread, but is not safe to call from any other.  */
+
+namespace {
+  struct xoshiro
+  {
+    uint64_t s[4];
+    bool seeded;
+
+    void seed();
+    uint64_t next();
+  };
+}
+
+static __thread xoshiro fast;
+
+void
+xoshiro::seed()
+{
+  if (RAND_bytes((uint8_t *)s, sizeof s) != 1)
+    log_abort("rng: failed to seed fast generator");
+  // The all-zero state is a fixed point.
+  if (!(s[0] | s[1] | s[2] | s[3]))
+    s[0] = 1;
+  seeded = true;
+}
+
+static inline uint64_t
+rotl64(uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+inline uint64_t
+xoshiro::next()
+{
+  if (!seeded)
+    seed();
+
+  uint64_t result = rotl64(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl64(s[3], 45);
+
+  return result;
+}
+
+uint64_t
+fast_rng_u64()
+{
+  return fast.next();
+}
+
+/**
+ * Return a number chosen uniformly from [0, max), by Lemire's
+ * multiply-and-shift method, which needs a division only on the
+ * rare occasions when it must reject a sample.
+ */
+unsigned int
+fast_rng_int(unsigned int max)
+{
+  log_assert(max > 0);
+
+  uint64_t m = (fast.next() >> 32) * (uint64_t)max;
+  uint32_t lo = (uint32_t)m;
+  if (lo < max) {
+    uint32_t threshold = -max % max;
+    while (lo < threshold) {
+      m = (fast.next() >> 32) * (uint64_t)max;
+      lo = (uint32_t)m;
+    }
+  }
+  return (unsigned int)(m >> 32);
+}
+
+unsigned int
+fast_rng_range(unsigned int min, unsigned int max)
+{
+  log_assert(max > min);
+  return min + fast_rng_int(max - min);
+}
+
+/**
+ * Mix fresh entropy from the operating system into OpenSSL's rng,
+ * and from there into ours.  OpenSSL already mixes in the process
+ * ID, but let's not count on that; and our own generators would
+ * otherwise carry on exactly where the parent process left off.
+ * Only the calling thread's fast generator is reseeded, but after
+ * fork() that is the only thread there is.
+ */
+void
+rng_reseed(void)
+{
+  int rv = RAND_poll();
+  log_assert(rv);
+  rng.seed();
+  fast.seed();
+}
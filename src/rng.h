@@ -5,7 +5,9 @@
 #ifndef RNG_H
 #define RNG_H
 
-/** Set b to contain n random bytes. */
+/** Set b to contain n random bytes.  This and everything below draw
+ *  on a per-process generator that only the event loop thread may use.
+ */
 void rng_bytes(uint8_t *b, size_t n);
 
 /** Return a random integer in the range [0, max).
@@ -28,4 +30,70 @@ int rng_range(unsigned int min, unsigned int max);
  */
 int rng_range_geom(unsigned int hi, unsigned int xv);
 
+/** A precomputed sampler for rng_range_geom.  Building one costs a
+ *  few hundred calls to exp(); after that, each sample costs one or
+ *  two table lookups and no floating point at all.  Callers that draw
+ *  repeatedly from the same distribution should build one once and
+ *  keep it.  Samples come from the same generator as rng_bytes.
+ */
+class rng_geom_sampler
+{
+public:
+  /** Prepare to sample the distribution of rng_range_geom(hi, xv);
+   *  the constraints on 'hi' and 'xv' are the same.
+   */
+  rng_geom_sampler(unsigned int hi, unsigned int xv);
+  ~rng_geom_sampler();
+
+  /** Equivalent to rng_range_geom(hi, xv). */
+  int sample() const { return sample(hi); }
+
+  /** Equivalent to rng_range_geom(lim, xv), for any 'lim' greater
+   *  than 'xv' and no greater than the 'hi' this sampler was built
+   *  with.  (Truncating a geometric distribution is the same thing as
+   *  rejecting the values beyond the cutoff, and the rejection rate
+   *  cannot exceed 1/e.)
+   */
+  int sample(unsigned int lim) const;
+
+  unsigned int max_hi() const { return hi; }
+  unsigned int expected() const { return xv; }
+
+private:
+  unsigned int hi;
+  unsigned int xv;
+  unsigned int nlevels;
+  uint64_t *table;
+
+  rng_geom_sampler(const rng_geom_sampler&) DELETE_METHOD;
+  rng_geom_sampler& operator=(const rng_geom_sampler&) DELETE_METHOD;
+};
+
+/** A second, much faster generator, for choices that only shape
+ *  cover traffic: which payload to send, how long to make a cookie,
+ *  and the like.  It is NOT cryptographically secure; anything an
+ *  adversary must not predict (keys, nonces, padding, chaff) uses
+ *  the functions above.  Each thread has its own generator, seeded
+ *  from the operating system on first use.
+ */
+
+/** Return 64 random bits. */
+uint64_t fast_rng_u64(void);
+
+/** Return a random integer in the range [0, max); 'max' must be
+ *  at least 1.
+ */
+unsigned int fast_rng_int(unsigned int max);
+
+/** Return a random integer in the range [min, max); 'max' must be
+ *  greater than 'min'.
+ */
+unsigned int fast_rng_range(unsigned int min, unsigned int max);
+
+/** Mix fresh entropy into the generator.  Call this in each new
+ *  process after fork(), so that parent and child do not share a
+ *  random stream.
+ */
+void rng_reseed(void);
+
 #endif
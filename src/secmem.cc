@@ -0,0 +1,261 @@
+/* Copyright 2012 the StegoTorus authors
+   See LICENSE for other credits and copying information
+*/
+
+#include "util.h"
+#include "secmem.h"
+
+#include <algorithm>
+#include <vector>
+#include <errno.h>
+#include <openssl/crypto.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+/* Blocks of up to SECMEM_MAX_SMALL bytes are rounded up to a power of
+   two (at least SECMEM_MIN_SMALL) and carved out of chunks of
+   SECMEM_CHUNK_LEN bytes, each mapped with a guard page on either
+   side.  A freed block is wiped and pushed onto the free list for its
+   size class, linked through its first word; chunks are never given
+   back.  Larger blocks get a guarded mapping of their own, which is
+   unmapped again when they are freed.  Every mapping is remembered,
+   with whether it is locked, so that secmem_after_fork can lock them
+   all again.  */
+
+namespace {
+  const size_t SECMEM_MIN_SMALL = 16;
+  const size_t SECMEM_MAX_SMALL = 2048;
+  const unsigned int SECMEM_CLASSES = 8;    // 16, 32, ... 2048
+  const size_t SECMEM_CHUNK_LEN = 64 * 1024;
+
+  struct free_block
+  {
+    free_block *next;
+  };
+
+  struct mapping
+  {
+    uint8_t *p;
+    size_t len;
+    bool locked;
+  };
+
+  struct secmem_arena
+  {
+    free_block *free_lists[SECMEM_CLASSES];
+    uint8_t *bump;        // unused part of the newest chunk
+    size_t bump_left;
+    size_t page;
+    bool warned;
+    secmem_stats stats;
+    std::vector<mapping> mappings;
+
+    void *map(size_t len);
+    void unmap(void *p, size_t len);
+    bool lock(void *p, size_t len);
+  };
+}
+
+static secmem_arena arena;
+
+static unsigned int
+size_class(size_t n)
+{
+  unsigned int c = 0;
+  size_t sz = SECMEM_MIN_SMALL;
+  while (sz < n) {
+    sz <<= 1;
+    c++;
+  }
+  return c;
+}
+
+// Round N up to a whole number of pages.
+static size_t
+round_to_pages(size_t n)
+{
+  if (!arena.page) {
+#ifndef _WIN32
+    arena.page = sysconf(_SC_PAGESIZE);
+#else
+    arena.page = 4096;
+#endif
+  }
+  return (n + arena.page - 1) & ~(arena.page - 1);
+}
+
+#ifndef _WIN32
+
+// Lock LEN bytes at P into RAM, if we can.
+bool
+secmem_arena::lock(void *p, size_t len)
+{
+  if (mlock(p, len) == 0) {
+    stats.locked += len;
+    return true;
+  }
+  if (!warned) {
+    warned = true;
+    log_warn("secmem: cannot lock key memory into RAM (%s); "
+             "it may be swapped out", strerror(errno));
+  }
+  return false;
+}
+
+// Map LEN bytes (a multiple of the page size) between two guard pages,
+// and lock them if we can.
+void *
+secmem_arena::map(size_t len)
+{
+  log_assert(len > 0 && len == round_to_pages(len));
+
+  uint8_t *base = (uint8_t *)mmap(0, len + 2*page, PROT_READ|PROT_WRITE,
+                                  MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    log_abort("secmem: failed to map %lu bytes: %s",
+              (unsigned long)len, strerror(errno));
+  if (mprotect(base, page, PROT_NONE) ||
+      mprotect(base + page + len, page, PROT_NONE))
+    log_abort("secmem: failed to protect guard pages: %s", strerror(errno));
+
+  uint8_t *p = base + page;
+#ifdef MADV_DONTDUMP
+  madvise(p, len, MADV_DONTDUMP);
+#endif
+  mapping m = { p, len, lock(p, len) };
+  mappings.push_back(m);
+  stats.reserved += len;
+  return p;
+}
+
+void
+secmem_arena::unmap(void *p, size_t len)
+{
+  for (std::vector<mapping>::iterator m = mappings.begin();
+       m != mappings.end(); m++)
+    if (m->p == p) {
+      log_assert(m->len == len);
+      if (m->locked)
+        stats.locked -= len;
+      mappings.erase(m);
+      break;
+    }
+  stats.reserved -= len;
+  munmap((uint8_t *)p - page, len + 2*page);
+}
+
+#else
+
+// No mlock or guard pages here; just use the heap.
+bool
+secmem_arena::lock(void *, size_t)
+{
+  return false;
+}
+
+void *
+secmem_arena::map(size_t len)
+{
+  stats.reserved += len;
+  return xzalloc(len);
+}
+
+void
+secmem_arena::unmap(void *p, size_t len)
+{
+  stats.reserved -= len;
+  free(p);
+}
+
+#endif
+
+void *
+secmem_alloc(size_t n)
+{
+  arena.stats.n_allocs++;
+
+  if (n > SECMEM_MAX_SMALL) {
+    size_t len = round_to_pages(n);
+    arena.stats.in_use += len;
+    arena.stats.peak = std::max(arena.stats.peak, arena.stats.in_use);
+    return arena.map(len);
+  }
+
+  unsigned int c = size_class(n);
+  size_t sz = SECMEM_MIN_SMALL << c;
+  arena.stats.in_use += sz;
+  arena.stats.peak = std::max(arena.stats.peak, arena.stats.in_use);
+
+  if (free_block *b = arena.free_lists[c]) {
+    arena.free_lists[c] = b->next;
+    b->next = 0;
+    return b;
+  }
+
+  if (arena.bump_left < sz) {
+    arena.bump = (uint8_t *)arena.map(SECMEM_CHUNK_LEN);
+    arena.bump_left = SECMEM_CHUNK_LEN;
+  }
+  void *p = arena.bump;
+  arena.bump += sz;
+  arena.bump_left -= sz;
+  return p;
+}
+
+void
+secmem_free(void *p, size_t n)
+{
+  if (!p)
+    return;
+  arena.stats.n_frees++;
+
+  if (n > SECMEM_MAX_SMALL) {
+    size_t len = round_to_pages(n);
+    OPENSSL_cleanse(p, len);
+    arena.stats.in_use -= len;
+    arena.unmap(p, len);
+    return;
+  }
+
+  unsigned int c = size_class(n);
+  size_t sz = SECMEM_MIN_SMALL << c;
+  OPENSSL_cleanse(p, sz);
+  arena.stats.in_use -= sz;
+
+  free_block *b = (free_block *)p;
+  b->next = arena.free_lists[c];
+  arena.free_lists[c] = b;
+}
+
+void
+secmem_after_fork(void)
+{
+  arena.stats.locked = 0;
+  for (std::vector<mapping>::iterator m = arena.mappings.begin();
+       m != arena.mappings.end(); m++)
+    m->locked = arena.lock(m->p, m->len);
+}
+
+void
+secmem_get_stats(secmem_stats *st)
+{
+  *st = arena.stats;
+}
+
+void
+secmem_log_stats(void)
+{
+  log_info("secmem: %lu bytes in use (peak %lu), %lu reserved, %lu locked; "
+           "%lu allocations, %lu frees",
+           (unsigned long)arena.stats.in_use,
+           (unsigned long)arena.stats.peak,
+           (unsigned long)arena.stats.reserved,
+           (unsigned long)arena.stats.locked,
+           arena.stats.n_allocs, arena.stats.n_frees);
+}
@@ -0,0 +1,60 @@
+/* Copyright 2012 the StegoTorus authors
+   See LICENSE for other credits and copying information
+*/
+
+#ifndef SECMEM_H
+#define SECMEM_H
+
+/* An arena for key material and cipher state.  Its memory is locked
+   into RAM where the operating system allows (so keys are never
+   written to swap) and left out of core dumps, and each chunk of it
+   is bracketed by inaccessible guard pages, so that an overrun from
+   an ordinary heap buffer cannot reach into it (nor an overrun from
+   the arena out of it).  Freed blocks are wiped and go onto a free
+   list for their size class, so setting up and tearing down a
+   circuit's ciphers does not touch the general-purpose heap.
+
+   If the memory cannot be locked (RLIMIT_MEMLOCK is often small),
+   the arena warns once and carries on without locking.
+
+   Like rng_bytes, the arena may be used only from the event loop
+   thread.  */
+
+/** Return N bytes of zeroed memory from the arena, suitably aligned
+    for any type.  Cannot fail.  */
+void *secmem_alloc(size_t n);
+
+/** Wipe and release P, which must have come from secmem_alloc(N).  */
+void secmem_free(void *p, size_t n);
+
+struct secmem_stats
+{
+  size_t in_use;      // bytes handed out and not yet freed
+  size_t peak;        // high-water mark of in_use
+  size_t reserved;    // bytes mapped, not counting guard pages
+  size_t locked;      // how much of 'reserved' is locked into RAM
+  unsigned long n_allocs;
+  unsigned long n_frees;
+};
+
+/** Lock the arena's memory into RAM again.  Memory locks are not
+    inherited across fork(), so a child process must call this before
+    it relies on anything allocated before the fork.  */
+void secmem_after_fork(void);
+
+/** Report the arena's current usage.  */
+void secmem_get_stats(secmem_stats *st);
+
+/** Log the arena's usage at 'info' severity.  */
+void secmem_log_stats(void);
+
+/** Classes whose instances should live in the arena inherit from
+    this.  Their destructors must be virtual if they are deleted
+    through a base pointer, so that the right size is passed back.  */
+struct secmem_object
+{
+  static void *operator new(size_t n) { return secmem_alloc(n); }
+  static void operator delete(void *p, size_t n) { secmem_free(p, n); }
+};
+
+#endif
@@ -28,7 +28,23 @@ steg_new(const char *name, config_t *cfg)
  return 0;
 }
 
+/* Have every steg module that uses cover-traffic files reread them. */
+void
+steg_reload(void)
+{
+  const steg_module *const *s;
+  for (s = supported_stegs; *s; s++)
+    if ((**s).reload)
+      (**s).reload();
+}
+
 /* Define these here rather than in the class definition so that the
    vtables will be emitted in only one place. */
 steg_config_t::~steg_config_t() {}
 steg_t::~steg_t() {}
+
+size_t
+steg_t::transmit_capacity(size_t min, size_t max)
+{
+  return transmit_room(max, min, max);
+}
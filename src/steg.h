@@ -69,6 +69,16 @@ struct steg_t
       in this range already.  */
   virtual size_t transmit_room(size_t pref, size_t min, size_t max) = 0;
 
+  /** Return the most bytes, between MIN and MAX, that transmit_room
+      could grant right now, or zero if your connection cannot
+      transmit at all.  The protocol uses this to rank connections
+      before asking one of them for transmit_room, so it must not be
+      randomized and should be cheap.  You need not define this
+      method; the default asks transmit_room for MAX bytes, which is
+      right for any module whose transmit_room never does better than
+      PREF or MAX, whichever is smaller.  */
+  virtual size_t transmit_capacity(size_t min, size_t max);
+
   /** Consume all of the data in SOURCE, disguise it, and write it to
       the outbound buffer for your connection. Return 0 on success, -1
       on failure. */
@@ -96,16 +106,31 @@ struct steg_module
 
   /** Create an appropriate steg_config_t subclass for this module. */
   steg_config_t *(*new_)(config_t *cfg);
+
+  /** Reread whatever cover-traffic files this module uses, or NULL if
+      it has none.  Connections that are already open may carry on
+      with the old contents; see steg_reload.  */
+  void (*reload)(void);
 };
 
 extern const steg_module *const supported_stegs[];
 
 int steg_is_supported(const char *name);
 steg_config_t *steg_new(const char *name, config_t *cfg);
+void steg_reload(void);
 
-/* Macros for use in defining steg modules. */
+/* Macros for use in defining steg modules.  A module that can reread
+   its cover-traffic files uses STEG_DEFINE_RELOADABLE_MODULE instead
+   of STEG_DEFINE_MODULE, and defines 'static void MODULE_reload(void)'
+   before it.  */
 
 #define STEG_DEFINE_MODULE(mod)                         \
+  STEG_DEFINE_MODULE_(mod, 0)
+
+#define STEG_DEFINE_RELOADABLE_MODULE(mod)              \
+  STEG_DEFINE_MODULE_(mod, mod##_reload)
+
+#define STEG_DEFINE_MODULE_(mod, reload)                \
   /* new_ dispatchers */                                \
   static steg_config_t *mod##_new(config_t *cfg)        \
   { return new mod##_steg_config_t(cfg); }              \
@@ -116,7 +141,7 @@ steg_config_t *steg_new(const char *name, config_t *cfg);
                                                         \
   /* module object */                                   \
   extern const steg_module s_mod_##mod = {              \
-    #mod, mod##_new                                     \
+    #mod, mod##_new, reload                             \
   } /* deliberate absence of semicolon */
 
 #define STEG_CONFIG_DECLARE_METHODS(mod)                \
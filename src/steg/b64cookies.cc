@@ -1,5 +1,7 @@
 
+#include "util.h"
 #include "b64cookies.h"
+#include "rng.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,12 +31,12 @@ int gen_one_b64cookie(char* outbuf, int& cookielen, char* data, int datalen) {
   int namelen;
   int data_consumed = 0;
 
-  cookielen = 4 + rand() % (datalen - 3);
+  cookielen = 4 + fast_rng_int(datalen - 3);
   
   if (cookielen > 13)
-    namelen = rand() % 10 + 1;
+    namelen = fast_rng_int(10) + 1;
   else 
-    namelen = rand() % (cookielen - 3) + 1;
+    namelen = fast_rng_int(cookielen - 3) + 1;
 
   
   while (sofar < namelen) {
@@ -120,7 +122,7 @@ void sanitize_b64(char* input, int len) {
 
 
   while (eqcnt > 0) {
-    int pos = rand() % (len - 1) + 1;
+    int pos = fast_rng_int(len - 1) + 1;
     if (pos >= len - eqcnt) {
       input[pos] = '-';
       eqcnt--;
@@ -1,5 +1,7 @@
 
+#include "util.h"
 #include "cookies.h"
+#include "rng.h"
 
 int unwrap_cookie(unsigned char* inbuf, unsigned char* outbuf, int buflen) {
   int i,j;
@@ -38,20 +40,20 @@ int gen_one_cookie(unsigned char* outbuf, int cookielen, unsigned char* data, in
 
 
   if (cookielen > 13)
-    namelen = rand() % 10 + 1;
+    namelen = fast_rng_int(10) + 1;
   else 
-    namelen = rand() % (cookielen - 3) + 1;
+    namelen = fast_rng_int(cookielen - 3) + 1;
 
 
 
 
   while (sofar < namelen) {
-    c = rand() % (127 - 33) + 33;
+    c = fast_rng_int(127 - 33) + 33;
     if (c == '=' || c == ';' || c == '`' || c == '\'' || c == '%' || c == '+' || c == '{' || c == '}' ||
 	c == '<' || c == '>' || c == '?' || c == '#')
       continue;
 
-    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') || (rand () % 4 != 0)) {
+    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') || (fast_rng_int(4) != 0)) {
       if (data_consumed < datalen) 
 	outbuf[sofar++] = data[data_consumed++];
     }
@@ -64,14 +66,14 @@ int gen_one_cookie(unsigned char* outbuf, int cookielen, unsigned char* data, in
 
 
   while (sofar < cookielen) {
-    c = rand() % (127 - 33) + 33;
+    c = fast_rng_int(127 - 33) + 33;
     if (c == '=' || c == ';' || c == '`' || c == '\'' || c == '%' || c == '+' || c == '{' || c == '}' ||
 	c == '<' || c == '>' || c == '?' || c == '#')
       continue;
 
 
 
-    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') || (rand() % 4 != 0)) {
+    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') || (fast_rng_int(4) != 0)) {
       if (data_consumed < datalen) 
 	outbuf[sofar++] = data[data_consumed++];
     }
@@ -120,7 +122,7 @@ int gen_cookie_field(unsigned char* outbuf, int total_cookie_len, unsigned char*
   }
 
   while (rem_cookie_len > 4) {
-    int cookielen = 4 + rand() % (rem_cookie_len - 3);
+    int cookielen = 4 + fast_rng_int(rem_cookie_len - 3);
 
     int cnt =  gen_one_cookie(outbuf, cookielen, data + consumed, datalen - consumed);
 
@@ -151,7 +153,7 @@ int gen_cookie_field(unsigned char* outbuf, int total_cookie_len, unsigned char*
       }
 
       for (i=0; i < rem_cookie_len; i++) 
-	outbuf[i] = "ghijklmnopqrstuvwxyzGHIJKLMNOPQRSTUVWXYZ"[rand() % 40];
+	outbuf[i] = "ghijklmnopqrstuvwxyzGHIJKLMNOPQRSTUVWXYZ"[fast_rng_int(40)];
       
       return consumed;
     }
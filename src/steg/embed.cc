@@ -1,5 +1,6 @@
 #include "util.h"
 #include "connections.h"
+#include "cryptpool.h"
 #include "protocol.h"
 #include "steg.h"
 #include "rng.h"
@@ -16,18 +17,52 @@ namespace {
     vector<int> pkt_times;    // packet inter-arrival times
   };
 
+  // One generation of traces/embed.txt.  Every connection holds a
+  // reference to the generation that was current when it started;
+  // embed_reload swaps in a new one for the connections after it.
+  // The client names its generation by ID alongside the trace index,
+  // so that the server can refuse a trace it would read differently.
+  struct trace_set {
+    vector<trace_t> traces;
+    uint32_t id;            // hash of the contents; see read_traces
+    unsigned int refs;
+
+    trace_set() : id(2166136261u), refs(1) {}
+    void mix(int v);
+    void release() { if (--refs == 0) delete this; }
+  };
+
+  // The traces shared by every embed_steg_config_t in the process.
+  struct embed_trace_store {
+    trace_set *current;
+    unsigned int users;     // steg configs using it
+    crypt_lane reload_lane;
+
+    embed_trace_store() : current(0), users(0), reload_lane(true) {}
+  };
+
+  // Reads a new generation on the crypto pool's background thread,
+  // and swaps it in on the event loop thread.
+  struct embed_reload_job : crypt_job {
+    trace_set *set;
+
+    embed_reload_job() : set(0) {}
+    virtual ~embed_reload_job() { if (set) set->release(); }
+
+    virtual void run();
+    virtual void finish();
+  };
+
   struct embed_steg_config_t : steg_config_t {
     bool is_clientside;
-    vector<trace_t> traces;
 
     STEG_CONFIG_DECLARE_METHODS(embed);
-
-    size_t get_random_trace() const;
   };
 
   struct embed_steg_t : steg_t {
     embed_steg_config_t *config;
     conn_t *conn;
+    trace_set *traces;
 
     int cur_idx;           // current trace index
     trace_t *cur;             // current trace
@@ -46,7 +81,115 @@ namespace {
   };
 }
 
-STEG_DEFINE_MODULE(embed);
+static const char embed_trace_file[] = "traces/embed.txt";
+static embed_trace_store embed_store;
+
+// Fold V into the generation ID (32-bit FNV-1a, a byte at a time).
+void
+trace_set::mix(int v)
+{
+  for (int i = 0; i < 4; i++) {
+    id ^= uint8_t(uint32_t(v) >> (8*i));
+    id *= 16777619u;
+  }
+}
+
+// Read a set of traces from FNAME; return NULL if it is unreadable or
+// malformed.  Safe to call on any thread.
+static trace_set *
+read_traces(const char *fname)
+{
+  FILE *trace_file = fopen(fname, "r");
+  if (!trace_file) {
+    log_warn("opening %s: %s", fname, strerror(errno));
+    return 0;
+  }
+
+  trace_set *set = new trace_set;
+  vector<trace_t> &traces = set->traces;
+  int num_traces;
+  if (fscanf(trace_file, "%d", &num_traces) < 1 || num_traces <= 0) {
+    log_warn("couldn't read number of traces");
+    goto fail;
+  }
+
+  traces.resize(num_traces);
+  set->mix(num_traces);
+
+  for (vector<trace_t>::iterator p = traces.begin(); p != traces.end(); ++p) {
+    int num_pkt;
+    if (fscanf(trace_file, "%d", &num_pkt) < 1 || num_pkt < 0) {
+      log_warn("couldn't read number of packets in trace %ld",
+               p - traces.begin());
+      goto fail;
+    }
+
+    p->pkt_sizes.resize(num_pkt);
+    p->pkt_times.resize(num_pkt);
+    set->mix(num_pkt);
+    for (int i = 0; i < num_pkt; i++) {
+      if (fscanf(trace_file, "%hd %d", &p->pkt_sizes[i], &p->pkt_times[i]) < 1) {
+        log_warn("couldn't read trace entry %ld/%d",
+                 p - traces.begin(), i);
+        goto fail;
+      }
+      set->mix(p->pkt_sizes[i]);
+      set->mix(p->pkt_times[i]);
+    }
+  }
+
+  fclose(trace_file);
+  log_debug("read %d traces, generation %08x", num_traces, set->id);
+  return set;
+
+ fail:
+  fclose(trace_file);
+  set->release();
+  return 0;
+}
+
+void
+embed_reload_job::run()
+{
+  set = read_traces(embed_trace_file);
+}
+
+void
+embed_reload_job::finish()
+{
+  if (!set) {
+    log_warn("failed to reload %s; carrying on with the old one",
+             embed_trace_file);
+    return;
+  }
+  if (!embed_store.current)
+    return;
+
+  embed_store.current->release();
+  embed_store.current = set;
+  set = 0;
+  log_info("reloaded %s (%lu traces, generation %08x)", embed_trace_file,
+           (unsigned long)embed_store.current->traces.size(),
+           embed_store.current->id);
+}
+
+static void
+embed_reload(void)
+{
+  if (!embed_store.current)
+    return;
+
+  embed_reload_job *job = new embed_reload_job;
+  if (crypt_pool_running())
+    embed_store.reload_lane.submit(job);
+  else {
+    job->run();
+    job->finish();
+    delete job;
+  }
+}
+
+STEG_DEFINE_RELOADABLE_MODULE(embed);
 
 static int
 millis_since(struct timeval *last)
@@ -64,36 +207,23 @@ embed_steg_config_t::embed_steg_config_t(config_t *cfg)
   : steg_config_t(cfg),
     is_clientside(cfg->mode != LSN_SIMPLE_SERVER)
 {
-  // read in traces to use for connections
-  FILE *trace_file = fopen("traces/embed.txt", "r");
-  if (!trace_file)
-    log_abort("opening traces/embed.txt: %s", strerror(errno));
-
-  int num_traces;
-  if (fscanf(trace_file, "%d", &num_traces) < 1)
-    log_abort("couldn't read number of traces");
-
-  traces.resize(num_traces);
-
-  for (vector<trace_t>::iterator p = traces.begin(); p != traces.end(); ++p) {
-    int num_pkt;
-    if (fscanf(trace_file, "%d", &num_pkt) < 1)
-      log_abort("couldn't read number of packets in trace %ld",
-                p - traces.begin());
-
-    p->pkt_sizes.resize(num_pkt);
-    p->pkt_times.resize(num_pkt);
-    for (int i = 0; i < num_pkt; i++)
-      if (fscanf(trace_file, "%hd %d", &p->pkt_sizes[i], &p->pkt_times[i]) < 1)
-        log_abort("couldn't read trace entry %ld/%d",
-                  p - traces.begin(), i);
+  // read in traces to use for connections, unless another config
+  // already has
+  if (embed_store.users++ == 0) {
+    embed_store.current = read_traces(embed_trace_file);
+    if (!embed_store.current)
+      log_abort("failed to load %s", embed_trace_file);
   }
-
-  log_debug("read %d traces", num_traces);
 }
 
 embed_steg_config_t::~embed_steg_config_t()
 {
+  if (--embed_store.users > 0)
+    return;
+
+  embed_store.current->release();
+  embed_store.current = 0;
+  embed_store.reload_lane.cancel();
 }
 
 steg_t *
@@ -102,12 +232,6 @@ embed_steg_config_t::steg_create(conn_t *conn)
   return new embed_steg_t(this, conn);
 }
 
-size_t
-embed_steg_config_t::get_random_trace() const
-{
-  return rng_int(traces.size());
-}
-
 bool
 embed_steg_t::advance_packet()
 {
@@ -141,12 +265,13 @@ embed_steg_t::is_finished()
 }
 
 embed_steg_t::embed_steg_t(embed_steg_config_t *cf, conn_t *cn)
-  : config(cf), conn(cn)
+  : config(cf), conn(cn), traces(embed_store.current)
 {
+  traces->refs++;
   cur_idx = -1;
   if (config->is_clientside) {
-    cur_idx = config->get_random_trace();
-    cur = &config->traces[cur_idx];
+    cur_idx = rng_int(traces->traces.size());
+    cur = &traces->traces[cur_idx];
     cur_pkt = 0;
   }
   gettimeofday(&last_pkt, NULL);
@@ -154,6 +279,7 @@ embed_steg_t::embed_steg_t(embed_steg_config_t *cf, conn_t *cn)
 
 embed_steg_t::~embed_steg_t()
 {
+  traces->release();
 }
 
 steg_config_t *
@@ -170,9 +296,10 @@ embed_steg_t::transmit_room(size_t, size_t lo, size_t hi)
   int time_diff = millis_since(&last_pkt);
   if (get_pkt_time() > time_diff+10) return 0;
 
-  // 2 bytes for data length, 4 bytes for the index of a new trace
+  // 2 bytes for data length, 8 for the generation and index of a
+  // new trace
   size_t room = get_pkt_size() - 2;
-  if (cur_pkt == 0) room -= 4;
+  if (cur_pkt == 0) room -= 8;
 
   if (room < lo) room = lo;
   if (room > hi) room = hi;
@@ -187,11 +314,12 @@ embed_steg_t::transmit(struct evbuffer *source)
   short pkt_size = get_pkt_size();
   short used = src_len + 2;
 
-  // starting a new trace, send the index
+  // starting a new trace, send the generation and index
   if (cur_pkt == 0) {
+    if (evbuffer_add(dest, &traces->id, 4) == -1) return -1;
     if (evbuffer_add(dest, &cur_idx, 4) == -1) return -1;
-    used += 4;
-    log_debug("sending trace %d", cur_idx);
+    used += 8;
+    log_debug("sending trace %d of generation %08x", cur_idx, traces->id);
   }
 
   log_debug("sending packet %d of trace %d", cur_pkt, cur_idx);
@@ -232,12 +360,27 @@ embed_steg_t::receive(struct evbuffer *dest)
 
   log_debug("receiving buffer of length %d", src_len);
 
-  // if we are receiving the first packet of the trace, read the index
+  // if we are receiving the first packet of the trace, read the
+  // generation and index; the trace must be one we have the same copy
+  // of, or we will not agree on where its packets end
   if (cur_idx == -1) {
+    uint32_t gen;
+    if (src_len < 8) return 0;
+    if (evbuffer_remove(source, &gen, 4) != 4) return -1;
+    if (gen != traces->id) {
+      log_warn(conn, "peer's traces are generation %08x, ours are %08x",
+               gen, traces->id);
+      return -1;
+    }
     if (evbuffer_remove(source, &cur_idx, 4) != 4) return -1;
-    cur = &config->traces[cur_idx];
+    if (cur_idx < 0 || cur_idx >= int(traces->traces.size())) {
+      log_warn(conn, "peer asked for trace %d of %lu", cur_idx,
+               (unsigned long)traces->traces.size());
+      return -1;
+    }
+    cur = &traces->traces[cur_idx];
     cur_pkt = 0;
-    pkt_size += 4;
+    pkt_size += 8;
 
     log_debug("received first packet of trace %d", cur_idx);
   }
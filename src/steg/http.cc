@@ -39,6 +39,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "rng.h"
 
 #include "payloads.h"
+#include "peernames.h"
 #include "cookies.h"
 #include "swfSteg.h"
 #include "pdfSteg.h"
@@ -55,15 +56,13 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 int
 http_server_receive(steg_t *s, conn_t *conn, struct evbuffer *dest, struct evbuffer* source);
 
-int
-lookup_peer_name_from_ip(const char* p_ip, char* p_name);
-
-
 namespace {
   struct http_steg_config_t : steg_config_t
   {
     bool is_clientside : 1;
-    payloads pl;
+    payload_trace *trace;         // in the payload store
+    rng_geom_sampler room_sizes;  // for transmit_room
+    peer_name_cache *peer_names;  // shared by the whole process
 
     STEG_CONFIG_DECLARE_METHODS(http);
   };
@@ -72,38 +71,47 @@ namespace {
   {
     http_steg_config_t *config;
     conn_t *conn;
+    const payloads *pl;   // as they were when this connection started
     char peer_dnsname[512];
 
     bool have_transmitted : 1;
     bool have_received : 1;
     int type;
+    unsigned int exchanges;  // requests sent or responses sent so far
 
     http_steg_t(http_steg_config_t *cf, conn_t *cn);
     STEG_DECLARE_METHODS(http);
+    virtual size_t transmit_capacity(size_t lo, size_t hi);
+
+    bool room_bounds(size_t *lo, size_t *hi);
   };
 }
 
-STEG_DEFINE_MODULE(http);
+static void
+http_reload(void)
+{
+  payload_store_reload();
+}
+
+STEG_DEFINE_RELOADABLE_MODULE(http);
 
 http_steg_config_t::http_steg_config_t(config_t *cfg)
   : steg_config_t(cfg),
-    is_clientside(cfg->mode != LSN_SIMPLE_SERVER)
+    is_clientside(cfg->mode != LSN_SIMPLE_SERVER),
+    room_sizes(((unsigned int)INT_MAX) + 1, 8),
+    peer_names(peer_names_open())
 {
 
   if (is_clientside)
-    load_payloads(this->pl, "traces/client.out");
-  else {
-    load_payloads(this->pl, "traces/server.out");
-    init_JS_payload_pool(this->pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE, JS_MIN_AVAIL_SIZE);
-    //   init_JS_payload_pool(this, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE, JS_MIN_AVAIL_SIZE, HTTP_CONTENT_HTML);
-    init_HTML_payload_pool(this->pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE, HTML_MIN_AVAIL_SIZE);
-    init_PDF_payload_pool(this->pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE, PDF_MIN_AVAIL_SIZE);
-    init_SWF_payload_pool(this->pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE, 0);
-  }
+    trace = payload_store_open("traces/client.out", false);
+  else
+    trace = payload_store_open("traces/server.out", true);
 }
 
 http_steg_config_t::~http_steg_config_t()
 {
+  payload_store_close(trace);
+  peer_names_close();
 }
 
 steg_t *
@@ -170,14 +178,15 @@ buf_dump(unsigned char* buf, int len, FILE *out)
 
 
 http_steg_t::http_steg_t(http_steg_config_t *cf, conn_t *cn)
-  : config(cf), conn(cn),
-    have_transmitted(false), have_received(false)
+  : config(cf), conn(cn), pl(payload_store_acquire(cf->trace)),
+    have_transmitted(false), have_received(false), exchanges(0)
 {
   memset(peer_dnsname, 0, sizeof peer_dnsname);
 }
 
 http_steg_t::~http_steg_t()
 {
+  payload_store_release(pl);
 }
 
 steg_config_t *
@@ -194,98 +203,73 @@ clamp(size_t val, size_t lo, size_t hi)
   return val;
 }
 
-size_t
-http_steg_t::transmit_room(size_t pref, size_t lo, size_t hi)
+// Narrow [LO, HI] to what this connection can carry in its next
+// request or response.  Returns false if it cannot carry anything.
+bool
+http_steg_t::room_bounds(size_t *lo, size_t *hi)
 {
   if (have_transmitted)
     /* can't send any more on this connection */
-    return 0;
+    return false;
 
   if (config->is_clientside) {
     // MIN_COOKIE_SIZE and MAX_COOKIE_SIZE are *after* base64'ing
-    if (lo < MIN_COOKIE_SIZE*3/4)
-      lo = MIN_COOKIE_SIZE*3/4;
+    if (*lo < MIN_COOKIE_SIZE*3/4)
+      *lo = MIN_COOKIE_SIZE*3/4;
 
-    if (hi > MAX_COOKIE_SIZE*3/4)
-      hi = MAX_COOKIE_SIZE*3/4;
+    if (*hi > MAX_COOKIE_SIZE*3/4)
+      *hi = MAX_COOKIE_SIZE*3/4;
   }
   else {
     if (!have_received)
-      return 0;
+      return false;
 
     switch (type) {
     case HTTP_CONTENT_SWF:
-      if (hi >= 1024)
-        hi = 1024;
+      if (*hi >= 1024)
+        *hi = 1024;
       break;
 
     case HTTP_CONTENT_JAVASCRIPT:
-      if (hi >= config->pl.max_JS_capacity / 2)
-        hi = config->pl.max_JS_capacity / 2;
+      if (*hi >= pl->max_JS_capacity / 2)
+        *hi = pl->max_JS_capacity / 2;
       break;
 
     case HTTP_CONTENT_HTML:
-      if (hi >= config->pl.max_HTML_capacity / 2)
-        hi = config->pl.max_HTML_capacity / 2;
+      if (*hi >= pl->max_HTML_capacity / 2)
+        *hi = pl->max_HTML_capacity / 2;
       break;
 
     case HTTP_CONTENT_PDF:
-      if (hi >= PDF_MIN_AVAIL_SIZE)
-        hi = PDF_MIN_AVAIL_SIZE;
+      if (*hi >= PDF_MIN_AVAIL_SIZE)
+        *hi = PDF_MIN_AVAIL_SIZE;
       break;
     }
   }
 
-  if (hi < lo)
+  if (*hi < *lo)
     log_abort("hi<lo: client=%d type=%d hi=%ld lo=%ld",
               config->is_clientside, type,
-              (unsigned long)hi, (unsigned long)lo);
-
-  return clamp(pref + rng_range_geom(hi - lo, 8), lo, hi);
+              (unsigned long)*hi, (unsigned long)*lo);
+  return true;
 }
 
-int
-lookup_peer_name_from_ip(const char* p_ip, char* p_name)  {
-  struct addrinfo* ailist;
-  struct addrinfo* aip;
-  struct addrinfo hint;
-  char buf[128];
-
-  hint.ai_flags = AI_CANONNAME;
-  hint.ai_family = 0;
-  hint.ai_socktype = 0;
-  hint.ai_protocol = 0;
-  hint.ai_addrlen = 0;
-  hint.ai_canonname = NULL;
-  hint.ai_addr = NULL;
-  hint.ai_next = NULL;
-
-  strcpy(buf, p_ip);
-  buf[strchr(buf, ':') - buf] = 0;
-
-
-  if (getaddrinfo(buf, NULL, &hint, &ailist)) {
-    fprintf(stderr, "error: getaddrinfo() %s\n", p_ip);
-    exit(1);
-  }
-
-  for (aip = ailist; aip != NULL; aip = aip->ai_next) {
-    char buf[512];
-    if (getnameinfo(aip->ai_addr, sizeof(struct sockaddr), buf, 512, NULL, 0, 0) == 0) {
-      sprintf(p_name, "%s", buf);
-      return 1;
-    }
-  }
-
-  return 0;
+size_t
+http_steg_t::transmit_room(size_t pref, size_t lo, size_t hi)
+{
+  if (!room_bounds(&lo, &hi))
+    return 0;
+  return clamp(pref + config->room_sizes.sample(hi - lo), lo, hi);
 }
 
-
-
-
-
-
-
+// transmit_room pads by a random amount, but never past HI.
+size_t
+http_steg_t::transmit_capacity(size_t lo, size_t hi)
+{
+  if (!room_bounds(&lo, &hi))
+    return 0;
+  return hi;
+}
 
 int
 http_client_cookie_transmit (http_steg_t *s, struct evbuffer *source,
@@ -325,7 +309,7 @@ http_client_cookie_transmit (http_steg_t *s, struct evbuffer *source,
 
   // retry up to 10 times
   while (!payload_len) {
-    payload_len = find_client_payload(s->config->pl, buf, bufsize,
+    payload_len = find_client_payload(*s->pl, buf, bufsize,
                                       TYPE_HTTP_REQUEST);
     if (cnt++ == 10) {
       goto err;
@@ -334,7 +318,8 @@ http_client_cookie_transmit (http_steg_t *s, struct evbuffer *source,
   buf[payload_len] = 0;
 
   if (s->peer_dnsname[0] == '\0')
-    lookup_peer_name_from_ip(conn->peername, s->peer_dnsname);
+    s->config->peer_names->lookup(conn->peername, s->peer_dnsname,
+                                 sizeof s->peer_dnsname);
 
   bzero(data2, sbuflen*4);
   E.encode((char*) data, sbuflen, (char*) data2);
@@ -412,7 +397,6 @@ http_client_cookie_transmit (http_steg_t *s, struct evbuffer *source,
 
   evbuffer_drain(source, sbuflen);
   log_debug("CLIENT TRANSMITTED payload %d\n", (int) sbuflen);
-  conn->cease_transmission();
 
   s->type = find_uri_type(buf, bufsize);
   s->have_transmitted = true;
@@ -440,10 +424,10 @@ int gen_uri_field(char* uri, unsigned int uri_sz, char* data, int datalen) {
   so_far = 5;
 
   while (datalen > 0) {
-    unsigned int r = rand() % 4;
+    unsigned int r = fast_rng_int(4);
 
     if (r == 1) {
-      r = rand() % 46;
+      r = fast_rng_int(46);
       if (r < 20)
         uri[so_far++] = 'g' + r;
       else
@@ -457,7 +441,7 @@ int gen_uri_field(char* uri, unsigned int uri_sz, char* data, int datalen) {
 
 
 
-    r = rand() % 8;
+    r = fast_rng_int(8);
 
     if (r == 0 && datalen > 0)
       uri[so_far++] = '/';
@@ -472,7 +456,7 @@ int gen_uri_field(char* uri, unsigned int uri_sz, char* data, int datalen) {
     }
   }
 
-  switch(rand()%4){
+  switch(fast_rng_int(4)){
   case 1:
     memcpy(uri+so_far, ".htm ", 6);
     break;
@@ -521,7 +505,8 @@ http_client_uri_transmit (http_steg_t *s,
   char buf[10000];
 
   if (s->peer_dnsname[0] == '\0')
-    lookup_peer_name_from_ip(conn->peername, s->peer_dnsname);
+    s->config->peer_names->lookup(conn->peername, s->peer_dnsname,
+                                 sizeof s->peer_dnsname);
 
   nv = evbuffer_peek(source, slen, NULL, NULL, 0);
   iv = (evbuffer_iovec *)xzalloc(sizeof(struct evbuffer_iovec) * nv);
@@ -553,7 +538,7 @@ http_client_uri_transmit (http_steg_t *s,
 
   // retry up to 10 times
   while (!len) {
-    len = find_client_payload(s->config->pl, buf, sizeof(buf),
+    len = find_client_payload(*s->pl, buf, sizeof(buf),
                               TYPE_HTTP_REQUEST);
     if (cnt++ == 10) return -1;
   }
@@ -573,7 +558,6 @@ http_client_uri_transmit (http_steg_t *s,
 
 
   evbuffer_drain(source, slen);
-  conn->cease_transmission();
   s->type = find_uri_type(outbuf, sizeof(outbuf));
   s->have_transmitted = 1;
   return 0;
@@ -617,30 +601,50 @@ http_steg_t::transmit(struct evbuffer *source)
     */
 
  //@@
-    return http_client_cookie_transmit(this, source, conn); //@@
+    int rval = http_client_cookie_transmit(this, source, conn); //@@
+
+    // Unless this was the last request this connection may carry, it
+    // stays open; receive() re-arms it once the response is in.
+    if (rval == 0 && ++exchanges >= config->cfg->max_exchanges)
+      conn->cease_transmission();
+    return rval;
   }
   else {
     int rval = -1;
+    bool keep_alive = exchanges + 1 < config->cfg->max_exchanges;
     switch(type) {
 
     case HTTP_CONTENT_SWF:
-      rval = http_server_SWF_transmit(this->config->pl, source, conn);
+      rval = http_server_SWF_transmit(*this->pl, source, conn,
+                                      keep_alive);
       break;
 
     case HTTP_CONTENT_JAVASCRIPT:
-      rval = http_server_JS_transmit(this->config->pl, source, conn, HTTP_CONTENT_JAVASCRIPT);
+      rval = http_server_JS_transmit(*this->pl, source, conn,
+                                     HTTP_CONTENT_JAVASCRIPT, keep_alive);
       break;
 
     case HTTP_CONTENT_HTML:
-      rval = http_server_JS_transmit(this->config->pl, source, conn, HTTP_CONTENT_HTML);
+      rval = http_server_JS_transmit(*this->pl, source, conn,
+                                     HTTP_CONTENT_HTML, keep_alive);
       break;
 
     case HTTP_CONTENT_PDF:
-      rval = http_server_PDF_transmit(this->config->pl, source, conn);
+      rval = http_server_PDF_transmit(*this->pl, source, conn,
+                                      keep_alive);
       break;
     }
 
-    if (rval == 0) have_transmitted = 1;
+    if (rval == 0) {
+      exchanges++;
+      if (keep_alive)
+        // Wait for the next request on this connection.
+        have_received = 0;
+      else {
+        have_transmitted = 1;
+        conn->cease_transmission();
+      }
+    }
     return rval;
   }
 }
@@ -738,6 +742,10 @@ http_steg_t::receive(struct evbuffer *dest)
 
 
   if (config->is_clientside) {
+    // RECV_INCOMPLETE is the same as RECV_GOOD; a response has only
+    // arrived if it was drained from the input.
+    size_t pending = evbuffer_get_length(source);
+
     switch(type) {
 
     case HTTP_CONTENT_SWF:
@@ -754,7 +762,17 @@ http_steg_t::receive(struct evbuffer *dest)
       break;
     }
 
-    if (rval == RECV_GOOD) have_received = 1;
+    if (rval == RECV_GOOD && evbuffer_get_length(source) < pending) {
+      if (exchanges < config->cfg->max_exchanges) {
+        // The server is keeping the connection open for another
+        // request, so we may send again.
+        have_transmitted = 0;
+        conn->resume_transmission();
+      } else {
+        have_received = 1;
+        conn->expect_close();
+      }
+    }
     return rval;
 
   } else {
@@ -707,8 +707,8 @@ int testDecode2(char *inBuf, char *outBuf,
 
 
 int
-http_server_JS_transmit (payloads& pl, struct evbuffer *source, conn_t *conn,
-                         unsigned int content_type)
+http_server_JS_transmit (const payloads& pl, struct evbuffer *source, conn_t *conn,
+                         unsigned int content_type, bool keep_alive)
 {
 
   struct evbuffer_iovec *iv;
@@ -842,10 +842,10 @@ http_server_JS_transmit (payloads& pl, struct evbuffer *source, conn_t *conn,
 
   if (mode == CONTENT_JAVASCRIPT) { // JavaScript in HTTP body
     newHdrLen = gen_response_header((char*) "application/x-javascript", gzipMode,
-                                    outbuf2len, newHdr, sizeof(newHdr));
+                                    outbuf2len, newHdr, sizeof(newHdr), keep_alive);
   } else if (mode == CONTENT_HTML_JAVASCRIPT) { // JavaScript(s) embedded in HTML doc
     newHdrLen = gen_response_header((char*) "text/html", gzipMode,
-                                    outbuf2len, newHdr, sizeof(newHdr));
+                                    outbuf2len, newHdr, sizeof(newHdr), keep_alive);
   } else { // unknown mode
     log_warn("SERVER ERROR: unknown mode for creating the HTTP response header");
     free(outbuf2);
@@ -874,7 +874,6 @@ http_server_JS_transmit (payloads& pl, struct evbuffer *source, conn_t *conn,
   evbuffer_drain(source, sbuflen);
 
   free(outbuf2);
-  conn->cease_transmission();
   //  downcast_steg(s)->have_transmitted = 1;
   return 0;
 }
@@ -885,7 +884,7 @@ http_server_JS_transmit (payloads& pl, struct evbuffer *source, conn_t *conn,
 
 
 int
-http_handle_client_JS_receive(steg_t *, conn_t *conn, struct evbuffer *dest, struct evbuffer* source) {
+http_handle_client_JS_receive(steg_t *, conn_t *, struct evbuffer *dest, struct evbuffer* source) {
   struct evbuffer_ptr s2;
   int response_len = 0;
   unsigned int content_len = 0;
@@ -1075,7 +1074,6 @@ http_handle_client_JS_receive(steg_t *, conn_t *conn, struct evbuffer *dest, str
   log_debug("Drained source for %d char\n", response_len);
    
   //  downcast_steg(s)->have_received = 1;
-  conn->expect_close();
   return RECV_GOOD;
 }
 
@@ -63,7 +63,8 @@ int testDecode2(char *inBuf, char *outBuf,
 
 
 int 
-http_server_JS_transmit (payloads& pl, struct evbuffer *source, conn_t *conn, unsigned int content_type);
+http_server_JS_transmit (const payloads& pl, struct evbuffer *source, conn_t *conn, unsigned int content_type,
+                         bool keep_alive);
 
 int
 http_handle_client_JS_receive(steg_t *s, conn_t *conn, struct evbuffer *dest, struct evbuffer* source);
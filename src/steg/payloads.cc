@@ -1,6 +1,14 @@
 #include "util.h"
 #include "payloads.h"
 #include "swfSteg.h"
+#include "rng.h"
+#include "cryptpool.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <map>
+#include <string>
+#include <sys/stat.h>
 
 /*
  * fixContentLen corrects the Content-Length for an HTTP msg that
@@ -176,83 +184,445 @@ log_debug("new: hdrLen = %d, bodyLen = %d, payloadLen = %d", hdrLen, bodyLen, hd
   return -1;
 }
 
-void load_payloads(payloads& pl, const char* fname)
+payloads::payloads()
+  : max_JS_capacity(0), max_HTML_capacity(0), max_PDF_capacity(0),
+    payload_count(0), trace(0), trace_len(0)
+{
+  memset(initTypePayload, 0, sizeof initTypePayload);
+  memset(&trace_stat, 0, sizeof trace_stat);
+}
+
+payloads::~payloads()
+{
+  for (size_t i = 0; i < rewritten.size(); i++)
+    free(rewritten[i]);
+  free(trace);
+}
+
+// Read the whole of F into one heap block, with a byte to spare at
+// the end for the NUL after the last message.  The messages are used
+// in place.  (Mapping the file instead would save the copy, but
+// anyone who then rewrote the trace in place would truncate it under
+// the mapping, and the next message touched would raise SIGBUS.)
+static bool
+read_trace(payloads& pl, FILE* f)
+{
+  struct stat& st = pl.trace_stat;
+  if (fstat(fileno(f), &st) || st.st_size < 0)
+    return false;
+  pl.trace_len = st.st_size;
+  pl.trace = (char *)xmalloc(pl.trace_len + 1);
+  return fread(pl.trace, 1, pl.trace_len, f) == pl.trace_len;
+}
+
+bool load_payloads(payloads& pl, const char* fname)
 {
   FILE* f;
-  char buf[HTTP_MSG_BUF_SIZE];
-  char buf2[HTTP_MSG_BUF_SIZE];
+  char* buf2;
   pentry_header pentry;
   int pentryLen;
   int r;
+  size_t pos;
+  std::vector<size_t> offsets;
 
-  srand(time(NULL));
   f = fopen(fname, "r");
   if (f == NULL) {
-    fprintf(stderr, "Cannot open trace file %s. Exiting\n", fname);
-    exit(1);
+    log_warn("cannot open trace file %s: %s", fname, strerror(errno));
+    return false;
   }
+  if (!read_trace(pl, f)) {
+    log_warn("cannot read trace file %s", fname);
+    fclose(f);
+    return false;
+  }
+  fclose(f);
 
-  bzero(pl.payload_hdrs, sizeof(pl.payload_hdrs));
-  pl.payload_count = 0;
+  pl.payload_hdrs.clear();
+  pl.payload_bufs.clear();
 
-  while (pl.payload_count < MAX_PAYLOADS) {
+  // First find all the messages.  This has to be done before any of
+  // them are NUL-terminated, because each terminator overwrites the
+  // start of the next header.
+  for (pos = 0; pl.trace_len - pos >= sizeof(pentry_header);
+       pos += pentryLen) {
+    memcpy(&pentry, pl.trace + pos, sizeof(pentry_header));
+    pos += sizeof(pentry_header);
 
-    if (fread(&pentry, 1, sizeof(pentry_header), f) < sizeof(pentry_header)) {
-      break;
-    }
-   
     pentryLen = ntohl(pentry.length);
-    if((unsigned int) pentryLen > sizeof(buf)) {
+    if ((unsigned int) pentryLen > pl.trace_len - pos)
+      break;
+    if (pentryLen > HTTP_MSG_BUF_SIZE) {
 #ifdef DEBUG
-      // fprintf(stderr, "pentry too big %d %d\n", pentry.length, ntohl(pentry.length));
       fprintf(stderr, "pentry too big %d\n", pentryLen);
 #endif
       // skip to the next pentry
-      if (fseek(f, pentryLen, SEEK_CUR)) {
-        fprintf(stderr, "skipping to next pentry fails\n");
-      }
       continue;
-      // exit(0);
     }
 
     pentry.length = pentryLen;
     pentry.ptype = ntohs(pentry.ptype);
+    pl.payload_hdrs.push_back(pentry);
+    offsets.push_back(pos);
+  }
 
-    if (fread(buf, 1, pentry.length, f) < (unsigned int) pentry.length)
-      break;
+  buf2 = (char *)xmalloc(HTTP_MSG_BUF_SIZE);
+  pl.payload_bufs.resize(pl.payload_hdrs.size());
+  for (size_t i = 0; i < pl.payload_hdrs.size(); i++) {
+    pentry_header& p = pl.payload_hdrs[i];
+    char* msg = pl.trace + offsets[i];
+
+    msg[p.length] = 0;
 
-    // todo:
     // fixed content length for gzip'd HTTP msg
     // fixContentLen returns -1, if no change to the msg
     // otherwise, it put the new HTTP msg (with hdr changed) in buf2
     // and returns the size of the new msg
-
     r = -1;
-    if (pentry.ptype == TYPE_HTTP_RESPONSE) {
-      r = fixContentLen (buf, pentry.length, buf2, HTTP_MSG_BUF_SIZE);
-      // log_debug("for payload_count %d, fixContentLen returns %d", payload_count, r);
+    if (p.ptype == TYPE_HTTP_RESPONSE)
+      r = fixContentLen (msg, p.length, buf2, HTTP_MSG_BUF_SIZE);
+
+    if (r >= 0) {
+      p.length = r;
+      msg = (char *)xmalloc(r + 1);
+      memcpy(msg, buf2, r);
+      msg[r] = 0;
+      pl.rewritten.push_back(msg);
     }
-    // else {
-    // log_debug("for payload_count %d, pentry.ptype = %d", payload_count, pentry.ptype);
-    // }
-
-    if (r < 0) {
-      pl.payloads[pl.payload_count] = (char *)xmalloc(pentry.length + 1);
-      memcpy(pl.payloads[pl.payload_count], buf, pentry.length);
-    } else {
-      pentry.length = r;
-      pl.payloads[pl.payload_count] = (char *)xmalloc(pentry.length + 1);
-      memcpy(pl.payloads[pl.payload_count], buf2, pentry.length);
+    pl.payload_bufs[i] = msg;
+  }
+  free(buf2);
+
+  pl.payload_count = pl.payload_hdrs.size();
+  log_debug("loaded %d payloads from %s (%lu rewritten)\n", pl.payload_count,
+            fname, (unsigned long)pl.rewritten.size());
+  return true;
+}
+
+
+// Work out which pool, if any, each message can go in, and how much it
+// can carry.  This is the expensive part of server startup: every
+// candidate is searched for its content type, and then scanned from
+// end to end for capacity.
+void scan_payloads(payloads& pl)
+{
+  pl.info.resize(pl.payload_hdrs.size());
+  for (size_t i = 0; i < pl.payload_hdrs.size(); i++) {
+    const pentry_header& p = pl.payload_hdrs[i];
+    payload_info& pi = pl.info[i];
+    char* msg = pl.payload_bufs[i];
+    char* hend;
+
+    memset(&pi, 0, sizeof pi);
+    if (p.ptype != TYPE_HTTP_RESPONSE)
+      continue;
+    hend = strstr(msg, "\r\n\r\n");
+    if (hend == NULL)
+      continue;
+    pi.body_offset = hend + 4 - msg;
+
+    // the JavaScript and HTML checks are the same; only the mode differs
+    pi.mode = has_eligible_HTTP_content(msg, p.length, HTTP_CONTENT_JAVASCRIPT);
+    if (pi.mode == CONTENT_JAVASCRIPT || pi.mode == CONTENT_HTML_JAVASCRIPT) {
+      pi.content_type = pi.mode == CONTENT_JAVASCRIPT
+        ? HTTP_CONTENT_JAVASCRIPT : HTTP_CONTENT_HTML;
+      pi.capacity = capacityJS3(msg, p.length, pi.mode);
+    } else if ((pi.mode = has_eligible_HTTP_content(msg, p.length,
+                                                    HTTP_CONTENT_PDF)) > 0) {
+      pi.content_type = HTTP_CONTENT_PDF;
+      pi.capacity = capacityPDF(msg, p.length);
+    } else if ((pi.mode = has_eligible_HTTP_content(msg, p.length,
+                                                    HTTP_CONTENT_SWF)) > 0) {
+      pi.content_type = HTTP_CONTENT_SWF;
     }
-    pl.payload_hdrs[pl.payload_count] = pentry;
-    pl.payloads[pl.payload_count][pentry.length] = 0;
-    pl.payload_count++;
-  } // while
+  }
+}
+
+/* The index for trace FNAME lives in FNAME.idx.  It holds this header
+   followed by one payload_info for each message load_payloads() keeps,
+   in the same order, all in host byte order: an index is only meant to
+   be used on the machine that built it.  It is stale if the trace has
+   changed size, inode or modification time (to the nanosecond, where
+   the system records it) since, or if it was built with a different
+   HTTP_MSG_BUF_SIZE (which changes the set of messages).  The inode
+   catches a same-size trace renamed into place within the second. */
+
+#define PAYLOAD_INDEX_MAGIC "STIDX02\n"
+
+struct payload_index_header {
+  char magic[8];
+  uint64_t trace_len;
+  int64_t trace_mtime;
+  uint64_t trace_ino;
+  uint32_t trace_mtime_nsec;
+  uint32_t msg_buf_size;
+  uint32_t record_size;
+  uint32_t count;
+};
+
+static std::string
+payload_index_name(const char* fname)
+{
+  return std::string(fname) + ".idx";
+}
 
+// The header an index for the trace loaded into PL should have.
+static void
+fill_index_header(payload_index_header& h, const payloads& pl)
+{
+  const struct stat& st = pl.trace_stat;
+
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, PAYLOAD_INDEX_MAGIC, sizeof h.magic);
+  h.trace_len = st.st_size;
+  h.trace_mtime = st.st_mtime;
+  h.trace_ino = st.st_ino;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  h.trace_mtime_nsec = st.st_mtim.tv_nsec;
+#endif
+  h.msg_buf_size = HTTP_MSG_BUF_SIZE;
+  h.record_size = sizeof(payload_info);
+  h.count = pl.payload_hdrs.size();
+}
 
-  log_debug("loaded %d payloads from %s\n", pl.payload_count, fname);
+// Fill in pl.info from the index for FNAME, which must already have
+// been loaded into PL.  Returns false, leaving pl.info empty, if there
+// is no index or it does not match the trace.
+bool read_payload_index(payloads& pl, const char* fname)
+{
+  std::string iname = payload_index_name(fname);
+  payload_index_header want, got;
+  FILE* f;
+  bool ok;
+
+  pl.info.clear();
+  fill_index_header(want, pl);
+  f = fopen(iname.c_str(), "rb");
+  if (f == NULL) {
+    log_info("no payload index %s; scanning %s", iname.c_str(), fname);
+    return false;
+  }
 
+  ok = fread(&got, sizeof got, 1, f) == 1 && !memcmp(&got, &want, sizeof got);
+  if (ok) {
+    pl.info.resize(want.count);
+    ok = want.count == 0
+      || fread(&pl.info[0], sizeof(payload_info), want.count, f) == want.count;
+  }
   fclose(f);
+
+  // Cheap sanity check that the records still describe these messages.
+  for (size_t i = 0; ok && i < pl.info.size(); i++) {
+    const payload_info& pi = pl.info[i];
+    ok = pi.body_offset >= 0 && pi.body_offset <= pl.payload_hdrs[i].length
+      && (pi.body_offset == 0 ||
+          (pi.body_offset >= 4 &&
+           !memcmp(pl.payload_bufs[i] + pi.body_offset - 4, "\r\n\r\n", 4)));
+  }
+
+  if (!ok) {
+    log_warn("payload index %s is stale or damaged; scanning %s",
+             iname.c_str(), fname);
+    pl.info.clear();
+    return false;
+  }
+  log_debug("read payload index %s (%lu entries)", iname.c_str(),
+            (unsigned long)pl.info.size());
+  return true;
+}
+
+// Write out the index for FNAME from pl.info, replacing any old one
+// atomically.  Returns 0 on success, -1 on failure.
+int write_payload_index(const payloads& pl, const char* fname)
+{
+  std::string iname = payload_index_name(fname);
+  std::string tmpname = iname + ".tmp";
+  payload_index_header h;
+  FILE* f;
+  bool ok;
+
+  log_assert(pl.info.size() == pl.payload_hdrs.size());
+  fill_index_header(h, pl);
+
+  f = fopen(tmpname.c_str(), "wb");
+  if (f == NULL) {
+    log_warn("%s: %s", tmpname.c_str(), strerror(errno));
+    return -1;
+  }
+  ok = fwrite(&h, sizeof h, 1, f) == 1
+    && (h.count == 0 ||
+        fwrite(&pl.info[0], sizeof(payload_info), h.count, f) == h.count);
+  ok = !fclose(f) && ok;
+  if (!ok || rename(tmpname.c_str(), iname.c_str())) {
+    log_warn("%s: %s", iname.c_str(), strerror(errno));
+    remove(tmpname.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+// Classify the messages loaded from FNAME, from its index if there is
+// a current one.
+void index_payloads(payloads& pl, const char* fname)
+{
+  if (!read_payload_index(pl, fname))
+    scan_payloads(pl);
+}
+
+struct payload_trace
+{
+  std::string fname;
+  bool server;
+  unsigned int users;   // steg configs holding it open
+  payloads* current;
+};
+
+namespace {
+  typedef std::pair<std::string, bool> payload_store_key;
+
+  struct payload_store_t
+  {
+    std::map<payload_store_key, payload_trace*> traces;
+    std::map<const payloads*, unsigned int> refs;
+    crypt_lane reload_lane;
+
+    payload_store_t() : reload_lane(true) {}
+  };
+
+  // Builds a new generation of one trace on the crypto pool's
+  // background thread, and then swaps it in on the event loop thread.
+  // (Without a pool, as in the unit tests, it all happens at once.)
+  struct payload_reload_job : crypt_job
+  {
+    payload_store_key key;
+    payloads* pl;
+    bool ok;
+
+    payload_reload_job(const payload_store_key& k)
+      : key(k), pl(new payloads), ok(false) {}
+    virtual ~payload_reload_job() { delete pl; }
+
+    virtual void run();
+    virtual void finish();
+  };
+}
+
+static payload_store_t payload_store;
+
+// Everything the steg modules need from trace FNAME, apart from the
+// server-side pools if SERVER is false.  Safe to call on any thread.
+static bool
+build_payloads(payloads& pl, const char* fname, bool server)
+{
+  if (!load_payloads(pl, fname))
+    return false;
+  if (server) {
+    index_payloads(pl, fname);
+    init_JS_payload_pool(pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE, JS_MIN_AVAIL_SIZE);
+    init_HTML_payload_pool(pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE, HTML_MIN_AVAIL_SIZE);
+    init_PDF_payload_pool(pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE, PDF_MIN_AVAIL_SIZE);
+    init_SWF_payload_pool(pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE, 0);
+  }
+  return true;
+}
+
+payload_trace*
+payload_store_open(const char* fname, bool server)
+{
+  payload_trace*& t = payload_store.traces[payload_store_key(fname, server)];
+  if (!t) {
+    t = new payload_trace;
+    t->fname = fname;
+    t->server = server;
+    t->users = 0;
+    t->current = new payloads;
+    if (!build_payloads(*t->current, fname, server))
+      log_abort("failed to load trace %s", fname);
+    payload_store.refs[t->current] = 1;
+  }
+  t->users++;
+  return t;
+}
+
+void
+payload_store_close(payload_trace* t)
+{
+  log_assert(t->users > 0);
+  if (--t->users > 0)
+    return;
+
+  payload_store.traces.erase(payload_store_key(t->fname, t->server));
+  payload_store_release(t->current);
+  delete t;
+
+  // nobody is left to want a reload that has not finished yet
+  if (payload_store.traces.empty())
+    payload_store.reload_lane.cancel();
+}
+
+const payloads*
+payload_store_acquire(payload_trace* t)
+{
+  payload_store.refs[t->current]++;
+  return t->current;
+}
+
+void
+payload_store_release(const payloads* pl)
+{
+  std::map<const payloads*, unsigned int>::iterator r =
+    payload_store.refs.find(pl);
+  log_assert(r != payload_store.refs.end() && r->second > 0);
+  if (--r->second > 0)
+    return;
+
+  payload_store.refs.erase(r);
+  delete pl;
+}
+
+void
+payload_reload_job::run()
+{
+  ok = build_payloads(*pl, key.first.c_str(), key.second);
+}
+
+void
+payload_reload_job::finish()
+{
+  std::map<payload_store_key, payload_trace*>::iterator i =
+    payload_store.traces.find(key);
+
+  if (!ok) {
+    log_warn("failed to reload %s; carrying on with the old one",
+             key.first.c_str());
+    return;
+  }
+  if (i == payload_store.traces.end())
+    return;
+
+  payload_trace* t = i->second;
+  payload_store_release(t->current);
+  t->current = pl;
+  payload_store.refs[pl] = 1;
+  pl = 0;
+  log_info("reloaded %s (%d messages)", key.first.c_str(),
+           t->current->payload_count);
+}
+
+void
+payload_store_reload(void)
+{
+  for (std::map<payload_store_key, payload_trace*>::iterator i =
+         payload_store.traces.begin();
+       i != payload_store.traces.end(); ++i) {
+    payload_reload_job* job = new payload_reload_job(i->first);
+    if (crypt_pool_running())
+      payload_store.reload_lane.submit(job);
+    else {
+      job->run();
+      job->finish();
+      delete job;
+    }
+  }
 }
 
 
@@ -268,7 +638,7 @@ void gen_rfc_1123_date(char* buf, int buf_size) {
 
 
 void gen_rfc_1123_expiry_date(char* buf, int buf_size) {
-  time_t t = time(NULL) + rand() % 10000;
+  time_t t = time(NULL) + fast_rng_int(10000);
   struct tm *my_tm = gmtime(&t);
   strftime(buf, buf_size, "Expires: %a, %d %b %Y %H:%M:%S GMT\r\n", my_tm);
 }
@@ -277,7 +647,8 @@ void gen_rfc_1123_expiry_date(char* buf, int buf_size) {
 
 
 
-int gen_response_header(char* content_type, int gzip, int length, char* buf, int buflen) {
+int gen_response_header(char* content_type, int gzip, int length, char* buf, int buflen,
+                        bool keep_alive) {
   char* ptr;
 
   // conservative assumption here.... 
@@ -294,7 +665,7 @@ int gen_response_header(char* content_type, int gzip, int length, char* buf, int
   sprintf(ptr, "Server: Apache\r\n");
   ptr = ptr + strlen(ptr);
 
-  switch(rand() % 9) {
+  switch(fast_rng_int(9)) {
   case 1:
     sprintf(ptr, "Vary: Cookie\r\n");
     ptr = ptr + strlen(ptr);
@@ -313,7 +684,7 @@ int gen_response_header(char* content_type, int gzip, int length, char* buf, int
   }
 
 
-  switch(rand() % 4) {
+  switch(fast_rng_int(4)) {
   case 2:
     gen_rfc_1123_expiry_date(ptr, buflen - (ptr - buf));
     ptr = ptr + strlen(ptr);
@@ -329,16 +700,11 @@ int gen_response_header(char* content_type, int gzip, int length, char* buf, int
     
   ptr += strlen(ptr);
 
-  switch(rand() % 4) {
-  case 2:
-  case 3:
-  case 4:
+  // Say what the connection will actually do next.
+  if (keep_alive)
     sprintf(ptr, "Connection: Keep-Alive\r\n\r\n");
-    break;
-  default:
+  else
     sprintf(ptr, "Connection: close\r\n\r\n");
-    break;    
-  }
 
   ptr += strlen(ptr);
 
@@ -527,16 +893,16 @@ find_uri_type(char* buf) {
 
 
 
-unsigned int find_client_payload(payloads& pl, char* buf, int len, int type) {
-  int r = rand() % pl.payload_count;
+unsigned int find_client_payload(const payloads& pl, char* buf, int len, int type) {
+  int r = fast_rng_int(pl.payload_count);
   int cnt = 0;
   char* inbuf;
 
   log_debug("trying payload %d", r);
   while (1) {
-    pentry_header* p = &pl.payload_hdrs[r];
+    const pentry_header* p = &pl.payload_hdrs[r];
     if (p->ptype == type) {
-      inbuf = pl.payloads[r];
+      inbuf = pl.payload_bufs[r];
       if (find_uri_type(inbuf, p->length) != HTTP_CONTENT_SWF &&
           find_uri_type(inbuf, p->length) != HTTP_CONTENT_HTML &&
 	  find_uri_type(inbuf, p->length) != HTTP_CONTENT_JAVASCRIPT &&
@@ -1073,20 +1439,70 @@ unsigned int capacityPDF (char* buf, int len) {
 
 
 
+namespace {
+  // Orders positions in one content type's pool by capacity, then
+  // by length.
+  struct by_capacity
+  {
+    const payloads& pl;
+    int contentType;
+
+    by_capacity(const payloads& p, int t) : pl(p), contentType(t) {}
+
+    int len(size_t i) const
+    {
+      return pl.payload_hdrs[pl.typePayload[contentType][i]].length;
+    }
+
+    bool operator()(size_t a, size_t b) const
+    {
+      int ca = pl.typePayloadCap[contentType][a];
+      int cb = pl.typePayloadCap[contentType][b];
+      return ca < cb || (ca == cb && len(a) < len(b));
+    }
+  };
+}
+
+// Rebuild pl.fit[contentType] from the pool's typePayload and
+// typePayloadCap entries.
+static void
+build_fit_index(payloads& pl, int contentType)
+{
+  payload_fit_index& fit = pl.fit[contentType];
+  size_t n = pl.typePayload[contentType].size();
+  std::vector<size_t> order(n);
+
+  for (size_t i = 0; i < n; i++)
+    order[i] = i;
+  by_capacity cmp(pl, contentType);
+  std::sort(order.begin(), order.end(), cmp);
+
+  fit.cap.resize(n);
+  fit.len.resize(n);
+  fit.buf.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    fit.cap[i] = pl.typePayloadCap[contentType][order[i]];
+    fit.len[i] = cmp.len(order[i]);
+    fit.buf[i] = pl.payload_bufs[pl.typePayload[contentType][order[i]]];
+  }
+}
+
 /*
  * init_payload_pool initializes the arrays pertaining to 
  * message payloads for the specified content type
  *
- * Specifically, it populates the following arrays
- * static int initTypePayload[MAX_CONTENT_TYPE];
- * static int typePayloadCount[MAX_CONTENT_TYPE];
- * static int typePayload[MAX_CONTENT_TYPE][MAX_PAYLOADS];
- * static int typePayloadCap[MAX_CONTENT_TYPE][MAX_PAYLOADS];
+ * Specifically, it populates the following members of 'pl'
+ * int initTypePayload[MAX_CONTENT_TYPE];
+ * std::vector<int> typePayload[MAX_CONTENT_TYPE];
+ * std::vector<int> typePayloadCap[MAX_CONTENT_TYPE];
  *
  * Input:
  * len - max length of payload
  * type - ptype field value in pentry_header
  * contentType - (e.g, HTTP_CONTENT_JAVASCRIPT for JavaScript content)
+ *
+ * The eligibility and capacity of each message come from pl.info,
+ * which index_payloads() fills in; if nobody has, it is scanned here.
  */
 
 
@@ -1104,14 +1520,14 @@ int init_JS_payload_pool(payloads& pl, int len, int type, int minCapacity) {
   int cnt = 0;
   int r;
   pentry_header* p;
-  char* msgbuf;
   int cap;
-  int mode;
 
   if (pl.payload_count == 0) {
     log_debug("payload_count == 0; forgot to run load_payloads()?\n");
     return 0;
   }
+  if (pl.info.size() != pl.payload_hdrs.size())
+    scan_payloads(pl);
 
   for (r = 0; r < pl.payload_count; r++) {
     p = &pl.payload_hdrs[r];
@@ -1119,22 +1535,19 @@ int init_JS_payload_pool(payloads& pl, int len, int type, int minCapacity) {
       continue;
     }
 
-    msgbuf = pl.payloads[r];
+    if (pl.info[r].content_type == HTTP_CONTENT_JAVASCRIPT) {
 
-    mode = has_eligible_HTTP_content(msgbuf, p->length, HTTP_CONTENT_JAVASCRIPT);
-    if (mode == CONTENT_JAVASCRIPT) {
-
-      cap = capacityJS3(msgbuf, p->length, mode);
+      cap = pl.info[r].capacity;
       if (cap <  JS_DELIMITER_SIZE)
 	continue;
 
       cap = (cap - JS_DELIMITER_SIZE)/2;
 
       if (cap > minCapacity) {
-	pl.typePayloadCap[contentType][cnt] = cap; // (cap-JS_DELIMITER_SIZE)/2;
+	pl.typePayloadCap[contentType].push_back(cap); // (cap-JS_DELIMITER_SIZE)/2;
 	// because we use 2 hex char to encode every data byte, the available
 	// capacity for encoding data is divided by 2
-	pl.typePayload[contentType][cnt] = r;
+	pl.typePayload[contentType].push_back(r);
 	cnt++;
 
 	// update stat
@@ -1158,9 +1571,9 @@ int init_JS_payload_pool(payloads& pl, int len, int type, int minCapacity) {
 
   pl.max_JS_capacity = maxPayloadCap;
   pl.initTypePayload[contentType] = 1;
-  pl.typePayloadCount[contentType] = cnt;
-  log_debug("init_payload_pool: typePayloadCount for contentType %d = %d",
-     contentType, pl.typePayloadCount[contentType]); 
+  build_fit_index(pl, contentType);
+  log_debug("init_payload_pool: %d payloads for contentType %d",
+     cnt, contentType); 
   log_debug("minPayloadSize = %d", minPayloadSize); 
   log_debug("maxPayloadSize = %d", maxPayloadSize); 
   log_debug("avgPayloadSize = %f", (float)sumPayloadSize/(float)cnt); 
@@ -1184,9 +1597,7 @@ int  init_HTML_payload_pool(payloads& pl, int len, int type, int minCapacity) {
   int cnt = 0;
   int r;
   pentry_header* p;
-  char* msgbuf;
   int cap;
-  int mode;
 
 
 
@@ -1194,6 +1605,8 @@ int  init_HTML_payload_pool(payloads& pl, int len, int type, int minCapacity) {
     log_debug("payload_count == 0; forgot to run load_payloads()?\n");
     return 0;
   }
+  if (pl.info.size() != pl.payload_hdrs.size())
+    scan_payloads(pl);
 
   for (r = 0; r < pl.payload_count; r++) {
     p = &pl.payload_hdrs[r];
@@ -1201,22 +1614,19 @@ int  init_HTML_payload_pool(payloads& pl, int len, int type, int minCapacity) {
       continue;
     }
 
-    msgbuf = pl.payloads[r];
-
-    mode = has_eligible_HTTP_content(msgbuf, p->length, HTTP_CONTENT_HTML);
-    if (mode == CONTENT_HTML_JAVASCRIPT) {
+    if (pl.info[r].content_type == HTTP_CONTENT_HTML) {
       
-      cap = capacityJS3(msgbuf, p->length, mode);
+      cap = pl.info[r].capacity;
       if (cap <  JS_DELIMITER_SIZE) 
 	continue;
 
       cap = (cap - JS_DELIMITER_SIZE)/2;
 
       if (cap > minCapacity) {
-	pl.typePayloadCap[contentType][cnt] = cap; // (cap-JS_DELIMITER_SIZE)/2;
+	pl.typePayloadCap[contentType].push_back(cap); // (cap-JS_DELIMITER_SIZE)/2;
 	// because we use 2 hex char to encode every data byte, the available
 	// capacity for encoding data is divided by 2
-	pl.typePayload[contentType][cnt] = r;
+	pl.typePayload[contentType].push_back(r);
 	cnt++;
 	
 	// update stat
@@ -1240,9 +1650,9 @@ int  init_HTML_payload_pool(payloads& pl, int len, int type, int minCapacity) {
 
   pl.max_HTML_capacity = maxPayloadCap;
   pl.initTypePayload[contentType] = 1;
-  pl.typePayloadCount[contentType] = cnt;
-  log_debug("init_payload_pool: typePayloadCount for contentType %d = %d",
-     contentType, pl.typePayloadCount[contentType]); 
+  build_fit_index(pl, contentType);
+  log_debug("init_payload_pool: %d payloads for contentType %d",
+     cnt, contentType); 
   log_debug("minPayloadSize = %d", minPayloadSize); 
   log_debug("maxPayloadSize = %d", maxPayloadSize); 
   log_debug("avgPayloadSize = %f", (float)sumPayloadSize/(float)cnt); 
@@ -1265,9 +1675,7 @@ init_PDF_payload_pool(payloads& pl, int len, int type, int minCapacity)
   int cnt = 0;
   int r;
   pentry_header* p;
-  char* msgbuf;
   int cap;
-  int mode;
   unsigned int contentType = HTTP_CONTENT_PDF;
   
 
@@ -1275,6 +1683,8 @@ init_PDF_payload_pool(payloads& pl, int len, int type, int minCapacity)
      fprintf(stderr, "payload_count == 0; forgot to run load_payloads()?\n");
      return 0;
   }
+  if (pl.info.size() != pl.payload_hdrs.size())
+    scan_payloads(pl);
 
   for (r = 0; r < pl.payload_count; r++) {
     p = &pl.payload_hdrs[r];
@@ -1282,19 +1692,15 @@ init_PDF_payload_pool(payloads& pl, int len, int type, int minCapacity)
       continue;
     }
 
-    msgbuf = pl.payloads[r];
-
-    mode = has_eligible_HTTP_content(msgbuf, p->length, HTTP_CONTENT_PDF);
-    if (mode > 0) {
-      // use capacityPDF() to find out the amount of data that we
+    if (pl.info[r].content_type == HTTP_CONTENT_PDF) {
+      // capacityPDF() tells us the amount of data that we
       // can encode in the pdf doc 
-      // cap = minCapacity+1;
-      cap = capacityPDF(msgbuf, p->length);
+      cap = pl.info[r].capacity;
       log_debug("got pdf (index %d) with capacity %d", r, cap);
       if (cap > minCapacity) {
 	log_debug("pdf (index %d) greater than mincapacity %d", cnt, minCapacity);
-	pl.typePayloadCap[contentType][cnt] = (cap-PDF_DELIMITER_SIZE)/2;
-	pl.typePayload[contentType][cnt] = r;
+	pl.typePayloadCap[contentType].push_back((cap-PDF_DELIMITER_SIZE)/2);
+	pl.typePayload[contentType].push_back(r);
 	cnt++;
 	
 	// update stat
@@ -1315,9 +1721,9 @@ init_PDF_payload_pool(payloads& pl, int len, int type, int minCapacity)
 
   pl.max_PDF_capacity = maxPayloadCap;
   pl.initTypePayload[contentType] = 1;
-  pl.typePayloadCount[contentType] = cnt;
-  log_debug("init_payload_pool: typePayloadCount for contentType %d = %d",
-     contentType, pl.typePayloadCount[contentType]); 
+  build_fit_index(pl, contentType);
+  log_debug("init_payload_pool: %d payloads for contentType %d",
+     cnt, contentType); 
   log_debug("minPayloadSize = %d", minPayloadSize); 
   log_debug("maxPayloadSize = %d", maxPayloadSize); 
   log_debug("avgPayloadSize = %f", (float)sumPayloadSize/(float)cnt); 
@@ -1337,8 +1743,6 @@ init_SWF_payload_pool(payloads& pl, int len, int type, int /*unused */)
   int cnt = 0;
   int r;
   pentry_header* p;
-  char* msgbuf;
-  int mode;
   unsigned int contentType = HTTP_CONTENT_SWF;
 
 
@@ -1346,6 +1750,8 @@ init_SWF_payload_pool(payloads& pl, int len, int type, int /*unused */)
      fprintf(stderr, "payload_count == 0; forgot to run load_payloads()?\n");
      return 0;
   }
+  if (pl.info.size() != pl.payload_hdrs.size())
+    scan_payloads(pl);
 
   for (r = 0; r < pl.payload_count; r++) {
     p = &pl.payload_hdrs[r];
@@ -1353,12 +1759,10 @@ init_SWF_payload_pool(payloads& pl, int len, int type, int /*unused */)
       continue;
     }
 
-    msgbuf = pl.payloads[r];
-    // found a payload corr to the specified contentType
-
-    mode = has_eligible_HTTP_content(msgbuf, p->length, HTTP_CONTENT_SWF);
-    if (mode > 0) {
-      pl.typePayload[contentType][cnt] = r;
+    if (pl.info[r].content_type == HTTP_CONTENT_SWF) {
+      // SWF templates have no fixed capacity; swf_wrap asks for any
+      pl.typePayload[contentType].push_back(r);
+      pl.typePayloadCap[contentType].push_back(0);
       cnt++;
       // update stat
       if (cnt == 1) {
@@ -1376,9 +1780,9 @@ init_SWF_payload_pool(payloads& pl, int len, int type, int /*unused */)
   }
     
   pl.initTypePayload[contentType] = 1;
-  pl.typePayloadCount[contentType] = cnt;
-  log_debug("init_payload_pool: typePayloadCount for contentType %d = %d",
-     contentType, pl.typePayloadCount[contentType]); 
+  build_fit_index(pl, contentType);
+  log_debug("init_payload_pool: %d payloads for contentType %d",
+     cnt, contentType); 
   log_debug("minPayloadSize = %d", minPayloadSize); 
   log_debug("maxPayloadSize = %d", maxPayloadSize); 
   log_debug("avgPayloadSize = %f", (float)sumPayloadSize/(float)cnt); 
@@ -1393,27 +1797,26 @@ init_SWF_payload_pool(payloads& pl, int len, int type, int /*unused */)
 
 
 
-int get_next_payload (payloads& pl, int contentType, char** buf,
+int get_next_payload (const payloads& pl, int contentType, char** buf,
                       int* size, int* cap)
 {
   int r;
 
-  log_debug("get_next_payload: contentType = %d, initTypePayload = %d, typePayloadCount = %d",
-      contentType, pl.initTypePayload[contentType], pl.typePayloadCount[contentType]);
-
-
   if (contentType <= 0 ||
       contentType >= MAX_CONTENT_TYPE ||
       pl.initTypePayload[contentType] == 0 ||
-      pl.typePayloadCount[contentType] == 0)
+      pl.typePayload[contentType].empty())
     return 0;
 
-  r = rand() % pl.typePayloadCount[contentType];
+  log_debug("get_next_payload: contentType = %d, %lu payloads",
+      contentType, (unsigned long)pl.typePayload[contentType].size());
+
+  r = fast_rng_int(pl.typePayload[contentType].size());
 //  int r = 1;
 //  log_debug("SERVER: *** always choose the same payload ***");
 
   log_debug("SERVER: picked payload with index %d", r);
-  *buf = pl.payloads[pl.typePayload[contentType][r]];
+  *buf = pl.payload_bufs[pl.typePayload[contentType][r]];
   *size = pl.payload_hdrs[pl.typePayload[contentType][r]].length;
   *cap = pl.typePayloadCap[contentType][r];
   return 1;
@@ -1426,58 +1829,37 @@ int get_next_payload (payloads& pl, int contentType, char** buf,
 
 
 
-int get_payload (payloads& pl, int contentType, int cap, char** buf, int* size) {
-  int r, i, cnt, found = 0, numCandidate = 0, first, best, current;
-
-  log_debug("contentType = %d, initTypePayload = %d, typePayloadCount = %d",
-            contentType, pl.initTypePayload[contentType],
-            pl.typePayloadCount[contentType]);
+// Choose a payload of type CONTENTTYPE that can carry CAP bytes: at
+// random from the MAX_CANDIDATE_PAYLOADS smallest that can, together
+// with any others the same size as the largest of those.
+int get_payload (const payloads& pl, int contentType, int cap, char** buf, int* size) {
+  size_t lo, hi, n, r;
 
   if (contentType <= 0 ||
       contentType >= MAX_CONTENT_TYPE ||
       pl.initTypePayload[contentType] == 0 ||
-      pl.typePayloadCount[contentType] == 0)
+      pl.typePayload[contentType].empty())
     return 0;
 
-
-  cnt = pl.typePayloadCount[contentType];
-  r = rand() % cnt;
-  best = r;
-  first = r;
-
-  i = -1;
-  // we look at MAX_CANDIDATE_PAYLOADS payloads that have enough capacity
-  // and select the best fit
-  while (i < (cnt-1) && numCandidate < MAX_CANDIDATE_PAYLOADS) {
-    i++;
-    current = (r+i)%cnt;
-
-    if (pl.typePayloadCap[contentType][current] <= cap)
-      continue;
-
-    if (found) {
-      if (pl.payload_hdrs[pl.typePayload[contentType][best]].length >
-          pl.payload_hdrs[pl.typePayload[contentType][current]].length)
-        best = current;
-    } else {
-      first = current;
-      best = current;
-      found = 1;
-    }
-    numCandidate++;
-  }
-
-  if (found) {
-    log_debug("first payload size=%d, best payload size=%d, num candidate=%d\n",
-      pl.payload_hdrs[pl.typePayload[contentType][first]].length,
-      pl.payload_hdrs[pl.typePayload[contentType][best]].length,
-      numCandidate);
-    *buf = pl.payloads[pl.typePayload[contentType][best]];
-    *size = pl.payload_hdrs[pl.typePayload[contentType][best]].length;
-    return 1;
-  } else {
+  const payload_fit_index& fit = pl.fit[contentType];
+  n = fit.cap.size();
+  lo = std::lower_bound(fit.cap.begin(), fit.cap.end(), cap) - fit.cap.begin();
+  if (lo == n) {
+    log_debug("contentType = %d, none of %lu payloads can carry %d bytes",
+              contentType, (unsigned long)n, cap);
     return 0;
   }
+  hi = std::min(n, lo + MAX_CANDIDATE_PAYLOADS);
+  hi = std::upper_bound(fit.cap.begin() + hi - 1, fit.cap.end(),
+                        fit.cap[hi - 1]) - fit.cap.begin();
+
+  r = lo + fast_rng_int(hi - lo);
+  log_debug("contentType = %d, cap = %d: picked payload size=%d, cap=%d "
+            "from %lu candidates", contentType, cap, fit.len[r], fit.cap[r],
+            (unsigned long)(hi - lo));
+  *buf = fit.buf[r];
+  *size = fit.len[r];
+  return 1;
 }
 
 
@@ -6,8 +6,11 @@
 #include <time.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <vector>
 
 
 /* three files:
@@ -25,11 +28,10 @@
 
 #define NO_NEXT_STATE -1
 
-#define MAX_PAYLOADS 10000
 #define MAX_RESP_HDR_SIZE 512
 
-// max number of payloads that have enough capacity from which
-// we choose the best fit 
+// get_payload chooses at random among this many of the smallest
+// payloads that have enough capacity
 #define MAX_CANDIDATE_PAYLOADS 10
 
 // jsSteg-specific defines
@@ -75,14 +77,12 @@
 // MAX_CONTENT_TYPE specifies the maximum number of supported content types
 // (e.g. HTTP_CONTENT_JAVASCRIPT is a content type)
 //
-// initTypePayload[x] specifies whether the arrays typePayloadCount and
-// typePayloads for content type x
-//
-// typePayloadCount[x] specifies the number of available payloads for
-// content type x
+// initTypePayload[x] specifies whether typePayload[x] and
+// typePayloadCap[x] have been initialized for content type x
 //
 // typePayload[x][] contains references to the corresponding entries in
-// payload_hdrs[] and payloads[]
+// payload_hdrs[] and payload_bufs[]; its size is the number of
+// available payloads for content type x
 //
 // typePayloadCap[x][] specifies the capacity for typePayload[x][]
 
@@ -120,26 +120,83 @@ typedef struct service_state {
   int dir;
 }state;
 
+// What the pool initializers need to know about one message.  Working
+// it out means scanning the whole message, so the payload-index tool
+// can do it ahead of time; see index_payloads().
+struct payload_info {
+  int32_t content_type; // HTTP_CONTENT_* the msg is eligible for, or 0
+  int32_t mode;         // has_eligible_HTTP_content() for that type
+  int32_t capacity;     // raw capacityJS3()/capacityPDF(); 0 for SWF
+  int32_t body_offset;  // start of the HTTP body; 0 if there is none
+};
+
+// The pool for one content type again, sorted by capacity (and then
+// by length), for get_payload's best-fit search.  The three arrays
+// are parallel; cap[] is what gets searched, so it is kept on its own.
+struct payload_fit_index {
+  std::vector<int> cap;
+  std::vector<int> len;
+  std::vector<char*> buf;
+};
+
 struct payloads {
   int initTypePayload[MAX_CONTENT_TYPE];
-  int typePayloadCount[MAX_CONTENT_TYPE];
-  int typePayload[MAX_CONTENT_TYPE][MAX_PAYLOADS];
-  int typePayloadCap[MAX_CONTENT_TYPE][MAX_PAYLOADS];
+  std::vector<int> typePayload[MAX_CONTENT_TYPE];
+  std::vector<int> typePayloadCap[MAX_CONTENT_TYPE];
+  payload_fit_index fit[MAX_CONTENT_TYPE];
 
   unsigned int max_JS_capacity;
   unsigned int max_HTML_capacity;
   unsigned int max_PDF_capacity;
 
-  pentry_header payload_hdrs[MAX_PAYLOADS];
-  char* payloads[MAX_PAYLOADS];
+  // One entry for each message in the trace.  payload_bufs[i] points
+  // into the trace itself, or, for a response whose header had to be
+  // rewritten, into a copy in rewritten[]; either way it is followed
+  // by a NUL.
+  std::vector<pentry_header> payload_hdrs;
+  std::vector<char*> payload_bufs;
+  std::vector<payload_info> info;
   int payload_count;
+
+  // The whole trace file, read into one block, and what fstat() said
+  // about it at the time (for judging whether its index is current).
+  char* trace;
+  size_t trace_len;
+  struct stat trace_stat;
+  std::vector<char*> rewritten;
+
+  payloads();
+  ~payloads();
+
+private:
+  payloads(const payloads&);
+  payloads& operator=(const payloads&);
 };
 
 
 #define HTTP_MSG_BUF_SIZE 100000
 
-void load_payloads(payloads& pl, const char* fname);
-unsigned int find_client_payload(payloads& pl, char* buf, int len, int type);
+bool load_payloads(payloads& pl, const char* fname);
+void scan_payloads(payloads& pl);
+bool read_payload_index(payloads& pl, const char* fname);
+int write_payload_index(const payloads& pl, const char* fname);
+void index_payloads(payloads& pl, const char* fname);
+
+// Process-wide store of loaded traces.  Every steg config that opens
+// the same trace file (with or without the server-side pools) shares
+// one copy of it.  Each connection takes a reference to the payloads
+// that are current when it starts, and keeps using them until it
+// releases them, even if payload_store_reload() has swapped in a new
+// generation since.  Payloads are read-only once loaded.  Only for
+// use from the event-loop thread.
+struct payload_trace;
+
+payload_trace* payload_store_open(const char* fname, bool server);
+void payload_store_close(payload_trace* t);
+const payloads* payload_store_acquire(payload_trace* t);
+void payload_store_release(const payloads* pl);
+void payload_store_reload(void);
+unsigned int find_client_payload(const payloads& pl, char* buf, int len, int type);
 unsigned int find_server_payload(payloads& pl, char** buf, int len, int type, int contentType);
 
 int init_JS_payload_pool(payloads& pl, int len, int type, int minCapacity);
@@ -148,8 +205,8 @@ int init_PDF_payload_pool(payloads& pl, int len, int type,int minCapacity);
 int init_HTML_payload_pool(payloads& pl, int len, int type, int minCapacity);
 
 
-int get_next_payload (payloads& pl, int contentType, char** buf, int* size, int* cap);
-int get_payload (payloads& pl, int contentType, int cap, char** buf, int* size);
+int get_next_payload (const payloads& pl, int contentType, char** buf, int* size, int* cap);
+int get_payload (const payloads& pl, int contentType, int cap, char** buf, int* size);
 
 int has_eligible_HTTP_content (char* buf, int len, int type);
 int fixContentLen (char* payload, int payloadLen, char *buf, int bufLen);
@@ -172,6 +229,7 @@ unsigned int get_max_PDF_capacity(void);
 int find_content_length (char *hdr, int hlen);
 int find_uri_type(char* buf, int size);
 
-int gen_response_header(char* content_type, int gzip, int length, char* buf, int buflen);
+int gen_response_header(char* content_type, int gzip, int length, char* buf, int buflen,
+                        bool keep_alive);
 
 #endif
@@ -1,5 +1,6 @@
 #include "payloads.h"
 #include "pdfSteg.h"
+#include "rng.h"
 
 void buf_dump(unsigned char* buf, int len, FILE *out);
 
@@ -64,7 +65,7 @@ addDelimiter(char *inbuf, int inbuflen, char *outbuf, int outbuflen,
   // as the end-of-data pattern at the end of outbuf
   outbuf[cnt++] = delimiter1;
   // try to get a random char (that is not delimiter1)
-  rc = (char) (rand() % 256);
+  rc = (char) fast_rng_int(256);
   if (rc != delimiter1) {
     outbuf[cnt++] = rc;
   } else { // unable to get a rand char != delimiter1, use delimiter2
@@ -297,8 +298,8 @@ pdfUnwrap (char *data, unsigned int dlen,
 
 
 int
-http_server_PDF_transmit (payloads& pl, struct evbuffer *source,
-                          conn_t *conn)
+http_server_PDF_transmit (const payloads& pl, struct evbuffer *source,
+                          conn_t *conn, bool keep_alive)
 {
 
   struct evbuffer *dest = conn->outbound();
@@ -403,7 +404,8 @@ http_server_PDF_transmit (payloads& pl, struct evbuffer *source,
   // }
 
 
-  newHdrLen = gen_response_header((char*) "application/pdf", 0, outbuflen, newHdr, sizeof(newHdr));
+  newHdrLen = gen_response_header((char*) "application/pdf", 0, outbuflen, newHdr, sizeof(newHdr),
+                                  keep_alive);
   if (newHdrLen < 0) {
     log_warn("SERVER ERROR: gen_response_header fails for pdfSteg");
     return -1;
@@ -425,7 +427,6 @@ http_server_PDF_transmit (payloads& pl, struct evbuffer *source,
 
   evbuffer_drain(source, sbuflen);
 
-  conn->cease_transmission();
   //  downcast_steg(s)->have_transmitted = 1;
   return 0;
 }
@@ -433,7 +434,7 @@ http_server_PDF_transmit (payloads& pl, struct evbuffer *source,
 
 
 int
-http_handle_client_PDF_receive(steg_t *, conn_t *conn, struct evbuffer *dest, struct evbuffer* source) {
+http_handle_client_PDF_receive(steg_t *, conn_t *, struct evbuffer *dest, struct evbuffer* source) {
   struct evbuffer_ptr s2;
   unsigned int response_len = 0, hdrLen;
   char outbuf[HTTP_MSG_BUF_SIZE];
@@ -505,7 +506,6 @@ http_handle_client_PDF_receive(steg_t *, conn_t *conn, struct evbuffer *dest, st
   }
 
   //  downcast_steg(s)->have_received = 1;
-  conn->expect_close();
   return RECV_GOOD;
 }
 
@@ -0,0 +1,189 @@
+/* Copyright 2012 the StegoTorus authors
+   See LICENSE for other credits and copying information
+*/
+
+#include "util.h"
+#include "peernames.h"
+
+#include <event2/dns.h>
+#include <event2/util.h>
+
+#include <algorithm>
+
+struct peer_lookup
+{
+  peer_name_cache *cache;   // NULL once the cache is gone
+  std::string key;
+  struct evdns_request *req;
+};
+
+// Cached names last between PEER_TTL_MIN and PEER_TTL_MAX seconds,
+// whatever the DNS says; failures are remembered for PEER_TTL_MIN.
+static const int PEER_TTL_MIN = 60;
+static const int PEER_TTL_MAX = 3600;
+static const size_t PEER_CACHE_MAX = 256;
+
+unsigned int peer_name_cache::in_flight;
+
+namespace {
+  struct peer_name_store
+  {
+    peer_name_cache *cache;
+    unsigned int users;     // steg configs using it
+
+    peer_name_store() : cache(0), users(0) {}
+  };
+}
+
+static peer_name_store peer_names;
+
+peer_name_cache *
+peer_names_open(void)
+{
+  if (peer_names.users++ == 0)
+    peer_names.cache = new peer_name_cache;
+  return peer_names.cache;
+}
+
+void
+peer_names_close(void)
+{
+  log_assert(peer_names.users > 0);
+  if (--peer_names.users > 0)
+    return;
+
+  delete peer_names.cache;
+  peer_names.cache = 0;
+}
+
+peer_name_cache::~peer_name_cache()
+{
+  // Outstanding queries will still call back (with DNS_ERR_CANCEL, or
+  // not at all if the evdns base goes first); the lookup objects
+  // must outlive us.
+  struct evdns_base *base = dns ? dns : get_evdns_base();
+  for (std::map<std::string, entry>::iterator i = names.begin();
+       i != names.end(); i++)
+    if (peer_lookup *lk = i->second.pending) {
+      lk->cache = 0;
+      evdns_cancel_request(base, lk->req);
+    }
+}
+
+void
+peer_name_cache::lookup(const char *peername, char *out, size_t outlen)
+{
+  struct sockaddr_storage ss;
+  int sslen = sizeof ss;
+  char abuf[INET6_ADDRSTRLEN + 2];
+
+  if (!peername ||
+      evutil_parse_sockaddr_port(peername, (struct sockaddr *)&ss, &sslen)) {
+    xsnprintf(out, outlen, "%s", peername ? peername : "localhost");
+    return;
+  }
+
+  // The key, and the name we use until DNS tells us better, is the
+  // address without the port.
+  const char *a;
+  if (ss.ss_family == AF_INET6) {
+    abuf[0] = '[';
+    a = evutil_inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&ss)->sin6_addr,
+                         abuf + 1, sizeof abuf - 2);
+    strcat(abuf, "]");
+  } else {
+    a = evutil_inet_ntop(AF_INET, &((struct sockaddr_in *)&ss)->sin_addr,
+                         abuf, sizeof abuf);
+  }
+  if (!a) {
+    xsnprintf(out, outlen, "%s", peername);
+    return;
+  }
+
+  std::string key(abuf);
+  time_t t = now();
+  std::map<std::string, entry>::iterator i = names.find(key);
+  if (i == names.end()) {
+    if (names.size() >= PEER_CACHE_MAX)
+      purge(t);
+    if (names.size() >= PEER_CACHE_MAX) {
+      xsnprintf(out, outlen, "%s", abuf);
+      return;
+    }
+    i = names.insert(std::make_pair(key, entry())).first;
+    i->second.name = key;
+  }
+
+  entry &e = i->second;
+  if (e.expires <= t && !e.pending)
+    start_lookup(key, e, (struct sockaddr *)&ss);
+  xsnprintf(out, outlen, "%s", e.name.c_str());
+}
+
+void
+peer_name_cache::start_lookup(const std::string &key, entry &e,
+                              const struct sockaddr *sa)
+{
+  struct evdns_base *base = dns ? dns : get_evdns_base();
+  e.expires = now() + PEER_TTL_MIN;
+  if (!base)
+    return;
+
+  peer_lookup *lk = new peer_lookup;
+  lk->cache = this;
+  lk->key = key;
+  if (sa->sa_family == AF_INET6)
+    lk->req = evdns_base_resolve_reverse_ipv6(base,
+                &((const struct sockaddr_in6 *)sa)->sin6_addr, 0,
+                lookup_done, lk);
+  else
+    lk->req = evdns_base_resolve_reverse(base,
+                &((const struct sockaddr_in *)sa)->sin_addr, 0,
+                lookup_done, lk);
+
+  if (lk->req) {
+    e.pending = lk;
+    in_flight++;
+  } else {
+    log_debug("http: could not start reverse lookup of %s", key.c_str());
+    delete lk;
+  }
+}
+
+void
+peer_name_cache::lookup_done(int result, char type, int count, int ttl,
+                             void *addresses, void *arg)
+{
+  peer_lookup *lk = (peer_lookup *)arg;
+  peer_name_cache *cache = lk->cache;
+  std::map<std::string, entry>::iterator i;
+
+  if (cache && (i = cache->names.find(lk->key)) != cache->names.end()) {
+    entry &e = i->second;
+    e.pending = 0;
+    if (result == DNS_ERR_NONE && type == DNS_PTR && count > 0 && addresses) {
+      e.name = *(const char **)addresses;
+      e.expires = cache->now() + std::max(PEER_TTL_MIN,
+                                          std::min(PEER_TTL_MAX, ttl));
+      log_debug("http: %s is %s", lk->key.c_str(), e.name.c_str());
+    } else {
+      log_debug("http: reverse lookup of %s failed: %s",
+                lk->key.c_str(), evdns_err_to_string(result));
+    }
+  }
+  in_flight--;
+  delete lk;
+}
+
+// Drop every entry that has expired and is not being looked up.
+void
+peer_name_cache::purge(time_t t)
+{
+  std::map<std::string, entry>::iterator i = names.begin();
+  while (i != names.end()) {
+    if (i->second.expires <= t && !i->second.pending)
+      names.erase(i++);
+    else
+      i++;
+  }
+}
@@ -0,0 +1,72 @@
+/* Copyright 2012 the StegoTorus authors
+   See LICENSE for other credits and copying information
+*/
+
+#ifndef PEERNAMES_H
+#define PEERNAMES_H
+
+#include <time.h>
+#include <map>
+#include <string>
+
+struct evdns_base;
+struct peer_lookup;
+struct sockaddr;
+
+// Host names for the peers we talk to, from reverse DNS, keyed by
+// numeric address.  A lookup never blocks: on a miss, the caller
+// gets the numeric address, and an asynchronous PTR query is started
+// whose answer will serve later connections until its TTL runs out.
+// Failed queries are remembered too, so an unresponsive resolver
+// is asked only once a minute.  Only for use from the event-loop
+// thread.
+class peer_name_cache
+{
+public:
+  // Queries go to DNS, or to get_evdns_base() if that is NULL.
+  explicit peer_name_cache(struct evdns_base *dns = 0) : dns(dns) {}
+  virtual ~peer_name_cache();
+
+  // Write the name to use for PEERNAME (as in conn_t) into OUT,
+  // which has room for OUTLEN bytes including the terminating NUL.
+  void lookup(const char *peername, char *out, size_t outlen);
+
+  size_t size() const { return names.size(); }
+
+  // Queries that have not yet called back, across all caches,
+  // including ones that have since been destroyed.
+  static unsigned int queries_in_flight() { return in_flight; }
+
+protected:
+  virtual time_t now() const { return time(0); }
+
+private:
+  struct entry
+  {
+    std::string name;
+    time_t expires;
+    peer_lookup *pending;
+    entry() : expires(0), pending(0) {}
+  };
+  std::map<std::string, entry> names;
+  struct evdns_base *dns;
+  static unsigned int in_flight;
+
+  void start_lookup(const std::string &key, entry &e,
+                    const struct sockaddr *sa);
+  void purge(time_t t);
+  static void lookup_done(int result, char type, int count, int ttl,
+                          void *addresses, void *arg);
+
+  peer_name_cache(const peer_name_cache&) DELETE_METHOD;
+  peer_name_cache& operator=(const peer_name_cache&) DELETE_METHOD;
+};
+
+// The cache shared by every steg config in the process, so that
+// configs listening on different addresses still ask about each peer
+// only once.  Each config that uses it opens it, and closes it again
+// when done; the last close frees it.
+peer_name_cache *peer_names_open(void);
+void peer_names_close(void);
+
+#endif
@@ -20,7 +20,8 @@ static const char http_response_1[] =
 
 
 unsigned int 
-swf_wrap(payloads& pl, char* inbuf, int in_len, char* outbuf, int out_sz) {
+swf_wrap(const payloads& pl, char* inbuf, int in_len, char* outbuf, int out_sz,
+         bool keep_alive) {
 
   char* swf;
   int in_swf_len;
@@ -74,7 +75,7 @@ swf_wrap(payloads& pl, char* inbuf, int in_len, char* outbuf, int out_sz) {
   //  fprintf(stderr, "out_swf_len = %d\n", out_swf_len);
 
 
-  hdr_len =   gen_response_header((char*) "application/x-shockwave-flash", 0, out_swf_len + 8, hdr, sizeof(hdr));
+  hdr_len =   gen_response_header((char*) "application/x-shockwave-flash", 0, out_swf_len + 8, hdr, sizeof(hdr), keep_alive);
 
   //  fprintf(stderr, "hdr = %s\n", hdr);
 				       
@@ -119,7 +120,8 @@ swf_unwrap(char* inbuf, int in_len, char* outbuf, int out_sz) {
 }
 
 int
-http_server_SWF_transmit(payloads& pl, struct evbuffer *source, conn_t *conn)
+http_server_SWF_transmit(const payloads& pl, struct evbuffer *source, conn_t *conn,
+                         bool keep_alive)
 {
 
   struct evbuffer *dest = conn->outbound();
@@ -138,7 +140,8 @@ http_server_SWF_transmit(payloads& pl, struct evbuffer *source, conn_t *conn)
   outbuf = (char *)xmalloc(4*sbuflen + SWF_SAVE_FOOTER_LEN + SWF_SAVE_HEADER_LEN + 512);
 
   //  fprintf(stderr, "server wrapping swf len %d\n", (int) sbuflen);
-  outlen = swf_wrap(pl, inbuf, sbuflen, outbuf, 4*sbuflen + SWF_SAVE_FOOTER_LEN + SWF_SAVE_HEADER_LEN + 512);
+  outlen = swf_wrap(pl, inbuf, sbuflen, outbuf, 4*sbuflen + SWF_SAVE_FOOTER_LEN + SWF_SAVE_HEADER_LEN + 512,
+                  keep_alive);
 
   if (outlen < 0) {
     log_warn("swf_wrap failed\n");
@@ -156,8 +159,6 @@ http_server_SWF_transmit(payloads& pl, struct evbuffer *source, conn_t *conn)
     return -1;
   }
 
-    
-  conn->cease_transmission();
 
   free(inbuf);
   free(outbuf);
@@ -168,7 +169,7 @@ http_server_SWF_transmit(payloads& pl, struct evbuffer *source, conn_t *conn)
 
 
 int
-http_handle_client_SWF_receive(steg_t *, conn_t *conn, struct evbuffer *dest, struct evbuffer* source) {
+http_handle_client_SWF_receive(steg_t *, conn_t *, struct evbuffer *dest, struct evbuffer* source) {
   struct evbuffer_ptr s2;
   unsigned int response_len = 0, hdrLen;
   char outbuf[HTTP_MSG_BUF_SIZE];
@@ -244,6 +245,5 @@ http_handle_client_SWF_receive(steg_t *, conn_t *conn, struct evbuffer *dest, st
   }
 
   //  downcast_steg(s)->have_received = 1;
-  conn->expect_close();
   return RECV_GOOD;
 }
@@ -21,13 +21,15 @@ struct payloads;
 
 
 unsigned int 
-swf_wrap(payloads& pl, char* inbuf, int in_len, char* outbuf, int out_sz);
+swf_wrap(const payloads& pl, char* inbuf, int in_len, char* outbuf, int out_sz,
+         bool keep_alive);
 
 unsigned int 
 swf_unwrap(char* inbuf, int in_len, char* outbuf, int out_sz);
 
 int 
-http_server_SWF_transmit(payloads& pl, struct evbuffer *source, conn_t *conn);
+http_server_SWF_transmit(const payloads& pl, struct evbuffer *source, conn_t *conn,
+                         bool keep_alive);
 
 
 int
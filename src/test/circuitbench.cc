@@ -0,0 +1,207 @@
+/* Copyright 2012 the StegoTorus authors
+   See LICENSE for other credits and copying information
+
+   Benchmarks for the chop protocol's per-circuit overheads.
+
+   Measure how many circuits per second the chop protocol can set up.
+   This is dominated by key derivation, so we compare the current
+   per-config key schedule against the old scheme, which ran PBKDF2
+   for every circuit.
+
+   Also measure how fast one circuit can send blocks as the number of
+   downstream connections grows; connection selection should not get
+   much slower with more connections.  Finally, measure bulk transfer,
+   where several blocks can share one steg transmission.  */
+
+#include "util.h"
+#include "connections.h"
+#include "crypt.h"
+#include "main.h"
+#include "protocol.h"
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include <algorithm>
+#include <vector>
+
+/* Required by libstegotorus. */
+void
+finish_shutdown(void)
+{
+}
+
+static double
+elapsed(const struct timeval *start)
+{
+  struct timeval now, diff;
+  evutil_gettimeofday(&now, NULL);
+  evutil_timersub(&now, start, &diff);
+  return diff.tv_sec + diff.tv_usec / 1e6;
+}
+
+static void
+report(const char *label, unsigned int n, double secs)
+{
+  printf("%-28s %8u circuits in %8.3f s = %10.1f circuits/s\n",
+         label, n, secs, n / secs);
+}
+
+/* The old schedule, for comparison: stretch the passphrase for every
+   circuit, then draw all four keys from that one generator.  */
+static void
+bench_per_circuit_pbkdf2(unsigned int n)
+{
+  static const char passphrase[] =
+    "did you buy one of therapist reawaken chemists continually gamma pacifies?";
+  struct timeval start;
+  evutil_gettimeofday(&start, NULL);
+
+  for (unsigned int i = 0; i < n; i++) {
+    key_generator *kgen =
+      key_generator::from_passphrase((const uint8_t *)passphrase,
+                                     sizeof(passphrase) - 1,
+                                     0, 0, 0, 0);
+    delete gcm_encryptor::create(kgen, 16);
+    delete ecb_encryptor::create(kgen, 16);
+    delete gcm_decryptor::create(kgen, 16);
+    delete ecb_decryptor::create(kgen, 16);
+    delete kgen;
+  }
+
+  report("per-circuit PBKDF2 (old)", n, elapsed(&start));
+}
+
+/* The real thing: circuit_create on a chop client configuration.
+   The circuits are not torn down, because that would measure the
+   shutdown path as well, and would complain about each circuit being
+   destroyed while still active.  */
+static void
+bench_circuit_create(unsigned int n)
+{
+  const char *const options[] = {
+    "chop", "client", "127.0.0.1:5000", "127.0.0.1:5001", "nosteg"
+  };
+  struct timeval start;
+
+  evutil_gettimeofday(&start, NULL);
+  config_t *cfg = config_create(sizeof options / sizeof options[0], options);
+  if (!cfg) {
+    fprintf(stderr, "failed to create chop configuration\n");
+    exit(1);
+  }
+  printf("%-28s %8.3f s\n", "config setup (one PBKDF2)", elapsed(&start));
+
+  evutil_gettimeofday(&start, NULL);
+  for (unsigned int i = 0; i < n; i++)
+    circuit_create(cfg, 0);
+
+  report("circuit_create (HKDF only)", n, elapsed(&start));
+}
+
+/* Create a chop client circuit with N_DOWN downstream connections,
+   all using the 'nosteg' module, and return it.  The connections are
+   appended to CONNS.  */
+static circuit_t *
+make_circuit(config_t *cfg, unsigned int n_down, std::vector<conn_t *> &conns)
+{
+  struct bufferevent *pair[2];
+  circuit_t *ckt = circuit_create(cfg, 0);
+  bufferevent_pair_new(cfg->base, 0, pair);
+  circuit_add_upstream(ckt, pair[1], xstrdup("upstream"));
+
+  for (unsigned int i = 0; i < n_down; i++) {
+    bufferevent_pair_new(cfg->base, 0, pair);
+    conn_t *conn = conn_create(cfg, 0, pair[0], xstrdup("downstream"));
+    ckt->add_downstream(conn);
+    conns.push_back(conn);
+  }
+
+  // Stand in for the upstream peer by adding data directly to the
+  // circuit's input buffer, which bufferevents normally keep frozen.
+  evbuffer_unfreeze(bufferevent_get_input(ckt->up_buffer), 0);
+  return ckt;
+}
+
+/* Send N_BLOCKS one-kilobyte blocks with N_DOWN downstream
+   connections.  Since nothing acknowledges the data, a circuit can
+   only send one flow-control window's worth (a megabyte), so use a
+   fresh circuit for each megabyte, and time only the sending.  If
+   BULK is true, queue each megabyte up front and send it with a
+   single call.  As above, nothing is torn down afterward.  */
+static void
+bench_send_blocks(unsigned int n_down, unsigned int n_blocks, bool bulk)
+{
+  const char *const options[] = {
+    "chop", "client", "127.0.0.1:5000", "127.0.0.1:5001", "nosteg"
+  };
+  struct event_base *base = event_base_new();
+  config_t *cfg = config_create(sizeof options / sizeof options[0], options);
+  if (!base || !cfg) {
+    fprintf(stderr, "failed to create chop configuration\n");
+    exit(1);
+  }
+  cfg->base = base;
+
+  uint8_t data[1024];
+  memset(data, 'x', sizeof data);
+
+  double secs = 0;
+  for (unsigned int sent = 0; sent < n_blocks; ) {
+    std::vector<conn_t *> conns;
+    circuit_t *ckt = make_circuit(cfg, n_down, conns);
+    struct evbuffer *up = bufferevent_get_input(ckt->up_buffer);
+    unsigned int n = std::min(n_blocks - sent, 1024u);
+    struct timeval start;
+
+    if (bulk) {
+      for (unsigned int i = 0; i < n; i++)
+        evbuffer_add(up, data, sizeof data);
+      evutil_gettimeofday(&start, NULL);
+      circuit_send(ckt);
+    } else {
+      evutil_gettimeofday(&start, NULL);
+      for (unsigned int i = 0; i < n; i++) {
+        evbuffer_add(up, data, sizeof data);
+        circuit_send(ckt);
+      }
+    }
+    secs += elapsed(&start);
+    sent += n;
+
+    for (std::vector<conn_t *>::iterator c = conns.begin();
+         c != conns.end(); c++)
+      evbuffer_drain((*c)->outbound(),
+                     evbuffer_get_length((*c)->outbound()));
+  }
+
+  printf("%4u downstreams: %8u KB %s in %8.3f s = %10.1f KB/s\n",
+         n_down, n_blocks, bulk ? "in bulk " : "singly  ", secs,
+         n_blocks / secs);
+}
+
+int
+main(int argc, char **argv)
+{
+  unsigned int n_old = 200, n_new = 20000, n_blocks = 100000;
+
+  if (argc > 1)
+    n_old = atoi(argv[1]);
+  if (argc > 2)
+    n_new = atoi(argv[2]);
+  if (argc > 3)
+    n_blocks = atoi(argv[3]);
+
+  log_set_method(LOG_METHOD_NULL, 0);
+
+  bench_per_circuit_pbkdf2(n_old);
+  bench_circuit_create(n_new);
+
+  bench_send_blocks(1, n_blocks, false);
+  bench_send_blocks(16, n_blocks, false);
+  bench_send_blocks(127, n_blocks, false);
+  bench_send_blocks(1, n_blocks, true);
+  return 0;
+}
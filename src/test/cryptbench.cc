@@ -0,0 +1,430 @@
+/* Copyright 2012 the StegoTorus authors
+   See LICENSE for other credits and copying information
+
+   Micro-benchmarks for the primitives in crypt.h and rng.h.
+
+   For each bulk operation (header encryption on single blocks,
+   authenticated encryption and decryption, both flat and
+   scatter-gather, under each cipher suite; and rng_bytes), report
+   the cost per operation and the throughput at every power-of-two
+   size from 32 bytes up to the largest chop block.  Also report the
+   cost of setting up keys: creating cipher states from a raw key or
+   from a key generator, and each way of making a key generator; and
+   the cost of the small random draws that steg modules and chop's
+   timers make all the time, with OpenSSL's RAND_bytes for
+   comparison.  unittest_crypt checks that all of these are correct;
+   this only checks that they are fast.
+
+   Each measurement repeats its operation, doubling the repeat count,
+   until at least MIN_SECS seconds have passed, so cheap and expensive
+   operations are both timed over a useful interval.  */
+
+#include "util.h"
+#include "crypt.h"
+#include "rng.h"
+#include "secmem.h"
+
+#include <event2/util.h>
+#include <openssl/rand.h>
+
+#include <algorithm>
+#include <vector>
+
+/* Required by libstegotorus. */
+void
+finish_shutdown(void)
+{
+}
+
+/* The largest block the chop protocol will ever encrypt: a 16-byte
+   header plus two sections of up to 65535 bytes each plus a 16-byte
+   tag.  Must match MAX_BLOCK_SIZE in protocol/chop.cc.  */
+const size_t MAX_BLOCK_SIZE = 16 + 16 + 65535*2;
+
+/* Only the data and padding sections are actually GCM-encrypted. */
+const size_t MAX_GCM_LEN = MAX_BLOCK_SIZE - 16 - GCM_TAG_LEN;
+
+static double min_secs = 0.25;
+
+static double
+elapsed(const struct timeval *start)
+{
+  struct timeval now, diff;
+  evutil_gettimeofday(&now, NULL);
+  evutil_timersub(&now, start, &diff);
+  return diff.tv_sec + diff.tv_usec / 1e6;
+}
+
+/* One benchmarked operation.  'run' is called repeatedly; 'bytes' is
+   how much data each call processes, or 0 if throughput is not
+   meaningful.  */
+struct bench_op
+{
+  size_t bytes;
+  bench_op(size_t bytes_) : bytes(bytes_) {}
+  virtual ~bench_op() {}
+  virtual void run() = 0;
+};
+
+static void
+measure(const char *label, bench_op &op)
+{
+  unsigned long n = 1, total = 0;
+  double secs = 0;
+  struct timeval start;
+
+  op.run(); // warm up
+  while (secs < min_secs) {
+    evutil_gettimeofday(&start, NULL);
+    for (unsigned long i = 0; i < n; i++)
+      op.run();
+    secs += elapsed(&start);
+    total += n;
+    n *= 2;
+  }
+
+  double ns = secs * 1e9 / total;
+  if (op.bytes)
+    printf("%-24s %7lu B %12.1f ns/op %10.1f MB/s\n",
+           label, (unsigned long)op.bytes, ns,
+           op.bytes * total / secs / 1e6);
+  else
+    printf("%-24s %9s %12.1f ns/op\n", label, "", ns);
+}
+
+static const uint8_t bench_key[32] = {
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+  0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+  0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+  0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f
+};
+static const uint8_t bench_nonce[16] = {
+  0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+  0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+static const char bench_passphrase[] =
+  "did you buy one of therapist reawaken chemists continually gamma pacifies?";
+
+/* Bulk operations. */
+
+/* The header cipher is only ever used on single blocks, so this
+   encrypts a buffer one block at a time, as chop would.  */
+struct ecb_op : bench_op
+{
+  ecb_encryptor *e;
+  std::vector<uint8_t> buf;
+  ecb_op(size_t n, cipher_suite cs)
+    : bench_op(n),
+      e(ecb_encryptor::create(cs, bench_key, cipher_suite_key_len(cs))),
+      buf(n) {}
+  ~ecb_op() { delete e; }
+  void run()
+  {
+    for (size_t i = 0; i + AES_BLOCK_LEN <= bytes; i += AES_BLOCK_LEN)
+      e->encrypt(&buf[i], &buf[i]);
+  }
+};
+
+struct gcm_enc_op : bench_op
+{
+  gcm_encryptor *e;
+  std::vector<uint8_t> in, out;
+  gcm_enc_op(size_t n, cipher_suite cs)
+    : bench_op(n),
+      e(gcm_encryptor::create(cs, bench_key, cipher_suite_key_len(cs))),
+      in(n), out(n + GCM_TAG_LEN) {}
+  ~gcm_enc_op() { delete e; }
+  void run()
+  {
+    e->encrypt(&out[0], &in[0], bytes, bench_nonce, sizeof bench_nonce);
+  }
+};
+
+struct gcm_dec_op : bench_op
+{
+  gcm_decryptor *d;
+  std::vector<uint8_t> in, out;
+  gcm_dec_op(size_t n, cipher_suite cs)
+    : bench_op(n),
+      d(gcm_decryptor::create(cs, bench_key, cipher_suite_key_len(cs))),
+      in(n + GCM_TAG_LEN), out(n)
+  {
+    gcm_encryptor *e =
+      gcm_encryptor::create(cs, bench_key, cipher_suite_key_len(cs));
+    e->encrypt(&in[0], &out[0], n, bench_nonce, sizeof bench_nonce);
+    delete e;
+  }
+  ~gcm_dec_op() { delete d; }
+  void run()
+  {
+    if (d->decrypt(&out[0], &in[0], bytes + GCM_TAG_LEN,
+                   bench_nonce, sizeof bench_nonce)) {
+      fprintf(stderr, "gcm_decryptor: authentication failure\n");
+      exit(1);
+    }
+  }
+};
+
+/* Scatter-gather encryption, with the input cut into 4 KB pieces
+   (about what evbuffer chains hold) and a flat output.  */
+struct gcm_enc_sg_op : bench_op
+{
+  gcm_encryptor *e;
+  std::vector<uint8_t> in, out;
+  std::vector<evbuffer_iovec> ivec, ovec;
+  gcm_enc_sg_op(size_t n, cipher_suite cs)
+    : bench_op(n),
+      e(gcm_encryptor::create(cs, bench_key, cipher_suite_key_len(cs))),
+      in(n), out(n + GCM_TAG_LEN)
+  {
+    for (size_t off = 0; off < n; off += 4096) {
+      evbuffer_iovec v;
+      v.iov_base = &in[off];
+      v.iov_len = std::min(n - off, size_t(4096));
+      ivec.push_back(v);
+    }
+    evbuffer_iovec v;
+    v.iov_base = &out[0];
+    v.iov_len = n;
+    ovec.push_back(v);
+  }
+  ~gcm_enc_sg_op() { delete e; }
+  void run()
+  {
+    e->encrypt(&ovec[0], ovec.size(), &ivec[0], ivec.size(), &out[bytes],
+               bench_nonce, sizeof bench_nonce);
+  }
+};
+
+struct rng_op : bench_op
+{
+  std::vector<uint8_t> buf;
+  rng_op(size_t n, cipher_suite) : bench_op(n), buf(n) {}
+  void run() { rng_bytes(&buf[0], bytes); }
+};
+
+/* Small random draws. */
+
+struct rng_small_op : bench_op
+{
+  uint8_t buf[16];
+  rng_small_op(size_t n) : bench_op(n) {}
+  void run() { rng_bytes(buf, bytes); }
+};
+
+struct rand_bytes_op : bench_op
+{
+  uint8_t buf[16];
+  rand_bytes_op(size_t n) : bench_op(n) {}
+  void run() { RAND_bytes(buf, bytes); }
+};
+
+struct rng_int_op : bench_op
+{
+  rng_int_op() : bench_op(0) {}
+  void run() { rng_int(1000); }
+};
+
+struct fast_rng_int_op : bench_op
+{
+  fast_rng_int_op() : bench_op(0) {}
+  void run() { fast_rng_int(1000); }
+};
+
+struct rng_range_geom_op : bench_op
+{
+  rng_range_geom_op() : bench_op(0) {}
+  void run() { rng_range_geom(1000, 100); }
+};
+
+struct geom_sampler_op : bench_op
+{
+  rng_geom_sampler sampler;
+  geom_sampler_op(unsigned int hi, unsigned int xv)
+    : bench_op(0), sampler(hi, xv) {}
+  void run() { sampler.sample(); }
+};
+
+struct geom_build_op : bench_op
+{
+  geom_build_op() : bench_op(0) {}
+  void run() { rng_geom_sampler s(20 * 60 * 1000, 1 << 10); }
+};
+
+/* Key setup. */
+
+struct ecb_create_op : bench_op
+{
+  ecb_create_op() : bench_op(0) {}
+  void run() { delete ecb_encryptor::create(bench_key, 16); }
+};
+
+struct gcm_create_op : bench_op
+{
+  gcm_create_op() : bench_op(0) {}
+  void run() { delete gcm_encryptor::create(bench_key, 16); }
+};
+
+struct chacha_create_op : bench_op
+{
+  chacha_create_op() : bench_op(0) {}
+  void run()
+  {
+    delete gcm_encryptor::create(CIPHER_CHACHA20_POLY1305, bench_key, 32);
+    delete ecb_encryptor::create(CIPHER_CHACHA20_POLY1305, bench_key, 32);
+  }
+};
+
+struct gcm_create_kgen_op : bench_op
+{
+  gcm_create_kgen_op() : bench_op(0) {}
+  void run()
+  {
+    key_generator *kgen =
+      key_generator::from_random_secret(bench_key, sizeof bench_key,
+                                        0, 0, 0, 0);
+    delete gcm_encryptor::create(kgen, 16);
+    delete kgen;
+  }
+};
+
+struct from_random_secret_op : bench_op
+{
+  from_random_secret_op() : bench_op(0) {}
+  void run()
+  {
+    delete key_generator::from_random_secret(bench_key, sizeof bench_key,
+                                             bench_nonce, sizeof bench_nonce,
+                                             0, 0);
+  }
+};
+
+struct from_prk_op : bench_op
+{
+  from_prk_op() : bench_op(0) {}
+  void run()
+  {
+    delete key_generator::from_prk(bench_key, 0, 0);
+  }
+};
+
+// Everything chop_circuit_t::init_keys does, and the teardown.
+struct circuit_keys_op : bench_op
+{
+  circuit_keys_op() : bench_op(0) {}
+  void run()
+  {
+    uint32_t id = 1;
+    key_generator *kgen = key_generator::from_prk(bench_key,
+                                                  (const uint8_t *)&id,
+                                                  sizeof id);
+    ecb_encryptor *se = ecb_encryptor::create(CIPHER_AES128_GCM, kgen);
+    gcm_encryptor *ge = gcm_encryptor::create(CIPHER_AES128_GCM, kgen);
+    ecb_decryptor *sd = ecb_decryptor::create(CIPHER_AES128_GCM, kgen);
+    gcm_decryptor *gd = gcm_decryptor::create(CIPHER_AES128_GCM, kgen);
+    delete kgen;
+    delete se;
+    delete ge;
+    delete sd;
+    delete gd;
+  }
+};
+
+struct from_passphrase_op : bench_op
+{
+  from_passphrase_op() : bench_op(0) {}
+  void run()
+  {
+    delete key_generator::from_passphrase((const uint8_t *)bench_passphrase,
+                                          sizeof bench_passphrase - 1,
+                                          0, 0, 0, 0);
+  }
+};
+
+/* Run a bulk operation at every power-of-two size from 32 bytes up,
+   finishing with MAXLEN itself.  */
+template <typename Op>
+static void
+measure_sizes(const char *label, size_t maxlen,
+              cipher_suite cs = CIPHER_AES128_GCM)
+{
+  for (size_t n = 32; ; n *= 2) {
+    if (n > maxlen)
+      n = maxlen;
+    Op op(n, cs);
+    measure(label, op);
+    if (n == maxlen)
+      break;
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  if (argc > 1)
+    min_secs = atof(argv[1]);
+
+  log_set_method(LOG_METHOD_NULL, 0);
+
+  {
+    ecb_create_op a;
+    measure("ecb_encryptor::create", a);
+    gcm_create_op b;
+    measure("gcm_encryptor::create", b);
+    gcm_create_kgen_op c;
+    measure("gcm_encryptor (kgen)", c);
+    chacha_create_op g;
+    measure("chacha20 hdr+aead create", g);
+    from_random_secret_op d;
+    measure("from_random_secret", d);
+    from_prk_op e;
+    measure("from_prk", e);
+    from_passphrase_op f;
+    measure("from_passphrase", f);
+    circuit_keys_op h;
+    measure("circuit key setup", h);
+
+    secmem_stats st;
+    secmem_get_stats(&st);
+    printf("key arena: peak %lu bytes, %lu reserved, %lu locked\n",
+           (unsigned long)st.peak, (unsigned long)st.reserved,
+           (unsigned long)st.locked);
+  }
+
+  measure_sizes<ecb_op>("ecb encrypt", MAX_GCM_LEN);
+  measure_sizes<gcm_enc_op>("gcm encrypt", MAX_GCM_LEN);
+  measure_sizes<gcm_enc_sg_op>("gcm encrypt (iovec)", MAX_GCM_LEN);
+  measure_sizes<gcm_dec_op>("gcm decrypt", MAX_GCM_LEN);
+  measure_sizes<ecb_op>("chacha20 header", MAX_GCM_LEN,
+                        CIPHER_CHACHA20_POLY1305);
+  measure_sizes<gcm_enc_op>("chacha20-poly1305 enc", MAX_GCM_LEN,
+                            CIPHER_CHACHA20_POLY1305);
+  measure_sizes<gcm_enc_sg_op>("chacha20-poly1305 (iov)", MAX_GCM_LEN,
+                               CIPHER_CHACHA20_POLY1305);
+  measure_sizes<gcm_dec_op>("chacha20-poly1305 dec", MAX_GCM_LEN,
+                            CIPHER_CHACHA20_POLY1305);
+  measure_sizes<rng_op>("rng_bytes", MAX_BLOCK_SIZE);
+
+  {
+    rng_small_op a(1), b(4), c(16);
+    measure("rng_bytes", a);
+    measure("rng_bytes", b);
+    measure("rng_bytes", c);
+    rand_bytes_op d(1), e(4), f(16);
+    measure("RAND_bytes", d);
+    measure("RAND_bytes", e);
+    measure("RAND_bytes", f);
+    rng_int_op g;
+    measure("rng_int", g);
+    fast_rng_int_op i;
+    measure("fast_rng_int", i);
+    rng_range_geom_op h;
+    measure("rng_range_geom", h);
+    geom_sampler_op j(1000, 100), k(20 * 60 * 1000, 1 << 10);
+    measure("rng_geom_sampler", j);
+    measure("rng_geom_sampler/flush", k);
+    geom_build_op l;
+    measure("rng_geom_sampler setup", l);
+  }
+  return 0;
+}
@@ -8,6 +8,7 @@
 
 import os
 import os.path
+import tempfile
 
 from unittest import TestCase, TestSuite
 from itestlib import Stegotorus, Tltester, diff
@@ -62,6 +63,40 @@ class TimelineTest(object):
             "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
             ))
 
+    def test_chop_window(self):
+        self.doTest("chop",
+           ("chop", "--window=1024", "server", "127.0.0.1:5001",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            "chop", "--window=1024", "client", "127.0.0.1:4999",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            ))
+
+    def test_chop_workers(self):
+        self.doTest("chop",
+           ("--workers=2",
+            "chop", "server", "127.0.0.1:5001",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            "chop", "client", "127.0.0.1:4999",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            ))
+
+    def test_chop_chacha(self):
+        self.doTest("chop",
+           ("chop", "--cipher=chacha20-poly1305", "server", "127.0.0.1:5001",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            "chop", "--cipher=chacha20-poly1305", "client", "127.0.0.1:4999",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            ))
+
+    def test_chop_crypto_threads(self):
+        self.doTest("chop",
+           ("--crypto-threads=2", "--crypto-offload-min=0",
+            "chop", "server", "127.0.0.1:5001",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            "chop", "client", "127.0.0.1:4999",
+            "127.0.0.1:5010","nosteg","127.0.0.1:5011","nosteg",
+            ))
+
     def test_chop_nosteg_rr(self):
         self.doTest("chop",
            ("chop", "server", "127.0.0.1:5001",
@@ -95,6 +130,26 @@ class TimelineTest(object):
             "127.0.0.1:5010","http","127.0.0.1:5011","http",
             ))
 
+# More than a flow-control window (1 MiB) in each direction, so that
+# circuits run out of credit.  With nosteg_rr every connection carries
+# a single request and response, so credit can only come back on a
+# connection the client opens while it is waiting for it.
+class FlowControlTest(TimelineTest, TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        fd, cls.scriptFile = tempfile.mkstemp(prefix="tl_credit_")
+        f = os.fdopen(fd, "w")
+        for i in range(32):
+            line = chr(ord('A') + i % 26) * 65536
+            f.write("> " + line + "\n< " + line + "\n")
+        f.close()
+        super(FlowControlTest, cls).setUpClass()
+
+    @classmethod
+    def tearDownClass(cls):
+        os.remove(cls.scriptFile)
+
 # Synthesize TimelineTest+TestCase subclasses for every 'tl_*' file in
 # the test directory.
 def load_tests(loader, standard_tests, pattern):
@@ -108,6 +163,9 @@ def load_tests(loader, standard_tests, pattern):
                        (TimelineTest, TestCase),
                        { 'scriptFile': script })
             suite.addTests(loader.loadTestsFromTestCase(cls))
+
+    for name in ('test_chop_nosteg_rr', 'test_chop_nosteg_rr2'):
+        suite.addTest(FlowControlTest(name))
     return suite
 
 if __name__ == '__main__':
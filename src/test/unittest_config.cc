@@ -11,7 +11,7 @@ struct option_parsing_case {
   config_t *result;
   short should_succeed;
   short n_opts;
-  const char *const opts[6];
+  const char *const opts[7];
 };
 
 static void
@@ -77,10 +77,63 @@ static struct option_parsing_case oc_null[] = {
   { 0, 0, 0, {0} }
 };
 
+static struct option_parsing_case oc_chop[] = {
+  /* bad window sizes */
+  { 0, 0, 6, {"chop", "--window=128", "client", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  { 0, 0, 6, {"chop", "--window=8192", "client", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  { 0, 0, 6, {"chop", "--window=1000", "client", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  { 0, 0, 6, {"chop", "--window=", "client", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  /* bad time-wait intervals */
+  { 0, 0, 6, {"chop", "--time-wait=", "server", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  { 0, 0, 6, {"chop", "--time-wait=10s", "server", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  { 0, 0, 6, {"chop", "--time-wait=86401", "server", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  /* bad cipher suites */
+  { 0, 0, 6, {"chop", "--cipher=", "client", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  { 0, 0, 6, {"chop", "--cipher=rot13", "client", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  /* bad keepalive limits */
+  { 0, 0, 6, {"chop", "--keepalive=0", "client", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  { 0, 0, 6, {"chop", "--keepalive=", "client", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  { 0, 0, 6, {"chop", "--keepalive=101", "server", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  { 0, 0, 6, {"chop", "--frobozz", "client", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  /* should succeed */
+  { 0, 1, 5, {"chop", "client", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  { 0, 1, 6, {"chop", "--window=4096", "client", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  { 0, 1, 6, {"chop", "--window=256", "server", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  { 0, 1, 6, {"chop", "--time-wait=0", "server", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  { 0, 1, 7, {"chop", "--window=512", "--time-wait=300", "server",
+              "127.0.0.1:5552", "192.168.1.99:11253", "nosteg"} },
+  { 0, 1, 6, {"chop", "--cipher=aes128-gcm", "client", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+  { 0, 1, 6, {"chop", "--cipher=chacha20-poly1305", "server",
+              "127.0.0.1:5552", "192.168.1.99:11253", "nosteg"} },
+  { 0, 1, 6, {"chop", "--keepalive=8", "client", "127.0.0.1:5552",
+              "192.168.1.99:11253", "nosteg"} },
+
+  { 0, 0, 0, {0} }
+};
+
 #define T(name) \
   { #name, test_config, 0, &config_fixture, oc_##name }
 
 struct testcase_t config_tests[] = {
   T(null),
+  T(chop),
   END_OF_TESTCASES
 };
@@ -0,0 +1,354 @@
+/* Copyright 2012 the StegoTorus authors
+   See LICENSE for other credits and copying information
+*/
+
+#include "util.h"
+#include "unittest.h"
+#include "steg/payloads.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+static const char trace_js[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Content-Type: text/javascript\r\n"
+  "Content-Length: 48\r\n\r\n"
+  "var a = 0x1234abcd, b = 0xdeadbeef; f(a, b, c);\n";
+
+static const char trace_html[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Content-Type: text/html\r\n\r\n"
+  "<html><script type=\"text/javascript\">var x = 0xfeed;</script></html>";
+
+static const char trace_plain[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Content-Type: text/plain\r\n\r\n"
+  "nothing to see here";
+
+static const char trace_req[] =
+  "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n";
+
+static void
+append_message(std::string& trace, PacketType ptype, const char *msg)
+{
+  pentry_header h;
+  memset(&h, 0, sizeof h);
+  h.ptype = htons(ptype);
+  h.length = htonl(strlen(msg));
+  h.port = htons(80);
+  trace.append((const char *)&h, sizeof h);
+  trace.append(msg);
+}
+
+// Write TRACE to a fresh temporary file; returns its name.
+static std::string
+write_trace(const std::string& trace)
+{
+  char name[] = "/tmp/st-payloads-XXXXXX";
+  int fd = mkstemp(name);
+  if (fd < 0)
+    return "";
+  bool ok = write(fd, trace.data(), trace.size()) == (ssize_t)trace.size();
+  ok = !close(fd) && ok;
+  return ok ? name : "";
+}
+
+// A small server trace with one message of each kind.
+static std::string
+make_trace(void)
+{
+  std::string trace;
+  append_message(trace, TYPE_HTTP_RESPONSE, trace_js);
+  append_message(trace, TYPE_HTTP_RESPONSE, trace_html);
+  append_message(trace, TYPE_HTTP_REQUEST, trace_req);
+  append_message(trace, TYPE_HTTP_RESPONSE, trace_plain);
+  return write_trace(trace);
+}
+
+static void
+remove_trace(const std::string& fname)
+{
+  remove(fname.c_str());
+  remove((fname + ".idx").c_str());
+}
+
+static void
+test_payloads_index(void *)
+{
+  std::string fname = make_trace();
+  tt_assert(!fname.empty());
+
+  {
+    payloads scanned, indexed;
+
+    tt_assert(load_payloads(scanned, fname.c_str()));
+    tt_int_op(scanned.payload_count, ==, 4);
+    tt_assert(!read_payload_index(scanned, fname.c_str()));
+    scan_payloads(scanned);
+    tt_int_op(scanned.info[0].content_type, ==, HTTP_CONTENT_JAVASCRIPT);
+    tt_int_op(scanned.info[0].mode, ==, CONTENT_JAVASCRIPT);
+    tt_int_op(scanned.info[0].capacity, >, 0);
+    tt_int_op(scanned.info[1].content_type, ==, HTTP_CONTENT_HTML);
+    tt_int_op(scanned.info[1].mode, ==, CONTENT_HTML_JAVASCRIPT);
+    tt_int_op(scanned.info[2].content_type, ==, 0);
+    tt_int_op(scanned.info[3].content_type, ==, 0);
+    tt_int_op(scanned.info[3].body_offset, ==,
+              strstr(trace_plain, "nothing") - trace_plain);
+    tt_int_op(write_payload_index(scanned, fname.c_str()), ==, 0);
+
+    tt_assert(load_payloads(indexed, fname.c_str()));
+    tt_assert(read_payload_index(indexed, fname.c_str()));
+    tt_uint_op(indexed.info.size(), ==, scanned.info.size());
+    tt_mem_op(&indexed.info[0], ==, &scanned.info[0],
+              scanned.info.size() * sizeof(payload_info));
+  }
+
+ end:
+  remove_trace(fname);
+}
+
+static void
+test_payloads_index_stale(void *)
+{
+  std::string fname = make_trace();
+  tt_assert(!fname.empty());
+
+  {
+    payloads pl, pl2, pl3;
+    struct stat st;
+    struct utimbuf ut;
+    FILE *f;
+
+    tt_assert(load_payloads(pl, fname.c_str()));
+    scan_payloads(pl);
+    tt_int_op(write_payload_index(pl, fname.c_str()), ==, 0);
+
+    // the trace has changed since the index was written
+    tt_assert(!stat(fname.c_str(), &st));
+    ut.actime = st.st_atime;
+    ut.modtime = st.st_mtime - 10;
+    tt_assert(!utime(fname.c_str(), &ut));
+    tt_assert(load_payloads(pl2, fname.c_str()));
+    tt_assert(!read_payload_index(pl2, fname.c_str()));
+    tt_assert(pl2.info.empty());
+
+    // index_payloads falls back to scanning
+    index_payloads(pl2, fname.c_str());
+    tt_uint_op(pl2.info.size(), ==, pl.info.size());
+    tt_mem_op(&pl2.info[0], ==, &pl.info[0],
+              pl.info.size() * sizeof(payload_info));
+
+    // a truncated index is ignored
+    tt_int_op(write_payload_index(pl2, fname.c_str()), ==, 0);
+    f = fopen((fname + ".idx").c_str(), "r+b");
+    tt_assert(f);
+    tt_assert(!ftruncate(fileno(f), 40));
+    fclose(f);
+    tt_assert(load_payloads(pl3, fname.c_str()));
+    tt_assert(!read_payload_index(pl3, fname.c_str()));
+  }
+
+  {
+    // A different trace of the same size and modification time,
+    // renamed into place: only the inode tells them apart.
+    payloads pl, pl2;
+    std::string trace, newname;
+    struct utimbuf ut;
+
+    ut.actime = ut.modtime = time(0) - 100;
+    tt_assert(!utime(fname.c_str(), &ut));
+    tt_assert(load_payloads(pl, fname.c_str()));
+    scan_payloads(pl);
+    tt_int_op(write_payload_index(pl, fname.c_str()), ==, 0);
+
+    append_message(trace, TYPE_HTTP_RESPONSE, trace_plain);
+    append_message(trace, TYPE_HTTP_REQUEST, trace_req);
+    append_message(trace, TYPE_HTTP_RESPONSE, trace_html);
+    append_message(trace, TYPE_HTTP_RESPONSE, trace_js);
+    newname = write_trace(trace);
+    tt_assert(!newname.empty());
+    tt_assert(!utime(newname.c_str(), &ut));
+    tt_assert(!rename(newname.c_str(), fname.c_str()));
+
+    tt_assert(load_payloads(pl2, fname.c_str()));
+    tt_uint_op(pl2.trace_len, ==, pl.trace_len);
+    tt_assert(!read_payload_index(pl2, fname.c_str()));
+  }
+
+ end:
+  remove_trace(fname);
+}
+
+static void
+test_payloads_get_payload(void *)
+{
+  std::string trace, fname;
+
+  // JavaScript responses of many different capacities, each twice
+  for (int i = 1; i <= 40; i++) {
+    std::string body;
+    char hdr[128];
+    for (int j = 0; j < i * (i % 7 + 1); j++)
+      body += "f(0xabcdef12);\n";
+    xsnprintf(hdr, sizeof hdr, "HTTP/1.1 200 OK\r\n"
+              "Content-Type: text/javascript\r\n"
+              "Content-Length: %d\r\n\r\n", (int)body.size());
+    append_message(trace, TYPE_HTTP_RESPONSE, (hdr + body).c_str());
+    append_message(trace, TYPE_HTTP_RESPONSE, (hdr + body).c_str());
+  }
+  fname = write_trace(trace);
+  tt_assert(!fname.empty());
+
+  {
+    payloads pl;
+    const int ct = HTTP_CONTENT_JAVASCRIPT;
+    char *buf;
+    int size, maxcap = 0;
+
+    tt_assert(load_payloads(pl, fname.c_str()));
+    init_JS_payload_pool(pl, HTTP_MSG_BUF_SIZE, TYPE_HTTP_RESPONSE, 0);
+    tt_uint_op(pl.typePayload[ct].size(), ==, 80);
+    for (size_t i = 0; i < pl.typePayloadCap[ct].size(); i++)
+      maxcap = std::max(maxcap, pl.typePayloadCap[ct][i]);
+
+    for (int want = 0; want <= maxcap; want += 37) {
+      // brute force: how many templates can carry WANT bytes, and how
+      // much the MAX_CANDIDATE_PAYLOADS'th smallest of them can carry
+      std::vector<int> fits;
+      for (size_t i = 0; i < pl.typePayloadCap[ct].size(); i++)
+        if (pl.typePayloadCap[ct][i] >= want)
+          fits.push_back(pl.typePayloadCap[ct][i]);
+      std::sort(fits.begin(), fits.end());
+      int limit = fits[std::min(fits.size(), (size_t)MAX_CANDIDATE_PAYLOADS)
+                       - 1];
+
+      for (int k = 0; k < 20; k++) {
+        tt_int_op(get_payload(pl, ct, want, &buf, &size), ==, 1);
+        int r = -1;
+        for (size_t i = 0; i < pl.typePayload[ct].size(); i++)
+          if (pl.payload_bufs[pl.typePayload[ct][i]] == buf)
+            r = i;
+        tt_int_op(r, >=, 0);
+        tt_int_op(size, ==, pl.payload_hdrs[pl.typePayload[ct][r]].length);
+        tt_int_op(pl.typePayloadCap[ct][r], >=, want);
+        tt_int_op(pl.typePayloadCap[ct][r], <=, limit);
+      }
+    }
+
+    tt_int_op(get_payload(pl, ct, maxcap + 1, &buf, &size), ==, 0);
+    tt_int_op(get_payload(pl, HTTP_CONTENT_PDF, 0, &buf, &size), ==, 0);
+  }
+
+ end:
+  remove_trace(fname);
+}
+
+static void
+test_payloads_store(void *)
+{
+  std::string fname = make_trace();
+  tt_assert(!fname.empty());
+
+  {
+    payload_trace *t, *t2, *tc;
+    const payloads *a, *b, *c;
+
+    t = payload_store_open(fname.c_str(), true);
+    t2 = payload_store_open(fname.c_str(), true);
+    tc = payload_store_open(fname.c_str(), false);
+    tt_ptr_op(t, ==, t2);
+    tt_ptr_op(t, !=, tc);
+
+    a = payload_store_acquire(t);
+    b = payload_store_acquire(t2);
+    c = payload_store_acquire(tc);
+    tt_ptr_op(a, ==, b);
+    tt_ptr_op(a, !=, c);
+    tt_int_op(a->payload_count, ==, 4);
+    tt_int_op(a->initTypePayload[HTTP_CONTENT_JAVASCRIPT], ==, 1);
+    tt_int_op(c->payload_count, ==, 4);
+    tt_int_op(c->initTypePayload[HTTP_CONTENT_JAVASCRIPT], ==, 0);
+
+    payload_store_release(a);
+    payload_store_release(b);
+    payload_store_release(c);
+    payload_store_close(t);
+    payload_store_close(t2);
+    payload_store_close(tc);
+  }
+
+ end:
+  remove_trace(fname);
+}
+
+static void
+test_payloads_reload(void *)
+{
+  std::string fname = make_trace(), trace;
+  tt_assert(!fname.empty());
+
+  {
+    payload_trace *t = payload_store_open(fname.c_str(), true);
+    const payloads *old, *cur, *cur2;
+    std::string newname;
+    FILE *f;
+
+    old = payload_store_acquire(t);
+    tt_int_op(old->payload_count, ==, 4);
+
+    // Rename a longer trace into place.  There are no crypto threads
+    // here, so the reload happens right away.
+    append_message(trace, TYPE_HTTP_RESPONSE, trace_html);
+    append_message(trace, TYPE_HTTP_RESPONSE, trace_js);
+    newname = write_trace(trace);
+    tt_assert(!newname.empty());
+    tt_assert(!rename(newname.c_str(), fname.c_str()));
+    payload_store_reload();
+
+    cur = payload_store_acquire(t);
+    tt_ptr_op(cur, !=, old);
+    tt_int_op(cur->payload_count, ==, 2);
+    tt_int_op(cur->info[0].content_type, ==, HTTP_CONTENT_HTML);
+
+    // the old generation is still intact for whoever holds it
+    tt_int_op(old->payload_count, ==, 4);
+    tt_str_op(old->payload_bufs[0], ==, trace_js);
+
+    // a loaded generation does not depend on the file any more, so
+    // even truncating it in place is harmless
+    f = fopen(fname.c_str(), "w");
+    tt_assert(f);
+    fclose(f);
+    tt_str_op(cur->payload_bufs[1], ==, trace_js);
+
+    // if the new trace cannot be read, the current one stays
+    tt_assert(!remove(fname.c_str()));
+    payload_store_reload();
+    cur2 = payload_store_acquire(t);
+    tt_ptr_op(cur2, ==, cur);
+
+    payload_store_release(old);
+    payload_store_release(cur);
+    payload_store_release(cur2);
+    payload_store_close(t);
+  }
+
+ end:
+  remove_trace(fname);
+}
+
+#define T(name) \
+  { #name, test_payloads_##name, 0, 0, 0 }
+
+struct testcase_t payloads_tests[] = {
+  T(index),
+  T(index_stale),
+  T(get_payload),
+  T(store),
+  T(reload),
+  END_OF_TESTCASES
+};
@@ -0,0 +1,316 @@
+/* Copyright 2012 the StegoTorus authors
+   See LICENSE for other credits and copying information
+*/
+
+#include "util.h"
+#include "unittest.h"
+#include "steg/peernames.h"
+
+#include <event2/dns.h>
+#include <event2/dns_struct.h>
+#include <event2/event.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+/* All the tests below use this test environment: a resolver whose
+   only nameserver is a fake one, in the same event loop, that answers
+   every query the way the test tells it to. */
+struct test_peernames_state
+{
+  struct event_base *base;
+  struct evdns_server_port *port;
+  struct evdns_base *dns;
+
+  int queries;     // received so far
+  int ttl;         // TTL to answer with
+  bool fail;       // answer NXDOMAIN instead
+  bool hold;       // don't answer at all
+  struct evdns_server_request *held[4];
+  int n_held;
+};
+
+// A cache whose clock only moves when the test moves it.
+class test_peer_name_cache : public peer_name_cache
+{
+public:
+  time_t t;
+  test_peer_name_cache(struct evdns_base *dns)
+    : peer_name_cache(dns), t(1000000) {}
+
+protected:
+  virtual time_t now() const { return t; }
+};
+
+static void
+fake_dns_cb(struct evdns_server_request *req, void *arg)
+{
+  struct test_peernames_state *s = (struct test_peernames_state *)arg;
+
+  s->queries++;
+  if (s->hold && s->n_held < (int)(sizeof s->held / sizeof s->held[0]))
+    s->held[s->n_held++] = req;
+  else if (s->fail)
+    evdns_server_request_respond(req, DNS_ERR_NOTEXIST);
+  else {
+    evdns_server_request_add_ptr_reply(req, NULL, req->questions[0]->name,
+                                       "peer.example.net", s->ttl);
+    evdns_server_request_respond(req, DNS_ERR_NONE);
+  }
+}
+
+/* Give the resolver and the fake nameserver time to talk. */
+static void
+settle(struct test_peernames_state *s)
+{
+  struct timeval tv = { 0, 100 * 1000 };
+  event_base_loopexit(s->base, &tv);
+  event_base_dispatch(s->base);
+}
+
+static int
+cleanup_peernames_state(const struct testcase_t *, void *data)
+{
+  struct test_peernames_state *s = (struct test_peernames_state *)data;
+
+  for (int i = 0; i < s->n_held; i++)
+    evdns_server_request_drop(s->held[i]);
+  if (s->dns)
+    evdns_base_free(s->dns, 0);
+  if (s->port)
+    evdns_close_server_port(s->port);
+  if (s->base)
+    event_base_free(s->base);
+  free(data);
+  return 1;
+}
+
+static void *
+setup_peernames_state(const struct testcase_t *)
+{
+  struct test_peernames_state *s =
+    (struct test_peernames_state *)xzalloc(sizeof(struct test_peernames_state));
+  struct sockaddr_in sin;
+  socklen_t slen = sizeof sin;
+  char ns[32];
+  evutil_socket_t fd;
+
+  s->ttl = 600;
+  s->base = event_base_new();
+  tt_assert(s->base);
+
+  memset(&sin, 0, sizeof sin);
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  tt_assert(fd >= 0);
+  if (bind(fd, (struct sockaddr *)&sin, sizeof sin) ||
+      getsockname(fd, (struct sockaddr *)&sin, &slen) ||
+      evutil_make_socket_nonblocking(fd)) {
+    close(fd);
+    tt_abort_perror("fake nameserver socket");
+  }
+  s->port = evdns_add_server_port_with_base(s->base, fd, 0, fake_dns_cb, s);
+  tt_assert(s->port);
+
+  s->dns = evdns_base_new(s->base, 0);
+  tt_assert(s->dns);
+  xsnprintf(ns, sizeof ns, "127.0.0.1:%d", ntohs(sin.sin_port));
+  tt_int_op(evdns_base_nameserver_ip_add(s->dns, ns), ==, 0);
+  return s;
+
+ end:
+  cleanup_peernames_state(NULL, s);
+  return NULL;
+}
+
+static const struct testcase_setup_t peernames_fixture =
+  { setup_peernames_state, cleanup_peernames_state };
+
+/* A miss gives the numeric address, without the port, and starts a
+   query whose answer serves the next lookup. */
+static void
+test_peernames_miss(void *data)
+{
+  struct test_peernames_state *s = (struct test_peernames_state *)data;
+  test_peer_name_cache *c = new test_peer_name_cache(s->dns);
+  char name[64];
+
+  c->lookup("10.1.2.3:4567", name, sizeof name);
+  tt_str_op(name, ==, "10.1.2.3");
+  c->lookup("[2001:db8::1]:80", name, sizeof name);
+  tt_str_op(name, ==, "[2001:db8::1]");
+
+  settle(s);
+  tt_int_op(s->queries, ==, 2);
+  c->lookup("10.1.2.3:8910", name, sizeof name);
+  tt_str_op(name, ==, "peer.example.net");
+  c->lookup("[2001:db8::1]:443", name, sizeof name);
+  tt_str_op(name, ==, "peer.example.net");
+  tt_int_op(s->queries, ==, 2);
+
+  // anything that isn't an address is passed through
+  c->lookup("not.an.address", name, sizeof name);
+  tt_str_op(name, ==, "not.an.address");
+  c->lookup(NULL, name, sizeof name);
+  tt_str_op(name, ==, "localhost");
+  tt_int_op(c->size(), ==, 2);
+
+ end:
+  delete c;
+  settle(s);
+}
+
+/* Whatever TTL the DNS gives, names are kept for at least a minute
+   and at most an hour. */
+static void
+test_peernames_ttl_clamp(void *data)
+{
+  struct test_peernames_state *s = (struct test_peernames_state *)data;
+  test_peer_name_cache *c = new test_peer_name_cache(s->dns);
+  char name[64];
+
+  s->ttl = 0;
+  c->lookup("10.1.2.3:4567", name, sizeof name);
+  settle(s);
+  tt_int_op(s->queries, ==, 1);
+
+  c->t += 59;
+  c->lookup("10.1.2.3:4567", name, sizeof name);
+  tt_str_op(name, ==, "peer.example.net");
+  settle(s);
+  tt_int_op(s->queries, ==, 1);
+
+  s->ttl = 86400;
+  c->t += 1;
+  c->lookup("10.1.2.3:4567", name, sizeof name);
+  tt_str_op(name, ==, "peer.example.net");
+  settle(s);
+  tt_int_op(s->queries, ==, 2);
+
+  c->t += 3599;
+  c->lookup("10.1.2.3:4567", name, sizeof name);
+  settle(s);
+  tt_int_op(s->queries, ==, 2);
+
+  c->t += 1;
+  c->lookup("10.1.2.3:4567", name, sizeof name);
+  settle(s);
+  tt_int_op(s->queries, ==, 3);
+
+ end:
+  delete c;
+  settle(s);
+}
+
+/* A failed query is remembered for a minute, during which the
+   numeric address is used without asking again. */
+static void
+test_peernames_negative(void *data)
+{
+  struct test_peernames_state *s = (struct test_peernames_state *)data;
+  test_peer_name_cache *c = new test_peer_name_cache(s->dns);
+  char name[64];
+
+  s->fail = true;
+  c->lookup("10.1.2.3:4567", name, sizeof name);
+  settle(s);
+  tt_int_op(s->queries, ==, 1);
+
+  c->t += 59;
+  c->lookup("10.1.2.3:4567", name, sizeof name);
+  tt_str_op(name, ==, "10.1.2.3");
+  settle(s);
+  tt_int_op(s->queries, ==, 1);
+
+  s->fail = false;
+  c->t += 1;
+  c->lookup("10.1.2.3:4567", name, sizeof name);
+  tt_str_op(name, ==, "10.1.2.3");
+  settle(s);
+  tt_int_op(s->queries, ==, 2);
+  c->lookup("10.1.2.3:4567", name, sizeof name);
+  tt_str_op(name, ==, "peer.example.net");
+
+ end:
+  delete c;
+  settle(s);
+}
+
+/* The cache holds at most 256 names.  When it is full, expired ones
+   are dropped to make room; if there are none, new peers just get
+   their numeric addresses. */
+static void
+test_peernames_purge(void *data)
+{
+  struct test_peernames_state *s = (struct test_peernames_state *)data;
+  test_peer_name_cache *c = new test_peer_name_cache(s->dns);
+  char peer[32], name[64];
+
+  s->fail = true;
+  for (int i = 0; i < 256; i++) {
+    xsnprintf(peer, sizeof peer, "10.0.%d.%d:80", i / 16, i % 16);
+    c->lookup(peer, name, sizeof name);
+  }
+  settle(s);
+  tt_int_op(s->queries, ==, 256);
+  tt_int_op(c->size(), ==, 256);
+
+  c->lookup("10.1.0.0:80", name, sizeof name);
+  tt_str_op(name, ==, "10.1.0.0");
+  tt_int_op(c->size(), ==, 256);
+  tt_int_op(s->queries, ==, 256);
+
+  // a peer already in the cache is still served from it
+  c->t += 30;
+  c->lookup("10.0.0.1:80", name, sizeof name);
+  tt_int_op(c->size(), ==, 256);
+
+  c->t += 30;
+  c->lookup("10.1.0.0:80", name, sizeof name);
+  tt_str_op(name, ==, "10.1.0.0");
+  tt_int_op(c->size(), ==, 1);
+  settle(s);
+  tt_int_op(s->queries, ==, 257);
+
+ end:
+  delete c;
+  settle(s);
+}
+
+/* Destroying the cache cancels its outstanding queries, whose
+   callbacks then clean up after themselves without touching it. */
+static void
+test_peernames_cancel(void *data)
+{
+  struct test_peernames_state *s = (struct test_peernames_state *)data;
+  test_peer_name_cache *c = new test_peer_name_cache(s->dns);
+  unsigned int before = peer_name_cache::queries_in_flight();
+  char name[64];
+
+  s->hold = true;
+  c->lookup("10.1.2.3:4567", name, sizeof name);
+  c->lookup("10.4.5.6:4567", name, sizeof name);
+  settle(s);
+  tt_int_op(s->queries, ==, 2);
+  tt_uint_op(peer_name_cache::queries_in_flight(), ==, before + 2);
+
+  delete c;
+  c = 0;
+  settle(s);
+  tt_uint_op(peer_name_cache::queries_in_flight(), ==, before);
+
+ end:
+  delete c;
+}
+
+#define T(name) \
+  { #name, test_peernames_##name, 0, &peernames_fixture, NULL }
+
+struct testcase_t peernames_tests[] = {
+  T(miss),
+  T(ttl_clamp),
+  T(negative),
+  T(purge),
+  T(cancel),
+  END_OF_TESTCASES
+};